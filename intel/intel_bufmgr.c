@@ -137,6 +137,42 @@ drm_intel_bo_get_subdata(drm_intel_bo *bo, unsigned long offset,
 	return 0;
 }
 
+drm_public int
+drm_intel_bo_subdatav(drm_intel_bo *bo,
+		      const struct drm_intel_bo_range *ranges, int count)
+{
+	int i, ret;
+
+	if (bo->bufmgr->bo_subdatav)
+		return bo->bufmgr->bo_subdatav(bo, ranges, count);
+
+	for (i = 0; i < count; i++) {
+		ret = drm_intel_bo_subdata(bo, ranges[i].offset,
+					   ranges[i].size, ranges[i].data);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+drm_public int
+drm_intel_bo_get_subdatav(drm_intel_bo *bo,
+			  const struct drm_intel_bo_range *ranges, int count)
+{
+	int i, ret;
+
+	if (bo->bufmgr->bo_get_subdatav)
+		return bo->bufmgr->bo_get_subdatav(bo, ranges, count);
+
+	for (i = 0; i < count; i++) {
+		ret = drm_intel_bo_get_subdata(bo, ranges[i].offset,
+					       ranges[i].size, ranges[i].data);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 drm_public void
 drm_intel_bo_wait_rendering(drm_intel_bo *bo)
 {
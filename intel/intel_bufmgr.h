@@ -43,6 +43,20 @@ struct drm_clip_rect;
 typedef struct _drm_intel_bufmgr drm_intel_bufmgr;
 typedef struct _drm_intel_context drm_intel_context;
 typedef struct _drm_intel_bo drm_intel_bo;
+typedef struct _drm_intel_stream drm_intel_stream;
+
+/**
+ * One range of a vectored drm_intel_bo_subdatav() or
+ * drm_intel_bo_get_subdatav() transfer, in the spirit of struct iovec.
+ */
+struct drm_intel_bo_range {
+	/** Byte offset of the range within the buffer object */
+	unsigned long offset;
+	/** Length of the range in bytes */
+	unsigned long size;
+	/** Client memory to copy from (subdatav) or into (get_subdatav) */
+	void *data;
+};
 
 struct _drm_intel_bo {
 	/**
@@ -133,6 +147,11 @@ int drm_intel_bo_subdata(drm_intel_bo *bo, unsigned long offset,
 			 unsigned long size, const void *data);
 int drm_intel_bo_get_subdata(drm_intel_bo *bo, unsigned long offset,
 			     unsigned long size, void *data);
+int drm_intel_bo_subdatav(drm_intel_bo *bo,
+			  const struct drm_intel_bo_range *ranges, int count);
+int drm_intel_bo_get_subdatav(drm_intel_bo *bo,
+			      const struct drm_intel_bo_range *ranges,
+			      int count);
 void drm_intel_bo_wait_rendering(drm_intel_bo *bo);
 
 void drm_intel_bufmgr_set_debug(drm_intel_bufmgr *bufmgr, int enable_debug);
@@ -170,14 +189,95 @@ drm_intel_bufmgr *drm_intel_bufmgr_gem_init(int fd, int batch_size);
 drm_intel_bo *drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 						const char *name,
 						unsigned int handle);
+drm_intel_bo *drm_intel_bo_gem_userptr_get(drm_intel_bufmgr *bufmgr,
+					  const char *name, void *addr,
+					  unsigned long size,
+					  unsigned long flags,
+					  uint32_t *offset);
+int drm_intel_bufmgr_gem_userptr_register(drm_intel_bufmgr *bufmgr,
+					  void *addr, unsigned long size,
+					  unsigned long flags);
+void drm_intel_bufmgr_gem_userptr_invalidate(drm_intel_bufmgr *bufmgr,
+					     void *addr, unsigned long size);
 void drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr,
 					     int limit);
+void drm_intel_bufmgr_gem_set_vma_cache_bytes(drm_intel_bufmgr *bufmgr,
+					      long limit);
+void drm_intel_bufmgr_gem_get_vma_cache_stats(drm_intel_bufmgr *bufmgr,
+					      uint64_t *hits,
+					      uint64_t *misses,
+					      unsigned long *cached_bytes);
+
+/** Events reported through drm_intel_bufmgr_gem_set_trace_callback() */
+enum drm_intel_gem_trace_event {
+	/** A BO was allocated; value is its size */
+	DRM_INTEL_GEM_TRACE_ALLOC,
+	/** An allocation was served from the BO cache; value is the size */
+	DRM_INTEL_GEM_TRACE_CACHE_HIT,
+	/** An allocation had to create a new BO; value is the size */
+	DRM_INTEL_GEM_TRACE_CACHE_MISS,
+	/** A cached BO was dropped after the kernel purged it */
+	DRM_INTEL_GEM_TRACE_PURGE,
+	/** A batch was submitted; value is the number of relocations */
+	DRM_INTEL_GEM_TRACE_EXEC,
+	/** A wait for rendering finished; value is the time in ns */
+	DRM_INTEL_GEM_TRACE_WAIT_RENDERING,
+	/**
+	 * A map moved a BO to the CPU or GTT domain, which waits for the GPU
+	 * if it still uses the BO; value is the time in ns
+	 */
+	DRM_INTEL_GEM_TRACE_MAP_SYNC,
+};
+
+typedef void (*drm_intel_gem_trace_func)(void *data,
+					 enum drm_intel_gem_trace_event event,
+					 drm_intel_bo *bo, uint64_t value);
+
+/** Counters returned by drm_intel_bufmgr_gem_get_stats() */
+struct drm_intel_gem_stats {
+	uint64_t allocs;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cached_bytes;
+	uint64_t purged;
+	uint64_t set_tiling_avoided;
+	uint64_t set_tiling_needed;
+	uint64_t execs;
+	uint64_t relocs;
+	uint64_t waits;
+	uint64_t wait_ns;
+	uint64_t map_syncs;
+	uint64_t map_sync_ns;
+	uint64_t vma_hits;
+	uint64_t vma_misses;
+};
+
+void drm_intel_bufmgr_gem_enable_stats(drm_intel_bufmgr *bufmgr, int enable);
+void drm_intel_bufmgr_gem_set_trace_callback(drm_intel_bufmgr *bufmgr,
+					     drm_intel_gem_trace_func func,
+					     void *data);
+void drm_intel_bufmgr_gem_get_stats(drm_intel_bufmgr *bufmgr,
+				    struct drm_intel_gem_stats *stats);
+int drm_intel_bufmgr_gem_get_bucket_stats(drm_intel_bufmgr *bufmgr,
+					  int bucket, unsigned long *size,
+					  uint64_t *hits, uint64_t *misses,
+					  unsigned long *cached_bytes);
+void drm_intel_bufmgr_gem_dump_stats(drm_intel_bufmgr *bufmgr, FILE *file);
 int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo);
 int drm_intel_gem_bo_map_gtt(drm_intel_bo *bo);
 int drm_intel_gem_bo_unmap_gtt(drm_intel_bo *bo);
 
+drm_intel_stream *drm_intel_gem_stream_create(drm_intel_bufmgr *bufmgr,
+					      const char *name,
+					      unsigned long block_size,
+					      int max_blocks);
+void drm_intel_gem_stream_destroy(drm_intel_stream *stream);
+int drm_intel_gem_stream_alloc(drm_intel_stream *stream, unsigned long size,
+			       unsigned int alignment, drm_intel_bo **bo,
+			       uint32_t *offset, void **ptr);
+
 int drm_intel_gem_bo_get_reloc_count(drm_intel_bo *bo);
 void drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start);
 void drm_intel_gem_bo_start_gtt_access(drm_intel_bo *bo, int write_enable);
@@ -206,6 +306,21 @@ void drm_intel_gem_context_destroy(drm_intel_context *ctx);
 int drm_intel_gem_bo_context_exec(drm_intel_bo *bo, drm_intel_context *ctx,
 				  int used, unsigned int flags);
 
+/** One batch of a drm_intel_gem_bo_exec_batches() submission */
+struct drm_intel_gem_exec_batch {
+	drm_intel_bo *bo;
+	/** Bytes of the batch to execute */
+	int used;
+	/** Hardware context, or NULL for the default context */
+	drm_intel_context *ctx;
+	/** Ring selection and other I915_EXEC_* flags */
+	unsigned int flags;
+};
+
+int
+drm_intel_gem_bo_exec_batches(const struct drm_intel_gem_exec_batch *batches,
+			      int count, int *failed);
+
 int drm_intel_bo_gem_export_to_prime(drm_intel_bo *bo, int *prime_fd);
 drm_intel_bo *drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr,
 						int prime_fd, int size);
@@ -243,6 +358,22 @@ void drm_intel_bo_fake_disable_backing_store(drm_intel_bo *bo,
 void drm_intel_bufmgr_fake_contended_lock_take(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_fake_evict_all(drm_intel_bufmgr *bufmgr);
 
+enum drm_intel_decode_format {
+	DRM_INTEL_DECODE_FORMAT_TEXT = 0,
+	DRM_INTEL_DECODE_FORMAT_BINARY,
+	DRM_INTEL_DECODE_FORMAT_JSON,
+};
+
+/**
+ * Per-packet record written by DRM_INTEL_DECODE_FORMAT_BINARY, in host
+ * byte order.
+ */
+struct drm_intel_decode_record {
+	uint32_t hw_offset;	/**< GPU address of the packet */
+	uint32_t header;	/**< first DWORD of the packet */
+	uint32_t length;	/**< packet length in DWORDs */
+};
+
 struct drm_intel_decode *drm_intel_decode_context_alloc(uint32_t devid);
 void drm_intel_decode_context_free(struct drm_intel_decode *ctx);
 void drm_intel_decode_set_batch_pointer(struct drm_intel_decode *ctx,
@@ -253,6 +384,8 @@ void drm_intel_decode_set_dump_past_end(struct drm_intel_decode *ctx,
 void drm_intel_decode_set_head_tail(struct drm_intel_decode *ctx,
 				    uint32_t head, uint32_t tail);
 void drm_intel_decode_set_output_file(struct drm_intel_decode *ctx, FILE *out);
+int drm_intel_decode_set_output_format(struct drm_intel_decode *ctx,
+				       enum drm_intel_decode_format format);
 void drm_intel_decode(struct drm_intel_decode *ctx);
 
 int drm_intel_reg_read(drm_intel_bufmgr *bufmgr,
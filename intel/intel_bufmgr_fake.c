@@ -150,6 +150,12 @@ typedef struct _bufmgr_fake {
 	unsigned need_fence:1;
 	int thrashing;
 
+	/** @{ Eviction statistics, reported through DBG. */
+	unsigned int evict_plans;
+	unsigned int evict_stalls;
+	unsigned long evict_bytes;
+	/** @} */
+
 	/**
 	 * Driver callback to emit a fence, returning the cookie.
 	 *
@@ -658,6 +664,247 @@ fence_blocks(drm_intel_bufmgr_fake *bufmgr_fake, unsigned fence)
 	assert(DRMLISTEMPTY(&bufmgr_fake->on_hardware));
 }
 
+/** Cost, in bytes copied, charged for waiting on a fence. */
+#define EVICT_FENCE_COST		(256 * 1024)
+/** Additional cost per fence sequence number still outstanding. */
+#define EVICT_FENCE_AGE_COST		(64 * 1024)
+/**
+ * Cost multiplier for blocks without backing store, whose contents the
+ * driver has to regenerate after the invalidate callback.
+ */
+#define EVICT_NO_BACKING_STORE_SCALE	4
+
+/**
+ * A run of aperture space considered by the eviction planner: either a
+ * free hole or an allocated block.
+ */
+struct evict_segment {
+	int ofs, size;
+	/** Estimated cost of freeing this segment, or -1 if it can't be. */
+	long cost;
+	/** Block holding the segment, NULL if the space is free. */
+	struct block *block;
+	/** Buffer in block, which outlives the block across a fence wait. */
+	drm_intel_bo *bo;
+};
+
+static int
+evict_segment_compare(const void *a, const void *b)
+{
+	const struct evict_segment *seg_a = a;
+	const struct evict_segment *seg_b = b;
+
+	return seg_a->block->mem->ofs - seg_b->block->mem->ofs;
+}
+
+/**
+ * Returns the estimated cost of evicting block, which is lru_rank'th of
+ * lru_count on the LRU list (or not on it if lru_count is 0), or -1 if
+ * the block can't be evicted.
+ *
+ * Evicting costs the re-upload of the contents the next time the buffer
+ * is used, which is more likely the more recently it was used, plus the
+ * copy back to backing store if the card wrote to it.  Blocks whose
+ * fence hasn't passed also cost a stall, more so the newer the fence.
+ */
+static long
+evict_block_cost(drm_intel_bufmgr_fake *bufmgr_fake, struct block *block,
+		 int lru_rank, int lru_count)
+{
+	drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
+	long size = block->mem->size;
+	long cost = 0;
+
+	if (block->on_hardware)
+		return -1;
+
+	if (block->fenced && !_fence_test(bufmgr_fake, block->fence)) {
+		cost += EVICT_FENCE_COST;
+		cost += (long)((block->fence - bufmgr_fake->last_fence) &
+			       MAXFENCE) * EVICT_FENCE_AGE_COST;
+	}
+
+	/* Already freed, just waiting on its fence. */
+	if (bo_fake == NULL)
+		return cost;
+
+	if (bo_fake->flags & BM_NO_FENCE_SUBDATA)
+		return -1;
+
+	if (bo_fake->flags & BM_NO_BACKING_STORE) {
+		cost += size * EVICT_NO_BACKING_STORE_SCALE;
+	} else {
+		if (lru_count)
+			cost += size + size * lru_rank / lru_count;
+		else
+			cost += size * 2;
+		if (bo_fake->card_dirty)
+			cost += size;
+	}
+
+	return cost;
+}
+
+/**
+ * Looks for the cheapest contiguous run of free space and evictable
+ * blocks that can hold bo, and evicts it.
+ *
+ * Unlike evicting from the LRU list until an allocation succeeds, this
+ * only evicts blocks that end up next to each other, and only waits for
+ * a fence when no cheaper run is available without one.
+ *
+ * Returns 1 if space was freed up for bo.
+ */
+static int
+evict_planned(drm_intel_bo *bo)
+{
+	drm_intel_bufmgr_fake *bufmgr_fake =
+	    (drm_intel_bufmgr_fake *) bo->bufmgr;
+	drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) bo;
+	struct mem_block *heap = bufmgr_fake->heap;
+	struct evict_segment *blocks, *segs;
+	struct block *block;
+	struct mem_block *mem;
+	int nblocks = 0, nsegs = 0, lru_count = 0, lru_rank = 0;
+	int i, j, first, best_first = -1, best_last = -1;
+	int size, align = bo_fake->alignment;
+	long cost, best_cost = -1;
+	unsigned int wait_fence = 0;
+
+	size = (bo->size + align - 1) & ~(align - 1);
+
+	DRMLISTFOREACH(block, &bufmgr_fake->lru)
+		lru_count++;
+	DRMLISTFOREACH(block, &bufmgr_fake->fenced)
+		nblocks++;
+	DRMLISTFOREACH(block, &bufmgr_fake->on_hardware)
+		nblocks++;
+	nblocks += lru_count;
+
+	/* Every allocated block is separated by at most one free hole. */
+	blocks = malloc((3 * nblocks + 1) * sizeof(*blocks));
+	if (blocks == NULL)
+		return 0;
+	segs = blocks + nblocks;
+
+	/* Price every block, then walk the heap in address order to
+	 * interleave them with the free holes.
+	 */
+	i = 0;
+	DRMLISTFOREACH(block, &bufmgr_fake->lru) {
+		blocks[i].cost = evict_block_cost(bufmgr_fake, block,
+						  lru_rank++, lru_count);
+		blocks[i++].block = block;
+	}
+	DRMLISTFOREACH(block, &bufmgr_fake->fenced) {
+		blocks[i].cost = evict_block_cost(bufmgr_fake, block, 0, 0);
+		blocks[i++].block = block;
+	}
+	DRMLISTFOREACH(block, &bufmgr_fake->on_hardware) {
+		blocks[i].cost = -1;
+		blocks[i++].block = block;
+	}
+	qsort(blocks, nblocks, sizeof(*blocks), evict_segment_compare);
+
+	j = 0;
+	for (mem = heap->next; mem != heap; mem = mem->next) {
+		struct evict_segment *seg = &segs[nsegs++];
+
+		if (mem->free) {
+			seg->cost = 0;
+			seg->block = NULL;
+		} else {
+			assert(j < nblocks && blocks[j].block->mem == mem);
+			*seg = blocks[j++];
+		}
+		seg->ofs = mem->ofs;
+		seg->size = mem->size;
+		seg->bo = seg->block ? seg->block->bo : NULL;
+	}
+
+	/* Find the cheapest window of segments [first, i] that can hold
+	 * the aligned allocation.  Costs are non-negative, so for each end
+	 * only the shortest window that still fits needs to be priced.
+	 */
+	first = 0;
+	cost = 0;
+	for (i = 0; i < nsegs; i++) {
+		if (segs[i].cost < 0) {
+			first = i + 1;
+			cost = 0;
+			continue;
+		}
+		cost += segs[i].cost;
+
+		while (first <= i) {
+			int start = (segs[first].ofs + align - 1) & ~(align - 1);
+			int end = segs[i].ofs + segs[i].size;
+
+			if (end - start < size)
+				break;
+
+			if (best_cost < 0 || cost < best_cost) {
+				best_cost = cost;
+				best_first = first;
+				best_last = i;
+			}
+
+			cost -= segs[first].cost;
+			first++;
+		}
+	}
+
+	if (best_cost < 0) {
+		free(blocks);
+		return 0;
+	}
+
+	DBG("%s: evicting 0x%x-0x%x, cost %ld\n", __FUNCTION__,
+	    segs[best_first].ofs,
+	    segs[best_last].ofs + segs[best_last].size, best_cost);
+
+	/* One wait covers every fenced block in the window, after which
+	 * they are back on the LRU list or freed.
+	 */
+	for (i = best_first; i <= best_last; i++) {
+		block = segs[i].block;
+		if (block && block->fenced &&
+		    !_fence_test(bufmgr_fake, block->fence) &&
+		    (wait_fence == 0 || FENCE_LTE(wait_fence, block->fence)))
+			wait_fence = block->fence;
+	}
+
+	bufmgr_fake->evict_plans++;
+	if (wait_fence) {
+		bufmgr_fake->evict_stalls++;
+		_fence_wait_internal(bufmgr_fake, wait_fence);
+	} else {
+		clear_fenced(bufmgr_fake, bufmgr_fake->last_fence);
+	}
+
+	for (i = best_first; i <= best_last; i++) {
+		drm_intel_bo_fake *evict_fake = (drm_intel_bo_fake *) segs[i].bo;
+
+		if (evict_fake == NULL || evict_fake->block == NULL)
+			continue;
+
+		block = evict_fake->block;
+		assert(!block->fenced && !block->on_hardware);
+
+		bufmgr_fake->evict_bytes += block->mem->size;
+		set_dirty(segs[i].bo);
+		evict_fake->block = NULL;
+		free_block(bufmgr_fake, block, 0);
+	}
+
+	DBG("%s: %u plans, %u stalls, %lu bytes evicted\n", __FUNCTION__,
+	    bufmgr_fake->evict_plans, bufmgr_fake->evict_stalls,
+	    bufmgr_fake->evict_bytes);
+
+	free(blocks);
+	return 1;
+}
+
 static int
 evict_and_alloc_block(drm_intel_bo *bo)
 {
@@ -672,6 +919,11 @@ evict_and_alloc_block(drm_intel_bo *bo)
 	if (alloc_block(bo))
 		return 1;
 
+	/* Evict the cheapest contiguous range that can hold the buffer:
+	 */
+	if (evict_planned(bo) && alloc_block(bo))
+		return 1;
+
 	/* If we're not thrashing, allow lru eviction to dig deeper into
 	 * recently used textures.  We'll probably be thrashing soon:
 	 */
@@ -1203,11 +1455,12 @@ static int
 
 		assert(!(bo_fake->flags & (BM_NO_BACKING_STORE | BM_PINNED)));
 
-		/* Actually, should be able to just wait for a fence on the
-		 * mmory, hich we would be tracking when we free it.  Waiting
-		 * for idle is a sufficiently large hammer for now.
+		/* Freed card memory only goes back to the heap once its
+		 * fence has passed, so a freshly allocated block is idle.
+		 * Only a block we already held may still be read by the
+		 * hardware; wait for its own fence rather than for idle.
 		 */
-		drm_intel_bufmgr_fake_wait_idle(bufmgr_fake);
+		drm_intel_fake_bo_wait_rendering_locked(bo);
 
 		/* we may never have mapped this BO so it might not have any
 		 * backing store if this happens it should be rare, but 0 the
@@ -47,9 +47,11 @@
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <stdbool.h>
 
 #include "errno.h"
@@ -85,11 +87,32 @@
 
 typedef struct _drm_intel_bo_gem drm_intel_bo_gem;
 
+/** Number of (tiling mode, stride) sub-lists in each BO cache bucket */
+#define BO_CACHE_TILING_LISTS 7
+
 struct drm_intel_gem_bo_bucket {
+	/** All cached BOs of this size, oldest first */
 	drmMMListHead head;
+	/** The same BOs hashed by tiling mode and stride, oldest first */
+	drmMMListHead tiling[BO_CACHE_TILING_LISTS];
 	unsigned long size;
+	unsigned long num_cached;
+	uint64_t hits, misses;
 };
 
+/**
+ * Number of size classes in the vma cache.  Mappings up to 64KiB share the
+ * first class, each following class doubles, and the last one holds
+ * everything from 8MiB up.
+ */
+#define VMA_CACHE_BUCKETS 9
+
+/**
+ * Default for bufmgr_gem->subdata_crossover, overridable through the
+ * INTEL_SUBDATA_CROSSOVER environment variable.
+ */
+#define SUBDATA_CROSSOVER_DEFAULT (16 * 1024)
+
 typedef struct _drm_intel_bufmgr_gem {
 	drm_intel_bufmgr bufmgr;
 
@@ -115,8 +138,21 @@ typedef struct _drm_intel_bufmgr_gem {
 	drmMMListHead managers;
 
 	drmMMListHead named;
-	drmMMListHead vma_cache;
+	/** LRU lists of idle mappings, one per size class */
+	drmMMListHead vma_cache[VMA_CACHE_BUCKETS];
 	int vma_count, vma_open, vma_max;
+	unsigned long vma_bytes;
+	long vma_bytes_max;
+
+	/**
+	 * Average range size below which vectored subdata goes through a
+	 * mapping instead of one pwrite/pread per range.
+	 */
+	unsigned long subdata_crossover;
+	unsigned int vma_tick;
+
+	drmMMListHead userptr_pool;
+	drmMMListHead userptr_arenas;
 
 	uint64_t gtt_size;
 	int available_fences;
@@ -132,9 +168,39 @@ typedef struct _drm_intel_bufmgr_gem {
 	unsigned int has_vebox : 1;
 	bool fenced_relocs;
 
+	/** Sequence number of the last successful submission */
+	uint32_t exec_seqno;
+	/** Serial of the last context created, the default context being 0 */
+	uint32_t ctx_serial;
+	/**
+	 * Per ring, the newest submission known to have completed and the
+	 * serial of the context it ran in.  Only the batches of one context
+	 * on one ring are known to complete in order; the kernel's scheduler
+	 * may reorder batches of different contexts.  So a buffer whose last
+	 * use was in that context on that ring, and no newer than this, is
+	 * idle.
+	 *
+	 * Updated both with and without the bufmgr lock held, so it has its
+	 * own lock, which is never held while taking another.
+	 */
+	pthread_mutex_t retired_lock;
+	uint32_t retired_seqno[I915_EXEC_RING_MASK + 1];
+	uint32_t retired_ctx[I915_EXEC_RING_MASK + 1];
+
+	/** Counters for drm_intel_bufmgr_gem_get_stats(), under lock */
+	struct drm_intel_gem_stats stats;
+	/** Whether waits and map syncs are timed */
+	bool stats_enabled;
+	/** Whether the stats are dumped to stderr on destroy */
+	bool stats_dump;
+	drm_intel_gem_trace_func trace_func;
+	void *trace_data;
+
 	char *aub_filename;
-	FILE *aub_file;
+	struct drm_intel_aub_writer *aub_writer;
 	uint32_t aub_offset;
+	/** Hash of the AUB address assignment of the last exec */
+	uint64_t aub_layout_hash;
 } drm_intel_bufmgr_gem;
 
 #define DRM_INTEL_RELOC_FENCE (1<<0)
@@ -193,9 +259,13 @@ struct _drm_intel_bo_gem {
 	void *user_virtual;
 	int map_count;
 	drmMMListHead vma_list;
+	/** bufmgr_gem->vma_tick when the mappings last became idle */
+	unsigned int vma_tick;
 
 	/** BO cache list */
 	drmMMListHead head;
+	/** BO cache sub-list for this BO's tiling mode and stride */
+	drmMMListHead tiling_list;
 
 	/**
 	 * Boolean of whether this BO and its children have been included in
@@ -229,6 +299,24 @@ struct _drm_intel_bo_gem {
 	 */
 	bool idle;
 
+	/**
+	 * bufmgr_gem->exec_seqno of the last successful submission using this
+	 * buffer, or 0 if it was never submitted, and the ring and context
+	 * serial it went to.
+	 *
+	 * Like idle, only trusted by drm_intel_gem_bo_busy() for reusable
+	 * buffers.
+	 */
+	uint32_t exec_seqno;
+	unsigned int exec_ring;
+	uint32_t exec_ctx;
+	/**
+	 * Whether the buffer went to more than one context or ring since it
+	 * was last known to be idle.  The watermark of exec_ring then says
+	 * nothing about the other batches, so only the kernel knows.
+	 */
+	bool exec_mixed;
+
 	/**
 	 * Boolean of whether this buffer was allocated with userptr
 	 */
@@ -252,6 +340,9 @@ struct _drm_intel_bo_gem {
 	bool mapped_cpu_write;
 
 	uint32_t aub_offset;
+	/** Hash of the contents last written to the AUB file */
+	uint64_t aub_hash;
+	bool aub_hash_valid;
 
 	drm_intel_aub_annotation *aub_annotations;
 	unsigned aub_annotation_count;
@@ -279,6 +370,9 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo);
 
 static void drm_intel_gem_bo_free(drm_intel_bo *bo);
 
+static void aub_writer_destroy(struct drm_intel_aub_writer *writer,
+			       int error);
+
 static unsigned long
 drm_intel_gem_bo_tile_size(drm_intel_bufmgr_gem *bufmgr_gem, unsigned long size,
 			   uint32_t *tiling_mode)
@@ -361,6 +455,31 @@ drm_intel_gem_bo_tile_pitch(drm_intel_bufmgr_gem *bufmgr_gem,
 	return i;
 }
 
+static uint64_t
+drm_intel_gem_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Waits and map syncs are only timed when somebody is listening */
+static inline bool
+drm_intel_gem_timing(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	return bufmgr_gem->stats_enabled || bufmgr_gem->trace_func != NULL;
+}
+
+static inline void
+drm_intel_gem_trace(drm_intel_bufmgr_gem *bufmgr_gem,
+		    enum drm_intel_gem_trace_event event,
+		    drm_intel_bo *bo, uint64_t value)
+{
+	if (bufmgr_gem->trace_func)
+		bufmgr_gem->trace_func(bufmgr_gem->trace_data, event, bo, value);
+}
+
 static struct drm_intel_gem_bo_bucket *
 drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 				 unsigned long size)
@@ -378,6 +497,39 @@ drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 	return NULL;
 }
 
+static drmMMListHead *
+drm_intel_gem_bo_bucket_tiling_list(struct drm_intel_gem_bo_bucket *bucket,
+				    uint32_t tiling_mode, unsigned long stride)
+{
+	return &bucket->tiling[((stride >> 6) + tiling_mode) %
+			       BO_CACHE_TILING_LISTS];
+}
+
+static void
+drm_intel_gem_bo_cache_add(drm_intel_bufmgr_gem *bufmgr_gem,
+			   struct drm_intel_gem_bo_bucket *bucket,
+			   drm_intel_bo_gem *bo_gem)
+{
+	DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+	DRMLISTADDTAIL(&bo_gem->tiling_list,
+		       drm_intel_gem_bo_bucket_tiling_list(bucket,
+							   bo_gem->tiling_mode,
+							   bo_gem->stride));
+	bucket->num_cached++;
+	bufmgr_gem->stats.cached_bytes += bucket->size;
+}
+
+static void
+drm_intel_gem_bo_cache_remove(drm_intel_bufmgr_gem *bufmgr_gem,
+			      struct drm_intel_gem_bo_bucket *bucket,
+			      drm_intel_bo_gem *bo_gem)
+{
+	DRMLISTDEL(&bo_gem->head);
+	DRMLISTDEL(&bo_gem->tiling_list);
+	bucket->num_cached--;
+	bufmgr_gem->stats.cached_bytes -= bucket->size;
+}
+
 static void
 drm_intel_gem_dump_validation_list(drm_intel_bufmgr_gem *bufmgr_gem)
 {
@@ -582,6 +734,107 @@ drm_intel_setup_reloc_list(drm_intel_bo *bo)
 	return 0;
 }
 
+static inline bool
+exec_seqno_passed(uint32_t seqno, uint32_t retired)
+{
+	return (int32_t)(seqno - retired) <= 0;
+}
+
+static unsigned int
+exec_ring_index(unsigned int flags)
+{
+	unsigned int ring = flags & I915_EXEC_RING_MASK;
+
+	return ring == I915_EXEC_DEFAULT ? I915_EXEC_RENDER : ring;
+}
+
+/* Allocates the sequence number for a submission that succeeded */
+static uint32_t
+drm_intel_gem_next_exec_seqno(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	if (++bufmgr_gem->exec_seqno == 0)
+		bufmgr_gem->exec_seqno = 1;
+
+	return bufmgr_gem->exec_seqno;
+}
+
+/**
+ * Returns whether the last submission using the buffer is known to have
+ * completed because a later one in the same context on the same ring has.
+ */
+static bool
+drm_intel_gem_bo_retired(drm_intel_bufmgr_gem *bufmgr_gem,
+			 drm_intel_bo_gem *bo_gem)
+{
+	unsigned int ring = bo_gem->exec_ring;
+	bool retired;
+
+	if (bo_gem->exec_mixed)
+		return false;
+
+	pthread_mutex_lock(&bufmgr_gem->retired_lock);
+	retired = bufmgr_gem->retired_ctx[ring] == bo_gem->exec_ctx &&
+		  exec_seqno_passed(bo_gem->exec_seqno,
+				    bufmgr_gem->retired_seqno[ring]);
+	pthread_mutex_unlock(&bufmgr_gem->retired_lock);
+
+	return retired;
+}
+
+/**
+ * Records that every submission using the buffer has completed, and with
+ * it every earlier submission in the same context on the same ring.
+ *
+ * A watermark of another context is simply replaced; that only costs
+ * BUSY ioctls for the buffers last used in that context.
+ */
+static void
+drm_intel_gem_bo_mark_idle(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo_gem *bo_gem)
+{
+	unsigned int ring = bo_gem->exec_ring;
+
+	bo_gem->idle = true;
+	bo_gem->exec_mixed = false;
+	if (!bo_gem->reusable || bo_gem->exec_seqno == 0)
+		return;
+
+	pthread_mutex_lock(&bufmgr_gem->retired_lock);
+	if (bufmgr_gem->retired_ctx[ring] != bo_gem->exec_ctx ||
+	    !exec_seqno_passed(bo_gem->exec_seqno,
+			       bufmgr_gem->retired_seqno[ring])) {
+		bufmgr_gem->retired_ctx[ring] = bo_gem->exec_ctx;
+		bufmgr_gem->retired_seqno[ring] = bo_gem->exec_seqno;
+	}
+	pthread_mutex_unlock(&bufmgr_gem->retired_lock);
+}
+
+/**
+ * Records that the buffer was part of a submission, with seqno 0 if the
+ * submission failed.
+ */
+static void
+drm_intel_gem_bo_mark_exec(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo_gem *bo_gem, uint32_t seqno,
+			   unsigned int ring, uint32_t ctx)
+{
+	bool was_idle;
+
+	was_idle = bo_gem->idle || bo_gem->exec_seqno == 0 ||
+		   drm_intel_gem_bo_retired(bufmgr_gem, bo_gem);
+
+	bo_gem->idle = false;
+	if (seqno == 0)
+		return;
+
+	bo_gem->exec_mixed = !was_idle &&
+		(bo_gem->exec_mixed || bo_gem->exec_ring != ring ||
+		 bo_gem->exec_ctx != ctx);
+	bo_gem->exec_seqno = seqno;
+	bo_gem->exec_ring = ring;
+	bo_gem->exec_ctx = ctx;
+}
+
 static int
 drm_intel_gem_bo_busy(drm_intel_bo *bo)
 {
@@ -590,15 +843,25 @@ drm_intel_gem_bo_busy(drm_intel_bo *bo)
 	struct drm_i915_gem_busy busy;
 	int ret;
 
-	if (bo_gem->reusable && bo_gem->idle)
-		return false;
+	if (bo_gem->reusable) {
+		if (bo_gem->idle)
+			return false;
+
+		/* Never submitted, or submitted before a completed batch */
+		if (bo_gem->exec_seqno == 0 ||
+		    drm_intel_gem_bo_retired(bufmgr_gem, bo_gem)) {
+			bo_gem->idle = true;
+			return false;
+		}
+	}
 
 	VG_CLEAR(busy);
 	busy.handle = bo_gem->gem_handle;
 
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_BUSY, &busy);
 	if (ret == 0) {
-		bo_gem->idle = !busy.busy;
+		if (!busy.busy)
+			drm_intel_gem_bo_mark_idle(bufmgr_gem, bo_gem);
 		return busy.busy;
 	} else {
 		return false;
@@ -644,11 +907,49 @@ drm_intel_gem_bo_cache_purge_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
 		    (bufmgr_gem, bo_gem, I915_MADV_DONTNEED))
 			break;
 
-		DRMLISTDEL(&bo_gem->head);
+		drm_intel_gem_bo_cache_remove(bufmgr_gem, bucket, bo_gem);
+		bufmgr_gem->stats.purged++;
+		drm_intel_gem_trace(bufmgr_gem, DRM_INTEL_GEM_TRACE_PURGE,
+				    &bo_gem->bo, bo_gem->bo.size);
 		drm_intel_gem_bo_free(&bo_gem->bo);
 	}
 }
 
+/**
+ * Looks for a cached BO that already has the requested tiling mode and
+ * stride, so that reusing it needs no SET_TILING ioctl.
+ *
+ * Follows the same policy as the generic path: render targets take the
+ * most recently freed match, anything else takes the oldest match only if
+ * it is idle.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_cache_find_tiled(struct drm_intel_gem_bo_bucket *bucket,
+				  uint32_t tiling_mode, unsigned long stride,
+				  bool for_render)
+{
+	drmMMListHead *list, *item;
+
+	list = drm_intel_gem_bo_bucket_tiling_list(bucket, tiling_mode, stride);
+	for (item = for_render ? list->prev : list->next;
+	     item != list;
+	     item = for_render ? item->prev : item->next) {
+		drm_intel_bo_gem *bo_gem;
+
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, item, tiling_list);
+		if (bo_gem->tiling_mode != tiling_mode ||
+		    bo_gem->stride != stride)
+			continue;
+
+		if (!for_render && drm_intel_gem_bo_busy(&bo_gem->bo))
+			return NULL;
+
+		return bo_gem;
+	}
+
+	return NULL;
+}
+
 static drm_intel_bo *
 drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 				const char *name,
@@ -663,6 +964,7 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 	int ret;
 	struct drm_intel_gem_bo_bucket *bucket;
 	bool alloc_from_cache;
+	bool head_tiled = false;
 	unsigned long bo_size;
 	bool for_render = false;
 
@@ -688,14 +990,30 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 retry:
 	alloc_from_cache = false;
 	if (bucket != NULL && !DRMLISTEMPTY(&bucket->head)) {
-		if (for_render) {
+		/* Whether the BO picked without looking at the tiling would
+		 * have been a match anyway, for the set_tiling stats.
+		 */
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      for_render ? bucket->head.prev :
+				      bucket->head.next, head);
+		head_tiled = bo_gem->tiling_mode == tiling_mode &&
+			bo_gem->stride == stride;
+
+		bo_gem = drm_intel_gem_bo_cache_find_tiled(bucket,
+							   tiling_mode,
+							   stride,
+							   for_render);
+		if (bo_gem) {
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bucket, bo_gem);
+			alloc_from_cache = true;
+		} else if (for_render) {
 			/* Allocate new render-target BOs from the tail (MRU)
 			 * of the list, as it will likely be hot in the GPU
 			 * cache and in the aperture for us.
 			 */
 			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
 					      bucket->head.prev, head);
-			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bucket, bo_gem);
 			alloc_from_cache = true;
 		} else {
 			/* For non-render-target BOs (where we're probably
@@ -709,19 +1027,34 @@ retry:
 					      bucket->head.next, head);
 			if (!drm_intel_gem_bo_busy(&bo_gem->bo)) {
 				alloc_from_cache = true;
-				DRMLISTDEL(&bo_gem->head);
+				drm_intel_gem_bo_cache_remove(bufmgr_gem,
+							      bucket, bo_gem);
 			}
 		}
 
 		if (alloc_from_cache) {
 			if (!drm_intel_gem_bo_madvise_internal
 			    (bufmgr_gem, bo_gem, I915_MADV_WILLNEED)) {
+				bufmgr_gem->stats.purged++;
+				drm_intel_gem_trace(bufmgr_gem,
+						    DRM_INTEL_GEM_TRACE_PURGE,
+						    &bo_gem->bo, bo_gem->bo.size);
 				drm_intel_gem_bo_free(&bo_gem->bo);
 				drm_intel_gem_bo_cache_purge_bucket(bufmgr_gem,
 								    bucket);
 				goto retry;
 			}
 
+			if (bo_gem->tiling_mode != tiling_mode ||
+			    bo_gem->stride != stride)
+				bufmgr_gem->stats.set_tiling_needed++;
+			else if (!head_tiled)
+				bufmgr_gem->stats.set_tiling_avoided++;
+			DBG("bo_create: reuse buf %d, set_tiling avoided %llu, "
+			    "needed %llu\n", bo_gem->gem_handle,
+			    (unsigned long long)bufmgr_gem->stats.set_tiling_avoided,
+			    (unsigned long long)bufmgr_gem->stats.set_tiling_needed);
+
 			if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
 								 tiling_mode,
 								 stride)) {
@@ -730,6 +1063,20 @@ retry:
 			}
 		}
 	}
+
+	bufmgr_gem->stats.allocs++;
+	if (alloc_from_cache) {
+		bucket->hits++;
+		bufmgr_gem->stats.cache_hits++;
+		drm_intel_gem_trace(bufmgr_gem, DRM_INTEL_GEM_TRACE_CACHE_HIT,
+				    &bo_gem->bo, bo_size);
+	} else {
+		if (bucket != NULL)
+			bucket->misses++;
+		bufmgr_gem->stats.cache_misses++;
+		drm_intel_gem_trace(bufmgr_gem, DRM_INTEL_GEM_TRACE_CACHE_MISS,
+				    NULL, bo_size);
+	}
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	if (!alloc_from_cache) {
@@ -784,6 +1131,8 @@ retry:
 
 	DBG("bo_create: buf %d (%s) %ldb\n",
 	    bo_gem->gem_handle, bo_gem->name, size);
+	drm_intel_gem_trace(bufmgr_gem, DRM_INTEL_GEM_TRACE_ALLOC,
+			    &bo_gem->bo, bo_gem->bo.size);
 
 	return &bo_gem->bo;
 }
@@ -935,6 +1284,223 @@ drm_intel_gem_bo_alloc_userptr(drm_intel_bufmgr *bufmgr,
 	return &bo_gem->bo;
 }
 
+/*
+ * Userptr objects handed out by drm_intel_bo_gem_userptr_get() are kept in
+ * a small MRU pool so that clients uploading out of the same malloc arenas
+ * over and over don't pay for a new USERPTR ioctl (and the page pinning
+ * that comes with the first exec) every time.
+ */
+#define USERPTR_POOL_CHUNK_SIZE	(2 * 1024 * 1024)
+#define USERPTR_POOL_MAX_ENTRIES	256
+
+struct drm_intel_userptr_range {
+	drmMMListHead link;
+	uintptr_t start;
+	unsigned long size;
+	unsigned long flags;
+	/** Pool reference to the object covering the range, if any */
+	drm_intel_bo *bo;
+};
+
+static bool
+userptr_range_contains(struct drm_intel_userptr_range *range,
+		       uintptr_t start, uintptr_t end)
+{
+	return range->start <= start && end <= range->start + range->size;
+}
+
+static bool
+userptr_range_overlaps(struct drm_intel_userptr_range *range,
+		       uintptr_t start, uintptr_t end)
+{
+	return range->start < end && start < range->start + range->size;
+}
+
+static void
+drm_intel_gem_userptr_range_free(struct drm_intel_userptr_range *range,
+				 time_t time)
+{
+	DRMLISTDEL(&range->link);
+	if (range->bo)
+		drm_intel_gem_bo_unreference_locked_timed(range->bo, time);
+	free(range);
+}
+
+/**
+ * Registers [addr, addr + size) as an arena that userptr objects may be
+ * created from.
+ *
+ * Large arenas are split into sub-objects of a fixed chunk size, created
+ * on demand, so that small uploads from anywhere in the arena map to a few
+ * long-lived objects instead of one object per upload.  The arena must be
+ * page aligned and stay mapped until it is passed to
+ * drm_intel_bufmgr_gem_userptr_invalidate().
+ */
+drm_public int
+drm_intel_bufmgr_gem_userptr_register(drm_intel_bufmgr *bufmgr,
+				      void *addr, unsigned long size,
+				      unsigned long flags)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_userptr_range *arena;
+	uintptr_t page_mask = getpagesize() - 1;
+
+	if (bufmgr_gem->bufmgr.bo_alloc_userptr == NULL)
+		return -ENODEV;
+
+	if (((uintptr_t)addr & page_mask) || (size & page_mask) || size == 0)
+		return -EINVAL;
+
+	arena = calloc(1, sizeof(*arena));
+	if (arena == NULL)
+		return -ENOMEM;
+
+	arena->start = (uintptr_t)addr;
+	arena->size = size;
+	arena->flags = flags;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	DRMLISTADD(&arena->link, &bufmgr_gem->userptr_arenas);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return 0;
+}
+
+/**
+ * Returns a userptr buffer object covering [addr, addr + size), and the
+ * offset of addr within it.
+ *
+ * A still-valid object from the pool is reused if one covers the range
+ * with the same flags.  Otherwise, if the range lies within a registered
+ * arena the containing chunk of the arena is wrapped, and failing that an
+ * object covering just the pages of the range is created.  The caller owns
+ * a reference to the returned object.
+ */
+drm_public drm_intel_bo *
+drm_intel_bo_gem_userptr_get(drm_intel_bufmgr *bufmgr, const char *name,
+			     void *addr, unsigned long size,
+			     unsigned long flags, uint32_t *offset)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_userptr_range *range, *arena;
+	uintptr_t page_mask = getpagesize() - 1;
+	uintptr_t start, end;
+	drm_intel_bo *bo;
+	int count = 0;
+
+	if (bufmgr_gem->bufmgr.bo_alloc_userptr == NULL || size == 0)
+		return NULL;
+
+	start = (uintptr_t)addr & ~page_mask;
+	end = ((uintptr_t)addr + size + page_mask) & ~page_mask;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+
+	DRMLISTFOREACHENTRY(range, &bufmgr_gem->userptr_pool, link) {
+		if (range->flags == flags &&
+		    userptr_range_contains(range, start, end)) {
+			DRMLISTDEL(&range->link);
+			DRMLISTADD(&range->link, &bufmgr_gem->userptr_pool);
+			goto out;
+		}
+		count++;
+	}
+
+	range = calloc(1, sizeof(*range));
+	if (range == NULL) {
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return NULL;
+	}
+
+	range->start = start;
+	range->size = end - start;
+	range->flags = flags;
+
+	DRMLISTFOREACHENTRY(arena, &bufmgr_gem->userptr_arenas, link) {
+		unsigned long first, last;
+
+		if (arena->flags != flags ||
+		    !userptr_range_contains(arena, start, end))
+			continue;
+
+		first = (start - arena->start) / USERPTR_POOL_CHUNK_SIZE;
+		last = (end - 1 - arena->start) / USERPTR_POOL_CHUNK_SIZE;
+		if (first == last) {
+			range->start = arena->start +
+				first * USERPTR_POOL_CHUNK_SIZE;
+			range->size = arena->start + arena->size - range->start;
+			if (range->size > USERPTR_POOL_CHUNK_SIZE)
+				range->size = USERPTR_POOL_CHUNK_SIZE;
+		}
+		break;
+	}
+
+	range->bo = drm_intel_gem_bo_alloc_userptr(bufmgr, name,
+						   (void *)range->start,
+						   I915_TILING_NONE, 0,
+						   range->size, flags);
+	if (range->bo == NULL) {
+		free(range);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return NULL;
+	}
+
+	DRMLISTADD(&range->link, &bufmgr_gem->userptr_pool);
+
+	/* Drop the least recently used entry to keep the pool bounded. */
+	if (count >= USERPTR_POOL_MAX_ENTRIES) {
+		struct drm_intel_userptr_range *lru;
+
+		lru = DRMLISTENTRY(struct drm_intel_userptr_range,
+				   bufmgr_gem->userptr_pool.prev, link);
+		drm_intel_gem_userptr_range_free(lru, 0);
+	}
+
+out:
+	bo = range->bo;
+	drm_intel_gem_bo_reference(bo);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	*offset = (uintptr_t)addr - range->start;
+
+	DBG("bo_userptr_get: %p+0x%lx -> buf %d + 0x%x\n",
+	    addr, size, bo->handle, *offset);
+
+	return bo;
+}
+
+/**
+ * Tells the pool that [addr, addr + size) is no longer mapped.
+ *
+ * Every pooled object and registered arena overlapping the range is
+ * dropped, so later lookups won't hand out objects pointing at the stale
+ * pages.  Objects the caller still holds references to remain valid
+ * handles until unreferenced, but must not be used for rendering.
+ */
+drm_public void
+drm_intel_bufmgr_gem_userptr_invalidate(drm_intel_bufmgr *bufmgr,
+					void *addr, unsigned long size)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_userptr_range *range, *tmp;
+	uintptr_t start = (uintptr_t)addr;
+	uintptr_t end = start + size;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+
+	DRMLISTFOREACHENTRYSAFE(range, tmp, &bufmgr_gem->userptr_pool, link) {
+		if (userptr_range_overlaps(range, start, end))
+			drm_intel_gem_userptr_range_free(range, 0);
+	}
+
+	DRMLISTFOREACHENTRYSAFE(range, tmp, &bufmgr_gem->userptr_arenas, link) {
+		if (userptr_range_overlaps(range, start, end))
+			drm_intel_gem_userptr_range_free(range, 0);
+	}
+
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
 /**
  * Returns a drm_intel_bo wrapping the given buffer object handle.
  *
@@ -1052,10 +1618,12 @@ drm_intel_gem_bo_free(drm_intel_bo *bo)
 		VG(VALGRIND_FREELIKE_BLOCK(bo_gem->mem_virtual, 0));
 		drm_munmap(bo_gem->mem_virtual, bo_gem->bo.size);
 		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_bytes -= bo_gem->bo.size;
 	}
 	if (bo_gem->gtt_virtual) {
 		drm_munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
 		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_bytes -= bo_gem->bo.size;
 	}
 
 	/* Close this object */
@@ -1105,7 +1673,7 @@ drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 			if (time - bo_gem->free_time <= 1)
 				break;
 
-			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bucket, bo_gem);
 
 			drm_intel_gem_bo_free(&bo_gem->bo);
 		}
@@ -1114,27 +1682,102 @@ drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 	bufmgr_gem->time = time;
 }
 
+static int
+drm_intel_gem_vma_bucket_for_size(unsigned long size)
+{
+	int bucket = 0;
+
+	size = (size - 1) >> 16;
+	while (size && bucket < VMA_CACHE_BUCKETS - 1) {
+		size >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+static unsigned long
+drm_intel_gem_bo_vma_bytes(drm_intel_bo_gem *bo_gem)
+{
+	unsigned long bytes = 0;
+
+	if (bo_gem->mem_virtual)
+		bytes += bo_gem->bo.size;
+	if (bo_gem->gtt_virtual)
+		bytes += bo_gem->bo.size;
+
+	return bytes;
+}
+
+/**
+ * Picks the idle mapping to drop next.
+ *
+ * Each size class is kept in LRU order, so only the head of each list is a
+ * candidate.  Among those, the one with the largest bytes * age wins: a big
+ * mapping nobody has touched for a while goes first, while small mappings
+ * that are reused every frame stay cached.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_vma_victim(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	drm_intel_bo_gem *victim = NULL;
+	uint64_t best = 0;
+	int i;
+
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++) {
+		drm_intel_bo_gem *bo_gem;
+		uint64_t score;
+
+		if (DRMLISTEMPTY(&bufmgr_gem->vma_cache[i]))
+			continue;
+
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      bufmgr_gem->vma_cache[i].next,
+				      vma_list);
+		score = (uint64_t)drm_intel_gem_bo_vma_bytes(bo_gem) *
+			(bufmgr_gem->vma_tick - bo_gem->vma_tick + 1);
+		if (victim == NULL || score > best) {
+			victim = bo_gem;
+			best = score;
+		}
+	}
+
+	return victim;
+}
+
 static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 {
 	int limit;
 
-	DBG("%s: cached=%d, open=%d, limit=%d\n", __FUNCTION__,
-	    bufmgr_gem->vma_count, bufmgr_gem->vma_open, bufmgr_gem->vma_max);
+	DBG("%s: cached=%d (%lu bytes), open=%d, limit=%d (%ld bytes), "
+	    "hits=%llu, misses=%llu\n", __FUNCTION__,
+	    bufmgr_gem->vma_count, bufmgr_gem->vma_bytes,
+	    bufmgr_gem->vma_open, bufmgr_gem->vma_max,
+	    bufmgr_gem->vma_bytes_max,
+	    (unsigned long long)bufmgr_gem->stats.vma_hits,
+	    (unsigned long long)bufmgr_gem->stats.vma_misses);
 
-	if (bufmgr_gem->vma_max < 0)
+	if (bufmgr_gem->vma_max < 0 && bufmgr_gem->vma_bytes_max < 0)
 		return;
 
 	/* We may need to evict a few entries in order to create new mmaps */
-	limit = bufmgr_gem->vma_max - 2*bufmgr_gem->vma_open;
-	if (limit < 0)
-		limit = 0;
+	if (bufmgr_gem->vma_max < 0) {
+		limit = bufmgr_gem->vma_count;
+	} else {
+		limit = bufmgr_gem->vma_max - 2*bufmgr_gem->vma_open;
+		if (limit < 0)
+			limit = 0;
+	}
 
-	while (bufmgr_gem->vma_count > limit) {
+	while (bufmgr_gem->vma_count > limit ||
+	       (bufmgr_gem->vma_bytes_max >= 0 &&
+		bufmgr_gem->vma_bytes > (unsigned long)bufmgr_gem->vma_bytes_max)) {
 		drm_intel_bo_gem *bo_gem;
 
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-				      bufmgr_gem->vma_cache.next,
-				      vma_list);
+		bo_gem = drm_intel_gem_bo_vma_victim(bufmgr_gem);
+		if (bo_gem == NULL)
+			break;
+
 		assert(bo_gem->map_count == 0);
 		DRMLISTDELINIT(&bo_gem->vma_list);
 
@@ -1142,11 +1785,13 @@ static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 			drm_munmap(bo_gem->mem_virtual, bo_gem->bo.size);
 			bo_gem->mem_virtual = NULL;
 			bufmgr_gem->vma_count--;
+			bufmgr_gem->vma_bytes -= bo_gem->bo.size;
 		}
 		if (bo_gem->gtt_virtual) {
 			drm_munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
 			bo_gem->gtt_virtual = NULL;
 			bufmgr_gem->vma_count--;
+			bufmgr_gem->vma_bytes -= bo_gem->bo.size;
 		}
 	}
 }
@@ -1154,12 +1799,16 @@ static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 static void drm_intel_gem_bo_close_vma(drm_intel_bufmgr_gem *bufmgr_gem,
 				       drm_intel_bo_gem *bo_gem)
 {
+	int bucket = drm_intel_gem_vma_bucket_for_size(bo_gem->bo.size);
+
 	bufmgr_gem->vma_open--;
-	DRMLISTADDTAIL(&bo_gem->vma_list, &bufmgr_gem->vma_cache);
+	bo_gem->vma_tick = ++bufmgr_gem->vma_tick;
+	DRMLISTADDTAIL(&bo_gem->vma_list, &bufmgr_gem->vma_cache[bucket]);
 	if (bo_gem->mem_virtual)
 		bufmgr_gem->vma_count++;
 	if (bo_gem->gtt_virtual)
 		bufmgr_gem->vma_count++;
+	bufmgr_gem->vma_bytes += drm_intel_gem_bo_vma_bytes(bo_gem);
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
 }
 
@@ -1172,6 +1821,7 @@ static void drm_intel_gem_bo_open_vma(drm_intel_bufmgr_gem *bufmgr_gem,
 		bufmgr_gem->vma_count--;
 	if (bo_gem->gtt_virtual)
 		bufmgr_gem->vma_count--;
+	bufmgr_gem->vma_bytes -= drm_intel_gem_bo_vma_bytes(bo_gem);
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
 }
 
@@ -1227,7 +1877,7 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 		bo_gem->name = NULL;
 		bo_gem->validate_index = -1;
 
-		DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+		drm_intel_gem_bo_cache_add(bufmgr_gem, bucket, bo_gem);
 	} else {
 		drm_intel_gem_bo_free(bo);
 	}
@@ -1267,10 +1917,46 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo)
 	}
 }
 
-static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
+/**
+ * Moves a BO into the domain a map asked for.  This is where a map waits
+ * for the GPU if it has to, so it is accounted as a map sync; the kernel
+ * does not tell whether it actually stalled.  Called with the lock held.
+ */
+static int
+drm_intel_gem_bo_map_set_domain(drm_intel_bo *bo,
+				struct drm_i915_gem_set_domain *set_domain)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
-	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	uint64_t start = 0, elapsed;
+	int ret;
+
+	if (drm_intel_gem_timing(bufmgr_gem))
+		start = drm_intel_gem_time_ns();
+
+	ret = drmIoctl(bufmgr_gem->fd,
+		       DRM_IOCTL_I915_GEM_SET_DOMAIN,
+		       set_domain);
+
+	/* Moving to a write domain waits for all GPU access */
+	if (ret == 0 && set_domain->write_domain)
+		drm_intel_gem_bo_mark_idle(bufmgr_gem,
+					   (drm_intel_bo_gem *) bo);
+
+	bufmgr_gem->stats.map_syncs++;
+	if (drm_intel_gem_timing(bufmgr_gem)) {
+		elapsed = drm_intel_gem_time_ns() - start;
+		bufmgr_gem->stats.map_sync_ns += elapsed;
+		drm_intel_gem_trace(bufmgr_gem, DRM_INTEL_GEM_TRACE_MAP_SYNC,
+				    bo, elapsed);
+	}
+
+	return ret;
+}
+
+static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_set_domain set_domain;
 	int ret;
 
@@ -1291,6 +1977,8 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 		DBG("bo_map: %d (%s), map_count=%d\n",
 		    bo_gem->gem_handle, bo_gem->name, bo_gem->map_count);
 
+		bufmgr_gem->stats.vma_misses++;
+
 		VG_CLEAR(mmap_arg);
 		mmap_arg.handle = bo_gem->gem_handle;
 		mmap_arg.offset = 0;
@@ -1310,6 +1998,8 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 		}
 		VG(VALGRIND_MALLOCLIKE_BLOCK(mmap_arg.addr_ptr, mmap_arg.size, 0, 1));
 		bo_gem->mem_virtual = (void *)(uintptr_t) mmap_arg.addr_ptr;
+	} else {
+		bufmgr_gem->stats.vma_hits++;
 	}
 	DBG("bo_map: %d (%s) -> %p\n", bo_gem->gem_handle, bo_gem->name,
 	    bo_gem->mem_virtual);
@@ -1322,9 +2012,7 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 		set_domain.write_domain = I915_GEM_DOMAIN_CPU;
 	else
 		set_domain.write_domain = 0;
-	ret = drmIoctl(bufmgr_gem->fd,
-		       DRM_IOCTL_I915_GEM_SET_DOMAIN,
-		       &set_domain);
+	ret = drm_intel_gem_bo_map_set_domain(bo, &set_domain);
 	if (ret != 0) {
 		DBG("%s:%d: Error setting to CPU domain %d: %s\n",
 		    __FILE__, __LINE__, bo_gem->gem_handle,
@@ -1361,6 +2049,8 @@ map_gtt(drm_intel_bo *bo)
 		DBG("bo_map_gtt: mmap %d (%s), map_count=%d\n",
 		    bo_gem->gem_handle, bo_gem->name, bo_gem->map_count);
 
+		bufmgr_gem->stats.vma_misses++;
+
 		VG_CLEAR(mmap_arg);
 		mmap_arg.handle = bo_gem->gem_handle;
 
@@ -1394,6 +2084,8 @@ map_gtt(drm_intel_bo *bo)
 				drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 			return ret;
 		}
+	} else {
+		bufmgr_gem->stats.vma_hits++;
 	}
 
 	bo->virtual = bo_gem->gtt_virtual;
@@ -1433,9 +2125,7 @@ drm_intel_gem_bo_map_gtt(drm_intel_bo *bo)
 	set_domain.handle = bo_gem->gem_handle;
 	set_domain.read_domains = I915_GEM_DOMAIN_GTT;
 	set_domain.write_domain = I915_GEM_DOMAIN_GTT;
-	ret = drmIoctl(bufmgr_gem->fd,
-		       DRM_IOCTL_I915_GEM_SET_DOMAIN,
-		       &set_domain);
+	ret = drm_intel_gem_bo_map_set_domain(bo, &set_domain);
 	if (ret != 0) {
 		DBG("%s:%d: Error setting domain %d: %s\n",
 		    __FILE__, __LINE__, bo_gem->gem_handle,
@@ -1558,6 +2248,264 @@ drm_intel_gem_bo_unmap_gtt(drm_intel_bo *bo)
 	return drm_intel_gem_bo_unmap(bo);
 }
 
+struct drm_intel_stream_block {
+	drm_intel_bo *bo;
+	void *virtual;
+
+	/**
+	 * Whether any range has been handed out from the block since it was
+	 * last recycled, and bufmgr_gem->exec_seqno at the time of the most
+	 * recent one.
+	 */
+	bool used;
+	uint32_t alloc_seqno;
+};
+
+struct _drm_intel_stream {
+	drm_intel_bufmgr *bufmgr;
+	const char *name;
+
+	/** Size of each backing buffer object */
+	unsigned long block_size;
+
+	/** Ring of persistently mapped buffer objects, oldest after current */
+	struct drm_intel_stream_block *blocks;
+	int num_blocks;
+	int size_blocks;
+	int max_blocks;
+
+	/** Block currently being filled and the next free byte within it */
+	int current;
+	unsigned long offset;
+};
+
+static int
+drm_intel_gem_stream_add_block(drm_intel_stream *stream, int index)
+{
+	struct drm_intel_stream_block *block;
+	drm_intel_bo *bo;
+	int ret;
+
+	if (stream->num_blocks == stream->size_blocks) {
+		int size = stream->size_blocks * 2;
+
+		block = realloc(stream->blocks, size * sizeof(*stream->blocks));
+		if (block == NULL)
+			return -ENOMEM;
+
+		stream->blocks = block;
+		stream->size_blocks = size;
+	}
+
+	bo = drm_intel_bo_alloc(stream->bufmgr, stream->name,
+				stream->block_size, 64);
+	if (bo == NULL)
+		return -ENOMEM;
+
+	/* The mapping is kept for the lifetime of the stream; every range
+	 * handed out from it is disjoint from whatever the GPU may still be
+	 * reading, so the unsynchronized mapping never needs to stall.
+	 */
+	ret = drm_intel_gem_bo_map_unsynchronized(bo);
+	if (ret) {
+		drm_intel_bo_unreference(bo);
+		return ret;
+	}
+
+	memmove(&stream->blocks[index + 1], &stream->blocks[index],
+		(stream->num_blocks - index) * sizeof(*stream->blocks));
+	block = &stream->blocks[index];
+	block->bo = bo;
+	block->virtual = bo->virtual;
+	block->used = false;
+	stream->num_blocks++;
+
+	return 0;
+}
+
+/**
+ * Creates a streaming upload buffer.
+ *
+ * The stream sub-allocates short-lived vertex, index and constant data out
+ * of a ring of buffer objects of \p block_size bytes each.  A block is only
+ * reused once the batches that consumed it have retired; if it is still
+ * busy when the ring wraps around, another block is added in front of it,
+ * up to \p max_blocks, before falling back to waiting for the GPU.
+ *
+ * Data handed out since the last batch submission may still be referenced
+ * by the batch being built, so a block holding such data is never reused
+ * and waiting for it would not help either.  In that case the ring grows
+ * past \p max_blocks; this is what lets a single batch consume more than
+ * \p max_blocks blocks worth of data.  Once past \p max_blocks, data that
+ * missed a later submission of any batch is considered abandoned and its
+ * block is reused, so that allocations which are never submitted do not
+ * grow the ring without bound.
+ */
+drm_public drm_intel_stream *
+drm_intel_gem_stream_create(drm_intel_bufmgr *bufmgr, const char *name,
+			    unsigned long block_size, int max_blocks)
+{
+	drm_intel_stream *stream;
+
+	if (max_blocks < 1 || block_size == 0)
+		return NULL;
+
+	stream = calloc(1, sizeof(*stream));
+	if (stream == NULL)
+		return NULL;
+
+	stream->bufmgr = bufmgr;
+	stream->name = name;
+	stream->block_size = ROUND_UP_TO(block_size, 4096);
+	stream->max_blocks = max_blocks;
+	stream->size_blocks = max_blocks;
+
+	stream->blocks = calloc(max_blocks, sizeof(*stream->blocks));
+	if (stream->blocks == NULL ||
+	    drm_intel_gem_stream_add_block(stream, 0)) {
+		free(stream->blocks);
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+drm_public void
+drm_intel_gem_stream_destroy(drm_intel_stream *stream)
+{
+	int i;
+
+	if (stream == NULL)
+		return;
+
+	for (i = 0; i < stream->num_blocks; i++) {
+		drm_intel_bo_unmap(stream->blocks[i].bo);
+		drm_intel_bo_unreference(stream->blocks[i].bo);
+	}
+
+	free(stream->blocks);
+	free(stream);
+}
+
+/**
+ * Returns whether ranges of the block may still be referenced by a batch
+ * that has not been submitted yet, i.e. whether no submission using the
+ * block has happened since the last range was handed out from it.
+ *
+ * When the ring has already grown past max_blocks, ranges that were left
+ * out of a later submission are taken as abandoned rather than pending.
+ */
+static bool
+drm_intel_gem_stream_block_pending(drm_intel_stream *stream,
+				   struct drm_intel_stream_block *block)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) stream->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) block->bo;
+
+	if (!block->used)
+		return false;
+
+	if (!exec_seqno_passed(bo_gem->exec_seqno, block->alloc_seqno))
+		return false;
+
+	return stream->num_blocks <= stream->max_blocks ||
+		bufmgr_gem->exec_seqno == block->alloc_seqno;
+}
+
+/**
+ * Moves the stream on to the next block in the ring.
+ *
+ * The oldest block is the one following the current block.  If the GPU is
+ * done with it, it is recycled as is; otherwise a fresh block is inserted
+ * in its place while we are still below max_blocks, and only once the ring
+ * cannot grow any further do we wait for the oldest block to go idle.
+ *
+ * The current block, and any block with data not yet submitted, is never
+ * recycled: a fresh block is inserted regardless of max_blocks instead,
+ * unless that data was left out of a later submission and the ring is
+ * already past max_blocks.
+ */
+static int
+drm_intel_gem_stream_advance(drm_intel_stream *stream)
+{
+	int next = (stream->current + 1) % stream->num_blocks;
+	struct drm_intel_stream_block *block = &stream->blocks[next];
+	int ret;
+
+	if (next == stream->current ||
+	    drm_intel_gem_stream_block_pending(stream, block)) {
+		next = stream->current + 1;
+		ret = drm_intel_gem_stream_add_block(stream, next);
+		if (ret)
+			return ret;
+	} else if (drm_intel_bo_busy(block->bo)) {
+		if (stream->num_blocks < stream->max_blocks) {
+			next = stream->current + 1;
+			ret = drm_intel_gem_stream_add_block(stream, next);
+			if (ret)
+				return ret;
+		} else {
+			drm_intel_bo_wait_rendering(block->bo);
+		}
+	}
+
+	stream->current = next;
+	stream->offset = 0;
+
+	return 0;
+}
+
+/**
+ * Allocates \p size bytes aligned to \p alignment from the stream.
+ *
+ * On success the buffer object backing the range, the offset of the range
+ * within it and a CPU pointer to the start of the range are returned.  The
+ * range stays valid until the stream wraps around to its block again,
+ * which only happens once a batch using the block has been submitted after
+ * the range was handed out and has retired.  A range must be used by the
+ * next batch submitted: once the ring is past max_blocks, a later
+ * submission that does not reference it lets its block be reused.  No
+ * reference is added to the returned buffer object.
+ */
+drm_public int
+drm_intel_gem_stream_alloc(drm_intel_stream *stream, unsigned long size,
+			   unsigned int alignment, drm_intel_bo **bo,
+			   uint32_t *offset, void **ptr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) stream->bufmgr;
+	struct drm_intel_stream_block *block;
+	unsigned long start;
+	int ret;
+
+	if (size > stream->block_size || (alignment & (alignment - 1)))
+		return -EINVAL;
+
+	if (alignment == 0)
+		alignment = 1;
+
+	start = ALIGN(stream->offset, alignment);
+	if (start + size > stream->block_size) {
+		ret = drm_intel_gem_stream_advance(stream);
+		if (ret)
+			return ret;
+		start = 0;
+	}
+
+	block = &stream->blocks[stream->current];
+	block->used = true;
+	block->alloc_seqno = bufmgr_gem->exec_seqno;
+	stream->offset = start + size;
+
+	*bo = block->bo;
+	*offset = start;
+	*ptr = (char *)block->virtual + start;
+
+	return 0;
+}
+
 static int
 drm_intel_gem_bo_subdata(drm_intel_bo *bo, unsigned long offset,
 			 unsigned long size, const void *data)
@@ -1643,11 +2591,173 @@ drm_intel_gem_bo_get_subdata(drm_intel_bo *bo, unsigned long offset,
 	return ret;
 }
 
+/**
+ * Decides whether a vectored transfer should copy through a mapping.
+ *
+ * Each pwrite/pread is a syscall, so many small ranges are cheaper to copy
+ * through one mapping, while a few large ranges are better left to the
+ * kernel.  On LLC platforms the CPU mapping is coherent for both
+ * directions.  Without LLC only writes to untiled objects go through the
+ * write-combined GTT mapping; GTT reads are uncached and a fenced GTT view
+ * would not match the linear offsets pwrite uses.
+ */
+static bool
+drm_intel_gem_bo_subdatav_use_map(drm_intel_bo *bo,
+				  const struct drm_intel_bo_range *ranges,
+				  int count, bool write)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	unsigned long total = 0;
+	int i;
+
+	if (count < 2)
+		return false;
+
+	if (!bufmgr_gem->has_llc &&
+	    (!write || bo_gem->tiling_mode != I915_TILING_NONE))
+		return false;
+
+	for (i = 0; i < count; i++)
+		total += ranges[i].size;
+
+	return total / count < bufmgr_gem->subdata_crossover;
+}
+
+static int
+drm_intel_gem_bo_check_ranges(drm_intel_bo *bo,
+			      const struct drm_intel_bo_range *ranges,
+			      int count)
+{
+	int i;
+
+	if (count < 0)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (ranges[i].offset > bo->size ||
+		    ranges[i].size > bo->size - ranges[i].offset)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int
+drm_intel_gem_bo_subdatav(drm_intel_bo *bo,
+			  const struct drm_intel_bo_range *ranges, int count)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	int i, ret;
+
+	if (bo_gem->is_userptr)
+		return -EINVAL;
+
+	ret = drm_intel_gem_bo_check_ranges(bo, ranges, count);
+	if (ret)
+		return ret;
+
+	if (drm_intel_gem_bo_subdatav_use_map(bo, ranges, count, true)) {
+		if (bufmgr_gem->has_llc)
+			ret = drm_intel_gem_bo_map(bo, 1);
+		else
+			ret = drm_intel_gem_bo_map_gtt(bo);
+		if (ret == 0) {
+			for (i = 0; i < count; i++)
+				memcpy((char *)bo->virtual + ranges[i].offset,
+				       ranges[i].data, ranges[i].size);
+
+			if (bufmgr_gem->has_llc)
+				return drm_intel_gem_bo_unmap(bo);
+			else
+				return drm_intel_gem_bo_unmap_gtt(bo);
+		}
+		/* Fall back to pwrite if we could not map the object */
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = drm_intel_gem_bo_subdata(bo, ranges[i].offset,
+					       ranges[i].size, ranges[i].data);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+drm_intel_gem_bo_get_subdatav(drm_intel_bo *bo,
+			      const struct drm_intel_bo_range *ranges,
+			      int count)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	int i, ret;
+
+	if (bo_gem->is_userptr)
+		return -EINVAL;
+
+	ret = drm_intel_gem_bo_check_ranges(bo, ranges, count);
+	if (ret)
+		return ret;
+
+	if (drm_intel_gem_bo_subdatav_use_map(bo, ranges, count, false)) {
+		ret = drm_intel_gem_bo_map(bo, 0);
+		if (ret == 0) {
+			for (i = 0; i < count; i++)
+				memcpy(ranges[i].data,
+				       (char *)bo->virtual + ranges[i].offset,
+				       ranges[i].size);
+
+			return drm_intel_gem_bo_unmap(bo);
+		}
+		/* Fall back to pread if we could not map the object */
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = drm_intel_gem_bo_get_subdata(bo, ranges[i].offset,
+						   ranges[i].size,
+						   ranges[i].data);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Counts a wait; start is 0 when the wait was not timed */
+static void
+drm_intel_gem_account_wait(drm_intel_bo *bo, uint64_t start)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	uint64_t elapsed = 0;
+
+	if (start)
+		elapsed = drm_intel_gem_time_ns() - start;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->stats.waits++;
+	bufmgr_gem->stats.wait_ns += elapsed;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	if (start)
+		drm_intel_gem_trace(bufmgr_gem,
+				    DRM_INTEL_GEM_TRACE_WAIT_RENDERING,
+				    bo, elapsed);
+}
+
 /** Waits for all GPU rendering with the object to have completed. */
 static void
 drm_intel_gem_bo_wait_rendering(drm_intel_bo *bo)
 {
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	uint64_t start = 0;
+
+	if (drm_intel_gem_timing(bufmgr_gem))
+		start = drm_intel_gem_time_ns();
+
 	drm_intel_gem_bo_start_gtt_access(bo, 1);
+	drm_intel_gem_account_wait(bo, start);
 }
 
 /**
@@ -1680,6 +2790,7 @@ drm_intel_gem_bo_wait(drm_intel_bo *bo, int64_t timeout_ns)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_wait wait;
+	uint64_t start = 0;
 	int ret;
 
 	if (!bufmgr_gem->has_wait_timeout) {
@@ -1693,12 +2804,19 @@ drm_intel_gem_bo_wait(drm_intel_bo *bo, int64_t timeout_ns)
 		}
 	}
 
+	if (drm_intel_gem_timing(bufmgr_gem))
+		start = drm_intel_gem_time_ns();
+
 	wait.bo_handle = bo_gem->gem_handle;
 	wait.timeout_ns = timeout_ns;
 	wait.flags = 0;
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_WAIT, &wait);
 	if (ret == -1)
-		return -errno;
+		ret = -errno;
+	else
+		drm_intel_gem_bo_mark_idle(bufmgr_gem, bo_gem);
+
+	drm_intel_gem_account_wait(bo, start);
 
 	return ret;
 }
@@ -1730,6 +2848,8 @@ drm_intel_gem_bo_start_gtt_access(drm_intel_bo *bo, int write_enable)
 		    __FILE__, __LINE__, bo_gem->gem_handle,
 		    set_domain.read_domains, set_domain.write_domain,
 		    strerror(errno));
+	} else if (write_enable) {
+		drm_intel_gem_bo_mark_idle(bufmgr_gem, bo_gem);
 	}
 }
 
@@ -1744,6 +2864,29 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 	free(bufmgr_gem->exec_bos);
 	free(bufmgr_gem->aub_filename);
 
+	if (bufmgr_gem->aub_writer)
+		aub_writer_destroy(bufmgr_gem->aub_writer, 0);
+
+	/* Drop the userptr pool's references */
+	while (!DRMLISTEMPTY(&bufmgr_gem->userptr_pool)) {
+		struct drm_intel_userptr_range *range;
+
+		range = DRMLISTENTRY(struct drm_intel_userptr_range,
+				     bufmgr_gem->userptr_pool.next, link);
+		drm_intel_gem_userptr_range_free(range, 0);
+	}
+	while (!DRMLISTEMPTY(&bufmgr_gem->userptr_arenas)) {
+		struct drm_intel_userptr_range *range;
+
+		range = DRMLISTENTRY(struct drm_intel_userptr_range,
+				     bufmgr_gem->userptr_arenas.next, link);
+		drm_intel_gem_userptr_range_free(range, 0);
+	}
+
+	if (bufmgr_gem->stats_dump)
+		drm_intel_bufmgr_gem_dump_stats(bufmgr, stderr);
+
+	pthread_mutex_destroy(&bufmgr_gem->retired_lock);
 	pthread_mutex_destroy(&bufmgr_gem->lock);
 
 	/* Free any cached buffer objects we were going to reuse */
@@ -1755,7 +2898,7 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 		while (!DRMLISTEMPTY(&bucket->head)) {
 			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
 					      bucket->head.next, head);
-			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bucket, bo_gem);
 
 			drm_intel_gem_bo_free(&bo_gem->bo);
 		}
@@ -1974,114 +3117,396 @@ drm_intel_gem_bo_process_reloc2(drm_intel_bo *bo)
 		need_fence = (bo_gem->reloc_target_info[i].flags &
 			      DRM_INTEL_RELOC_FENCE);
 
-		/* Add the target to the validate list */
-		drm_intel_add_validate_buffer2(target_bo, need_fence);
-	}
+		/* Add the target to the validate list */
+		drm_intel_add_validate_buffer2(target_bo, need_fence);
+	}
+}
+
+
+static void
+drm_intel_update_buffer_offsets(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	int i;
+
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+
+		/* Update the buffer offset */
+		if (bufmgr_gem->exec_objects[i].offset != bo->offset64) {
+			DBG("BO %d (%s) migrated: 0x%08lx -> 0x%08llx\n",
+			    bo_gem->gem_handle, bo_gem->name, bo->offset64,
+			    (unsigned long long)bufmgr_gem->exec_objects[i].
+			    offset);
+			bo->offset64 = bufmgr_gem->exec_objects[i].offset;
+			bo->offset = bufmgr_gem->exec_objects[i].offset;
+		}
+	}
+}
+
+static void
+drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	int i;
+
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
+
+		/* Update the buffer offset */
+		if (bufmgr_gem->exec2_objects[i].offset != bo->offset64) {
+			DBG("BO %d (%s) migrated: 0x%08lx -> 0x%08llx\n",
+			    bo_gem->gem_handle, bo_gem->name, bo->offset64,
+			    (unsigned long long)bufmgr_gem->exec2_objects[i].offset);
+			bo->offset64 = bufmgr_gem->exec2_objects[i].offset;
+			bo->offset = bufmgr_gem->exec2_objects[i].offset;
+		}
+	}
+}
+
+/*
+ * AUB output is staged in a ring of large chunks and written out by a
+ * separate thread, so that dumping a frame costs a memcpy per object
+ * instead of a stdio call per dword.  If the thread can't be started the
+ * chunks are written out synchronously as they fill up.
+ */
+#define AUB_CHUNK_SIZE		(1024 * 1024)
+#define AUB_CHUNK_COUNT		16
+
+struct drm_intel_aub_writer {
+	FILE *file;
+	/** gzip process compressing the stream, if any */
+	pid_t compressor;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool threaded;
+	bool done;
+	/**
+	 * First error writing the trace, as a negative errno.  Once set, the
+	 * rest of the trace is dropped and aub_exec() shuts the writer down.
+	 */
+	int error;
+
+	char *chunks[AUB_CHUNK_COUNT];
+	size_t chunk_used[AUB_CHUNK_COUNT];
+	/** Chunks [tail, head) are queued for writing, head is being filled */
+	unsigned int head, tail;
+	size_t fill;
+};
+
+static int
+aub_writer_write(struct drm_intel_aub_writer *writer, const char *data,
+		 size_t size)
+{
+	errno = 0;
+	if (fwrite(data, 1, size, writer->file) != size)
+		return errno ? -errno : -EIO;
+
+	return 0;
+}
+
+static void *
+aub_writer_thread(void *arg)
+{
+	struct drm_intel_aub_writer *writer = arg;
+	sigset_t sigpipe;
+
+	/* If gzip goes away, fail the write with EPIPE rather than killing
+	 * the application.  The signal stays pending on this thread and is
+	 * discarded when it exits.
+	 */
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		unsigned int index;
+		bool failed;
+		int ret = 0;
+
+		while (writer->tail == writer->head && !writer->done)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		if (writer->tail == writer->head)
+			break;
+
+		index = writer->tail % AUB_CHUNK_COUNT;
+		failed = writer->error != 0;
+		pthread_mutex_unlock(&writer->lock);
+
+		if (!failed)
+			ret = aub_writer_write(writer, writer->chunks[index],
+					       writer->chunk_used[index]);
+
+		pthread_mutex_lock(&writer->lock);
+		if (ret && !writer->error)
+			writer->error = ret;
+		writer->tail++;
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+}
+
+/**
+ * Queues the chunk being filled for writing and starts a new one.
+ *
+ * Returns the first error hit writing the trace so far.  With the writer
+ * thread, errors show up in a later call than the one that queued the
+ * data.
+ */
+static int
+aub_writer_submit(struct drm_intel_aub_writer *writer)
+{
+	unsigned int index = writer->head % AUB_CHUNK_COUNT;
+	int ret;
+
+	if (!writer->threaded) {
+		if (writer->fill && !writer->error)
+			writer->error = aub_writer_write(writer,
+							 writer->chunks[index],
+							 writer->fill);
+		writer->fill = 0;
+		return writer->error;
+	}
+
+	pthread_mutex_lock(&writer->lock);
+	if (writer->fill) {
+		writer->chunk_used[index] = writer->fill;
+		writer->head++;
+		pthread_cond_broadcast(&writer->cond);
+		while (writer->head - writer->tail == AUB_CHUNK_COUNT)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+	}
+	ret = writer->error;
+	pthread_mutex_unlock(&writer->lock);
+
+	writer->fill = 0;
+
+	return ret;
+}
+
+/**
+ * Opens \p filename for writing.  Names ending in ".gz" are compressed on
+ * the fly by piping the stream through gzip, which keeps multi-gigabyte
+ * captures manageable without making libdrm depend on zlib.
+ *
+ * gzip must not inherit any other descriptor: holding the write end of
+ * its own pipe would keep it from ever seeing EOF, and the application's
+ * descriptors are none of its business.  Ours are opened close-on-exec,
+ * and the child closes everything but stdin and stdout before the exec,
+ * using only async-signal-safe calls since other threads may hold locks.
+ */
+static FILE *
+aub_writer_open_file(struct drm_intel_aub_writer *writer,
+		     const char *filename)
+{
+	size_t len = strlen(filename);
+	long max_fd;
+	int fds[2];
+	int out;
+
+	writer->compressor = -1;
+	if (len < 3 || strcmp(filename + len - 3, ".gz") != 0)
+		return fopen(filename, "w+");
+
+	max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0)
+		max_fd = 1024;
+
+	out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out < 0)
+		return NULL;
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		close(out);
+		return NULL;
+	}
+
+	writer->compressor = fork();
+	if (writer->compressor == 0) {
+		long fd;
+		int in;
+
+		/* Move both out of the way first, in case either is 0 or 1 */
+		in = fcntl(fds[0], F_DUPFD, STDERR_FILENO + 1);
+		out = fcntl(out, F_DUPFD, STDERR_FILENO + 1);
+		if (in < 0 || out < 0 ||
+		    dup2(in, STDIN_FILENO) < 0 ||
+		    dup2(out, STDOUT_FILENO) < 0)
+			_exit(127);
+
+		for (fd = STDERR_FILENO + 1; fd < max_fd; fd++)
+			close(fd);
+
+		execlp("gzip", "gzip", "-1", "-c", NULL);
+		_exit(127);
+	}
+
+	close(fds[0]);
+	close(out);
+	if (writer->compressor < 0) {
+		close(fds[1]);
+		return NULL;
+	}
+
+	return fdopen(fds[1], "w");
+}
+
+static struct drm_intel_aub_writer *
+aub_writer_create(const char *filename)
+{
+	struct drm_intel_aub_writer *writer;
+	int i;
+
+	writer = calloc(1, sizeof(*writer));
+	if (writer == NULL)
+		return NULL;
+
+	for (i = 0; i < AUB_CHUNK_COUNT; i++) {
+		writer->chunks[i] = malloc(AUB_CHUNK_SIZE);
+		if (writer->chunks[i] == NULL)
+			goto err;
+	}
+
+	writer->file = aub_writer_open_file(writer, filename);
+	if (writer->file == NULL)
+		goto err;
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	writer->threaded = pthread_create(&writer->thread, NULL,
+					  aub_writer_thread, writer) == 0;
+
+	return writer;
+
+err:
+	for (i = 0; i < AUB_CHUNK_COUNT; i++)
+		free(writer->chunks[i]);
+	free(writer);
+	return NULL;
 }
 
-
+/**
+ * Flushes and closes the trace, reporting the first error hit writing it,
+ * or \p error if there was none.
+ */
 static void
-drm_intel_update_buffer_offsets(drm_intel_bufmgr_gem *bufmgr_gem)
+aub_writer_destroy(struct drm_intel_aub_writer *writer, int error)
 {
-	int i;
+	int status, i;
 
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
-		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	aub_writer_submit(writer);
 
-		/* Update the buffer offset */
-		if (bufmgr_gem->exec_objects[i].offset != bo->offset64) {
-			DBG("BO %d (%s) migrated: 0x%08lx -> 0x%08llx\n",
-			    bo_gem->gem_handle, bo_gem->name, bo->offset64,
-			    (unsigned long long)bufmgr_gem->exec_objects[i].
-			    offset);
-			bo->offset64 = bufmgr_gem->exec_objects[i].offset;
-			bo->offset = bufmgr_gem->exec_objects[i].offset;
-		}
+	if (writer->threaded) {
+		pthread_mutex_lock(&writer->lock);
+		writer->done = true;
+		pthread_cond_broadcast(&writer->cond);
+		pthread_mutex_unlock(&writer->lock);
+		pthread_join(writer->thread, NULL);
 	}
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+
+	if (!writer->error)
+		writer->error = error;
+	if (fclose(writer->file) != 0 && !writer->error)
+		writer->error = -errno;
+	if (writer->compressor > 0 &&
+	    waitpid(writer->compressor, &status, 0) == writer->compressor &&
+	    !(WIFEXITED(status) && WEXITSTATUS(status) == 0) &&
+	    !writer->error)
+		writer->error = -EIO;
+
+	if (writer->error)
+		fprintf(stderr, "Failed to write the AUB trace, "
+			"AUB dumping disabled: %s\n",
+			strerror(-writer->error));
+
+	for (i = 0; i < AUB_CHUNK_COUNT; i++)
+		free(writer->chunks[i]);
+	free(writer);
 }
 
 static void
-drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
+aub_out_data(drm_intel_bufmgr_gem *bufmgr_gem, const void *data, size_t size)
 {
-	int i;
+	struct drm_intel_aub_writer *writer = bufmgr_gem->aub_writer;
+	const char *src = data;
 
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
-		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
+	while (size) {
+		size_t len = AUB_CHUNK_SIZE - writer->fill;
 
-		/* Update the buffer offset */
-		if (bufmgr_gem->exec2_objects[i].offset != bo->offset64) {
-			DBG("BO %d (%s) migrated: 0x%08lx -> 0x%08llx\n",
-			    bo_gem->gem_handle, bo_gem->name, bo->offset64,
-			    (unsigned long long)bufmgr_gem->exec2_objects[i].offset);
-			bo->offset64 = bufmgr_gem->exec2_objects[i].offset;
-			bo->offset = bufmgr_gem->exec2_objects[i].offset;
-		}
+		if (len > size)
+			len = size;
+
+		memcpy(writer->chunks[writer->head % AUB_CHUNK_COUNT] +
+		       writer->fill, src, len);
+		writer->fill += len;
+		src += len;
+		size -= len;
+
+		if (writer->fill == AUB_CHUNK_SIZE)
+			aub_writer_submit(writer);
 	}
 }
 
 static void
 aub_out(drm_intel_bufmgr_gem *bufmgr_gem, uint32_t data)
 {
-	fwrite(&data, 1, 4, bufmgr_gem->aub_file);
+	aub_out_data(bufmgr_gem, &data, 4);
 }
 
-static void
-aub_out_data(drm_intel_bufmgr_gem *bufmgr_gem, void *data, size_t size)
+static uint64_t
+aub_hash(uint64_t hash, const uint32_t *data, size_t count)
 {
-	fwrite(data, 1, size, bufmgr_gem->aub_file);
+	size_t i;
+
+	/* FNV-1a, a dword at a time */
+	for (i = 0; i < count; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
 }
 
-static void
-aub_write_bo_data(drm_intel_bo *bo, uint32_t offset, uint32_t size)
+/**
+ * Reads back the contents of bo with its relocations resolved to AUB
+ * addresses.  Returns NULL if there is no memory for the copy.
+ */
+static uint32_t *
+aub_read_bo(drm_intel_bo *bo)
 {
-	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	uint32_t *data;
-	unsigned int i;
+	int r;
 
 	data = malloc(bo->size);
-	drm_intel_bo_get_subdata(bo, offset, size, data);
-
-	/* Easy mode: write out bo with no relocations */
-	if (!bo_gem->reloc_count) {
-		aub_out_data(bufmgr_gem, data, size);
-		free(data);
-		return;
-	}
-
-	/* Otherwise, handle the relocations while writing. */
-	for (i = 0; i < size / 4; i++) {
-		int r;
-		for (r = 0; r < bo_gem->reloc_count; r++) {
-			struct drm_i915_gem_relocation_entry *reloc;
-			drm_intel_reloc_target *info;
-
-			reloc = &bo_gem->relocs[r];
-			info = &bo_gem->reloc_target_info[r];
+	if (data == NULL)
+		return NULL;
 
-			if (reloc->offset == offset + i * 4) {
-				drm_intel_bo_gem *target_gem;
-				uint32_t val;
+	drm_intel_bo_get_subdata(bo, 0, bo->size, data);
 
-				target_gem = (drm_intel_bo_gem *)info->bo;
+	/* Walk the relocations backwards so that the first one emitted for
+	 * a given dword is the one that ends up in the dump.
+	 */
+	for (r = bo_gem->reloc_count - 1; r >= 0; r--) {
+		struct drm_i915_gem_relocation_entry *reloc;
+		drm_intel_bo_gem *target_gem;
 
-				val = reloc->delta;
-				val += target_gem->aub_offset;
+		reloc = &bo_gem->relocs[r];
+		target_gem = (drm_intel_bo_gem *) bo_gem->reloc_target_info[r].bo;
 
-				aub_out(bufmgr_gem, val);
-				data[i] = val;
-				break;
-			}
-		}
-		if (r == bo_gem->reloc_count) {
-			/* no relocation, just the data */
-			aub_out(bufmgr_gem, data[i]);
-		}
+		if (reloc->offset + 4 <= bo->size)
+			data[reloc->offset / 4] =
+				reloc->delta + target_gem->aub_offset;
 	}
 
-	free(data);
+	return data;
 }
 
 static void
@@ -2105,7 +3530,8 @@ aub_bo_get_address(drm_intel_bo *bo)
 }
 
 static void
-aub_write_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
+aub_write_trace_block(drm_intel_bo *bo, const uint32_t *data,
+		      uint32_t type, uint32_t subtype,
 		      uint32_t offset, uint32_t size)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
@@ -2121,7 +3547,7 @@ aub_write_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
 	aub_out(bufmgr_gem, size);
 	if (bufmgr_gem->gen >= 8)
 		aub_out(bufmgr_gem, 0);
-	aub_write_bo_data(bo, offset, size);
+	aub_out_data(bufmgr_gem, data + offset / 4, size);
 }
 
 /**
@@ -2130,7 +3556,8 @@ aub_write_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
  * everything goes badly after that.
  */
 static void
-aub_write_large_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
+aub_write_large_trace_block(drm_intel_bo *bo, const uint32_t *data,
+			    uint32_t type, uint32_t subtype,
 			    uint32_t offset, uint32_t size)
 {
 	uint32_t block_size;
@@ -2142,19 +3569,42 @@ aub_write_large_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
 		if (block_size > 8 * 4096)
 			block_size = 8 * 4096;
 
-		aub_write_trace_block(bo, type, subtype, offset + sub_offset,
-				      block_size);
+		aub_write_trace_block(bo, data, type, subtype,
+				      offset + sub_offset, block_size);
 	}
 }
 
-static void
-aub_write_bo(drm_intel_bo *bo)
+/**
+ * Writes out bo at the AUB address assigned by aub_bo_get_address().
+ *
+ * If the memory layout of this exec matches that of the previous one, the
+ * simulator memory at bo's address still holds whatever we wrote there
+ * last time, so the object is skipped when its contents (and annotations)
+ * hash to the same value as then.
+ */
+static int
+aub_write_bo(drm_intel_bo *bo, bool same_layout)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	uint32_t offset = 0;
+	uint32_t *data;
+	uint64_t hash;
 	unsigned i;
 
-	aub_bo_get_address(bo);
+	data = aub_read_bo(bo);
+	if (data == NULL)
+		return -ENOMEM;
+
+	hash = aub_hash(0xcbf29ce484222325ull, data, bo->size / 4);
+	hash = aub_hash(hash, (uint32_t *) bo_gem->aub_annotations,
+			bo_gem->aub_annotation_count *
+			sizeof(*bo_gem->aub_annotations) / 4);
+	if (same_layout && bo_gem->aub_hash_valid && bo_gem->aub_hash == hash) {
+		free(data);
+		return 0;
+	}
+	bo_gem->aub_hash = hash;
+	bo_gem->aub_hash_valid = true;
 
 	/* Write out each annotated section separately. */
 	for (i = 0; i < bo_gem->aub_annotation_count; ++i) {
@@ -2164,7 +3614,8 @@ aub_write_bo(drm_intel_bo *bo)
 		if (ending_offset > bo->size)
 			ending_offset = bo->size;
 		if (ending_offset > offset) {
-			aub_write_large_trace_block(bo, annotation->type,
+			aub_write_large_trace_block(bo, data,
+						    annotation->type,
 						    annotation->subtype,
 						    offset,
 						    ending_offset - offset);
@@ -2174,9 +3625,13 @@ aub_write_bo(drm_intel_bo *bo)
 
 	/* Write out any remaining unannotated data */
 	if (offset < bo->size) {
-		aub_write_large_trace_block(bo, AUB_TRACE_TYPE_NOTYPE, 0,
+		aub_write_large_trace_block(bo, data, AUB_TRACE_TYPE_NOTYPE, 0,
 					    offset, bo->size - offset);
 	}
+
+	free(data);
+
+	return 0;
 }
 
 /*
@@ -2253,7 +3708,7 @@ drm_intel_gem_bo_aub_dump_bmp(drm_intel_bo *bo,
 		return;
 	}
 
-	if (!bufmgr_gem->aub_file)
+	if (!bufmgr_gem->aub_writer)
 		return;
 
 	aub_out(bufmgr_gem, CMD_AUB_DUMP_BMP | 4);
@@ -2269,15 +3724,24 @@ drm_intel_gem_bo_aub_dump_bmp(drm_intel_bo *bo,
 		((bo_gem->tiling_mode == I915_TILING_Y) ? (1 << 3) : 0));
 }
 
+/**
+ * Dumps the batch and the buffers it references to the AUB trace.
+ *
+ * The trace is only a debugging aid, so if it cannot be written the error
+ * is reported once and dumping is turned off; the batch itself is still
+ * submitted by the caller.
+ */
 static void
 aub_exec(drm_intel_bo *bo, int ring_flag, int used)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	int i;
+	int i, ret = 0;
 	bool batch_buffer_needs_annotations;
+	bool same_layout;
+	uint64_t layout;
 
-	if (!bufmgr_gem->aub_file)
+	if (!bufmgr_gem->aub_writer)
 		return;
 
 	/* If batch buffer is not annotated, annotate it the best we
@@ -2292,19 +3756,46 @@ aub_exec(drm_intel_bo *bo, int ring_flag, int used)
 		drm_intel_bufmgr_gem_set_aub_annotations(bo, annotations, 2);
 	}
 
-	/* Write out all buffers to AUB memory */
+	/* Assign AUB addresses up front, so we know whether each buffer
+	 * lands where it did in the previous exec.
+	 */
+	layout = 0xcbf29ce484222325ull;
 	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		aub_write_bo(bufmgr_gem->exec_bos[i]);
+		drm_intel_bo *exec_bo = bufmgr_gem->exec_bos[i];
+		drm_intel_bo_gem *exec_bo_gem = (drm_intel_bo_gem *) exec_bo;
+		uint32_t key[3];
+
+		aub_bo_get_address(exec_bo);
+
+		key[0] = exec_bo_gem->gem_handle;
+		key[1] = exec_bo_gem->aub_offset;
+		key[2] = exec_bo->size;
+		layout = aub_hash(layout, key, 3);
+	}
+	same_layout = layout == bufmgr_gem->aub_layout_hash;
+	bufmgr_gem->aub_layout_hash = layout;
+
+	/* Write out all buffers to AUB memory */
+	for (i = 0; i < bufmgr_gem->exec_count && ret == 0; i++) {
+		ret = aub_write_bo(bufmgr_gem->exec_bos[i], same_layout);
 	}
 
 	/* Remove any annotations we added */
 	if (batch_buffer_needs_annotations)
 		drm_intel_bufmgr_gem_set_aub_annotations(bo, NULL, 0);
 
-	/* Dump ring buffer */
-	aub_build_dump_ringbuffer(bufmgr_gem, bo_gem->aub_offset, ring_flag);
+	if (ret == 0) {
+		/* Dump ring buffer */
+		aub_build_dump_ringbuffer(bufmgr_gem, bo_gem->aub_offset,
+					  ring_flag);
+
+		ret = aub_writer_submit(bufmgr_gem->aub_writer);
+	}
 
-	fflush(bufmgr_gem->aub_file);
+	if (ret) {
+		aub_writer_destroy(bufmgr_gem->aub_writer, ret);
+		bufmgr_gem->aub_writer = NULL;
+	}
 
 	/*
 	 * One frame has been dumped. So reset the aub_offset for the next frame.
@@ -2314,6 +3805,27 @@ aub_exec(drm_intel_bo *bo, int ring_flag, int used)
 	bufmgr_gem->aub_offset = 0x10000;
 }
 
+/* Called with the lock held, before the validate list is torn down */
+static void
+drm_intel_gem_account_exec(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo *batch)
+{
+	uint64_t relocs = 0;
+	int i;
+
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo_gem *bo_gem =
+			(drm_intel_bo_gem *) bufmgr_gem->exec_bos[i];
+
+		relocs += bo_gem->reloc_count;
+	}
+
+	bufmgr_gem->stats.execs++;
+	bufmgr_gem->stats.relocs += relocs;
+	drm_intel_gem_trace(bufmgr_gem, DRM_INTEL_GEM_TRACE_EXEC,
+			    batch, relocs);
+}
+
 static int
 drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 		      drm_clip_rect_t * cliprects, int num_cliprects, int DR4)
@@ -2321,6 +3833,7 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_execbuffer execbuf;
+	uint32_t seqno;
 	int ret, i;
 
 	if (bo_gem->has_error)
@@ -2363,15 +3876,18 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 		}
 	}
 	drm_intel_update_buffer_offsets(bufmgr_gem);
+	drm_intel_gem_account_exec(bufmgr_gem, bo);
 
 	if (bufmgr_gem->bufmgr.debug)
 		drm_intel_gem_dump_validation_list(bufmgr_gem);
 
+	seqno = ret == 0 ? drm_intel_gem_next_exec_seqno(bufmgr_gem) : 0;
 	for (i = 0; i < bufmgr_gem->exec_count; i++) {
 		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
-		bo_gem->idle = false;
+		drm_intel_gem_bo_mark_exec(bufmgr_gem, bo_gem, seqno,
+					   I915_EXEC_RENDER, 0);
 
 		/* Disconnect the buffer from the validate list */
 		bo_gem->validate_index = -1;
@@ -2384,15 +3900,8 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 }
 
 static int
-do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
-	 drm_clip_rect_t *cliprects, int num_cliprects, int DR4,
-	 unsigned int flags)
+check_exec2_ring(drm_intel_bufmgr_gem *bufmgr_gem, unsigned int flags)
 {
-	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
-	struct drm_i915_gem_execbuffer2 execbuf;
-	int ret = 0;
-	int i;
-
 	switch (flags & 0x7) {
 	default:
 		return -EINVAL;
@@ -2413,7 +3922,21 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		break;
 	}
 
-	pthread_mutex_lock(&bufmgr_gem->lock);
+	return 0;
+}
+
+/* Called with the lock held and the ring already checked */
+static int
+do_exec2_locked(drm_intel_bo *bo, int used, drm_intel_context *ctx,
+		drm_clip_rect_t *cliprects, int num_cliprects, int DR4,
+		unsigned int flags)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
+	struct drm_i915_gem_execbuffer2 execbuf;
+	uint32_t seqno;
+	int ret = 0;
+	int i;
+
 	/* Update indices and set up the validate list. */
 	drm_intel_gem_bo_process_reloc2(bo);
 
@@ -2459,22 +3982,46 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		}
 	}
 	drm_intel_update_buffer_offsets2(bufmgr_gem);
+	drm_intel_gem_account_exec(bufmgr_gem, bo);
 
 skip_execution:
+
 	if (bufmgr_gem->bufmgr.debug)
 		drm_intel_gem_dump_validation_list(bufmgr_gem);
 
+	seqno = ret == 0 ? drm_intel_gem_next_exec_seqno(bufmgr_gem) : 0;
 	for (i = 0; i < bufmgr_gem->exec_count; i++) {
 		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
 
-		bo_gem->idle = false;
+		drm_intel_gem_bo_mark_exec(bufmgr_gem, bo_gem, seqno,
+					   exec_ring_index(flags),
+					   ctx ? ctx->serial : 0);
 
 		/* Disconnect the buffer from the validate list */
 		bo_gem->validate_index = -1;
 		bufmgr_gem->exec_bos[i] = NULL;
 	}
 	bufmgr_gem->exec_count = 0;
+
+	return ret;
+}
+
+static int
+do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
+	 drm_clip_rect_t *cliprects, int num_cliprects, int DR4,
+	 unsigned int flags)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
+	int ret;
+
+	ret = check_exec2_ring(bufmgr_gem, flags);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	ret = do_exec2_locked(bo, used, ctx, cliprects, num_cliprects, DR4,
+			      flags);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	return ret;
@@ -2505,6 +4052,63 @@ drm_intel_gem_bo_context_exec(drm_intel_bo *bo, drm_intel_context *ctx,
 	return do_exec2(bo, used, ctx, NULL, 0, 0, flags);
 }
 
+/**
+ * Submits \p count batches in array order, with the same result as one
+ * drm_intel_gem_bo_context_exec() call per batch, but taking the bufmgr
+ * lock once for the whole array.
+ *
+ * All batches must come from the same bufmgr, and every ring is checked
+ * before anything is submitted.  The kernel still takes one batch per
+ * execbuffer, so each batch gets its own validate list.  Offsets are
+ * updated after every batch, so relocation targets shared with an
+ * earlier batch go in with up-to-date presumed offsets.
+ *
+ * Submission stops at the first batch the kernel rejects: its error is
+ * returned and, if \p failed is not NULL, its index is stored there.
+ * The batches before it have been submitted.  A batch failing the checks
+ * is reported the same way, with nothing submitted.
+ */
+drm_public int
+drm_intel_gem_bo_exec_batches(const struct drm_intel_gem_exec_batch *batches,
+			      int count, int *failed)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem;
+	int i, ret = 0;
+
+	if (count <= 0)
+		return 0;
+
+	bufmgr_gem = (drm_intel_bufmgr_gem *)batches[0].bo->bufmgr;
+
+	for (i = 0; i < count; i++) {
+		if (bufmgr_gem->bufmgr.bo_mrb_exec == NULL ||
+		    batches[i].bo->bufmgr != &bufmgr_gem->bufmgr)
+			ret = -EINVAL;
+		else
+			ret = check_exec2_ring(bufmgr_gem, batches[i].flags);
+		if (ret) {
+			if (failed)
+				*failed = i;
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	for (i = 0; i < count; i++) {
+		ret = do_exec2_locked(batches[i].bo, batches[i].used,
+				      batches[i].ctx, NULL, 0, 0,
+				      batches[i].flags);
+		if (ret) {
+			if (failed)
+				*failed = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return ret;
+}
+
 static int
 drm_intel_gem_bo_pin(drm_intel_bo *bo, uint32_t alignment)
 {
@@ -3021,10 +4625,13 @@ static void
 add_bucket(drm_intel_bufmgr_gem *bufmgr_gem, int size)
 {
 	unsigned int i = bufmgr_gem->num_buckets;
+	int j;
 
 	assert(i < ARRAY_SIZE(bufmgr_gem->cache_bucket));
 
 	DRMINITLISTHEAD(&bufmgr_gem->cache_bucket[i].head);
+	for (j = 0; j < BO_CACHE_TILING_LISTS; j++)
+		DRMINITLISTHEAD(&bufmgr_gem->cache_bucket[i].tiling[j]);
 	bufmgr_gem->cache_bucket[i].size = size;
 	bufmgr_gem->num_buckets++;
 }
@@ -3066,6 +4673,174 @@ drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr, int limit)
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
 }
 
+/**
+ * Sets the number of bytes of idle CPU and GTT mappings kept around for
+ * reuse, or -1 for no byte limit.
+ *
+ * When either this or the count set by
+ * drm_intel_bufmgr_gem_set_vma_cache_size() is exceeded, large mappings
+ * that have been idle the longest are unmapped first.
+ */
+drm_public void
+drm_intel_bufmgr_gem_set_vma_cache_bytes(drm_intel_bufmgr *bufmgr, long limit)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->vma_bytes_max = limit;
+	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Returns how many buffer maps reused an existing mapping (\p hits) or had
+ * to create one (\p misses), and how many bytes of idle mappings are
+ * currently cached.  Any of the pointers may be NULL.
+ */
+drm_public void
+drm_intel_bufmgr_gem_get_vma_cache_stats(drm_intel_bufmgr *bufmgr,
+					 uint64_t *hits, uint64_t *misses,
+					 unsigned long *cached_bytes)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (hits)
+		*hits = bufmgr_gem->stats.vma_hits;
+	if (misses)
+		*misses = bufmgr_gem->stats.vma_misses;
+	if (cached_bytes)
+		*cached_bytes = bufmgr_gem->vma_bytes;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Enables timing of waits and map syncs for drm_intel_bufmgr_gem_get_stats().
+ *
+ * The other counters are always maintained.  Setting INTEL_BUFMGR_STATS in
+ * the environment enables timing and dumps the stats to stderr when the
+ * bufmgr is destroyed.
+ */
+drm_public void
+drm_intel_bufmgr_gem_enable_stats(drm_intel_bufmgr *bufmgr, int enable)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	bufmgr_gem->stats_enabled = enable;
+}
+
+/**
+ * Installs a callback invoked on every allocation, BO cache hit and miss,
+ * purge, exec, wait for rendering and map sync, or removes it if \p func
+ * is NULL.
+ *
+ * The callback may run with the bufmgr lock held and from any thread that
+ * uses the bufmgr, so it must be cheap and must not call back into
+ * libdrm_intel.
+ */
+drm_public void
+drm_intel_bufmgr_gem_set_trace_callback(drm_intel_bufmgr *bufmgr,
+					drm_intel_gem_trace_func func,
+					void *data)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->trace_func = func;
+	bufmgr_gem->trace_data = data;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+drm_public void
+drm_intel_bufmgr_gem_get_stats(drm_intel_bufmgr *bufmgr,
+			       struct drm_intel_gem_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	*stats = bufmgr_gem->stats;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Returns the size, hit and miss counts and currently cached bytes of BO
+ * cache bucket \p bucket, or -EINVAL once \p bucket is past the last one.
+ * Any of the pointers may be NULL.
+ */
+drm_public int
+drm_intel_bufmgr_gem_get_bucket_stats(drm_intel_bufmgr *bufmgr, int bucket,
+				      unsigned long *size,
+				      uint64_t *hits, uint64_t *misses,
+				      unsigned long *cached_bytes)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+	struct drm_intel_gem_bo_bucket *b;
+
+	if (bucket < 0 || bucket >= bufmgr_gem->num_buckets)
+		return -EINVAL;
+
+	b = &bufmgr_gem->cache_bucket[bucket];
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (size)
+		*size = b->size;
+	if (hits)
+		*hits = b->hits;
+	if (misses)
+		*misses = b->misses;
+	if (cached_bytes)
+		*cached_bytes = b->num_cached * b->size;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return 0;
+}
+
+drm_public void
+drm_intel_bufmgr_gem_dump_stats(drm_intel_bufmgr *bufmgr, FILE *file)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+	struct drm_intel_gem_stats *stats = &bufmgr_gem->stats;
+	int i;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	fprintf(file, "libdrm_intel: bufmgr stats\n");
+	fprintf(file, "  allocs %llu, cache hits %llu, misses %llu, "
+		"cached %llu bytes, purged %llu\n",
+		(unsigned long long)stats->allocs,
+		(unsigned long long)stats->cache_hits,
+		(unsigned long long)stats->cache_misses,
+		(unsigned long long)stats->cached_bytes,
+		(unsigned long long)stats->purged);
+	fprintf(file, "  set_tiling avoided %llu, needed %llu\n",
+		(unsigned long long)stats->set_tiling_avoided,
+		(unsigned long long)stats->set_tiling_needed);
+	fprintf(file, "  execs %llu, relocs %llu (%.1f per exec)\n",
+		(unsigned long long)stats->execs,
+		(unsigned long long)stats->relocs,
+		stats->execs ? (double)stats->relocs / stats->execs : 0.0);
+	fprintf(file, "  waits %llu (%.3f ms), map syncs %llu (%.3f ms)\n",
+		(unsigned long long)stats->waits, stats->wait_ns / 1e6,
+		(unsigned long long)stats->map_syncs,
+		stats->map_sync_ns / 1e6);
+	fprintf(file, "  vma hits %llu, misses %llu\n",
+		(unsigned long long)stats->vma_hits,
+		(unsigned long long)stats->vma_misses);
+	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+		struct drm_intel_gem_bo_bucket *bucket =
+		    &bufmgr_gem->cache_bucket[i];
+
+		if (bucket->hits == 0 && bucket->misses == 0 &&
+		    bucket->num_cached == 0)
+			continue;
+
+		fprintf(file, "  bucket %9lu: hits %llu, misses %llu, "
+			"cached %lu\n", bucket->size,
+			(unsigned long long)bucket->hits,
+			(unsigned long long)bucket->misses,
+			bucket->num_cached);
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
 /**
  * Get the PCI ID for the device.  This can be overridden by setting the
  * INTEL_DEVID_OVERRIDE environment variable to the desired ID.
@@ -3110,7 +4885,8 @@ drm_intel_bufmgr_gem_get_devid(drm_intel_bufmgr *bufmgr)
  * Sets the AUB filename.
  *
  * This function has to be called before drm_intel_bufmgr_gem_set_aub_dump()
- * for it to have any effect.
+ * for it to have any effect.  If the name ends in ".gz", the trace is
+ * compressed by piping it through gzip as it is written.
  */
 drm_public void
 drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
@@ -3130,6 +4906,11 @@ drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
  * Packets are emitted in a format somewhat like GPU command packets.
  * You can set up a GTT and upload your objects into the referenced
  * space, then send off batchbuffers and get BMPs out the other end.
+ *
+ * The trace is written out by a background thread; disabling dumping
+ * (or destroying the bufmgr) flushes and closes the file.  If the trace
+ * cannot be written, the error is reported on stderr and dumping is
+ * disabled; batches keep being submitted.
  */
 drm_public void
 drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
@@ -3140,14 +4921,14 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 	int gtt_size = 0x10000;
 	const char *filename;
 
-	if (!enable) {
-		if (bufmgr_gem->aub_file) {
-			fclose(bufmgr_gem->aub_file);
-			bufmgr_gem->aub_file = NULL;
-		}
-		return;
+	if (bufmgr_gem->aub_writer) {
+		aub_writer_destroy(bufmgr_gem->aub_writer, 0);
+		bufmgr_gem->aub_writer = NULL;
 	}
 
+	if (!enable)
+		return;
+
 	if (geteuid() != getuid())
 		return;
 
@@ -3155,12 +4936,13 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 		filename = bufmgr_gem->aub_filename;
 	else
 		filename = "intel.aub";
-	bufmgr_gem->aub_file = fopen(filename, "w+");
-	if (!bufmgr_gem->aub_file)
+	bufmgr_gem->aub_writer = aub_writer_create(filename);
+	if (!bufmgr_gem->aub_writer)
 		return;
 
 	/* Start allocating objects from just after the GTT. */
 	bufmgr_gem->aub_offset = gtt_size;
+	bufmgr_gem->aub_layout_hash = 0;
 
 	/* Start with a (required) version packet. */
 	aub_out(bufmgr_gem, CMD_AUB_HEADER | (13 - 2));
@@ -3211,6 +4993,12 @@ drm_intel_gem_context_create(drm_intel_bufmgr *bufmgr)
 	context->ctx_id = create.ctx_id;
 	context->bufmgr = bufmgr;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (++bufmgr_gem->ctx_serial == 0)
+		bufmgr_gem->ctx_serial = 1;
+	context->serial = bufmgr_gem->ctx_serial;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
 	return context;
 }
 
@@ -3424,7 +5212,7 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	drm_intel_bufmgr_gem *bufmgr_gem;
 	struct drm_i915_gem_get_aperture aperture;
 	drm_i915_getparam_t gp;
-	int ret, tmp;
+	int ret, tmp, i;
 	bool exec2 = false;
 
 	pthread_mutex_lock(&bufmgr_list_mutex);
@@ -3445,6 +5233,7 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 		bufmgr_gem = NULL;
 		goto exit;
 	}
+	pthread_mutex_init(&bufmgr_gem->retired_lock, NULL);
 
 	ret = drmIoctl(bufmgr_gem->fd,
 		       DRM_IOCTL_I915_GEM_GET_APERTURE,
@@ -3580,6 +5369,8 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	bufmgr_gem->bufmgr.bo_unmap = drm_intel_gem_bo_unmap;
 	bufmgr_gem->bufmgr.bo_subdata = drm_intel_gem_bo_subdata;
 	bufmgr_gem->bufmgr.bo_get_subdata = drm_intel_gem_bo_get_subdata;
+	bufmgr_gem->bufmgr.bo_subdatav = drm_intel_gem_bo_subdatav;
+	bufmgr_gem->bufmgr.bo_get_subdatav = drm_intel_gem_bo_get_subdatav;
 	bufmgr_gem->bufmgr.bo_wait_rendering = drm_intel_gem_bo_wait_rendering;
 	bufmgr_gem->bufmgr.bo_emit_reloc = drm_intel_gem_bo_emit_reloc;
 	bufmgr_gem->bufmgr.bo_emit_reloc_fence = drm_intel_gem_bo_emit_reloc_fence;
@@ -3609,8 +5400,26 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	DRMINITLISTHEAD(&bufmgr_gem->named);
 	init_cache_buckets(bufmgr_gem);
 
-	DRMINITLISTHEAD(&bufmgr_gem->vma_cache);
+	for (i = 0; i < VMA_CACHE_BUCKETS; i++)
+		DRMINITLISTHEAD(&bufmgr_gem->vma_cache[i]);
 	bufmgr_gem->vma_max = -1; /* unlimited by default */
+	bufmgr_gem->vma_bytes_max = -1;
+
+	bufmgr_gem->subdata_crossover = SUBDATA_CROSSOVER_DEFAULT;
+	if (geteuid() == getuid()) {
+		char *crossover = getenv("INTEL_SUBDATA_CROSSOVER");
+		if (crossover)
+			bufmgr_gem->subdata_crossover =
+				strtoul(crossover, NULL, 0);
+	}
+
+	if (getenv("INTEL_BUFMGR_STATS")) {
+		bufmgr_gem->stats_enabled = true;
+		bufmgr_gem->stats_dump = true;
+	}
+
+	DRMINITLISTHEAD(&bufmgr_gem->userptr_pool);
+	DRMINITLISTHEAD(&bufmgr_gem->userptr_arenas);
 
 	DRMLISTADD(&bufmgr_gem->managers, &bufmgr_list);
 
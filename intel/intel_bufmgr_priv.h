@@ -137,6 +137,26 @@ struct _drm_intel_bufmgr {
 	int (*bo_get_subdata) (drm_intel_bo *bo, unsigned long offset,
 			       unsigned long size, void *data);
 
+	/**
+	 * Write a list of ranges into an object in one call.
+	 *
+	 * This is an optional function, if missing, drm_intel_bo will
+	 * call bo_subdata for each range.
+	 */
+	int (*bo_subdatav) (drm_intel_bo *bo,
+			    const struct drm_intel_bo_range *ranges,
+			    int count);
+
+	/**
+	 * Read a list of ranges from an object in one call.
+	 *
+	 * This is an optional function, if missing, drm_intel_bo will
+	 * call drm_intel_bo_get_subdata for each range.
+	 */
+	int (*bo_get_subdatav) (drm_intel_bo *bo,
+				const struct drm_intel_bo_range *ranges,
+				int count);
+
 	/**
 	 * Waits for rendering to an object by the GPU to have completed.
 	 *
@@ -295,6 +315,8 @@ struct _drm_intel_bufmgr {
 struct _drm_intel_context {
 	unsigned int ctx_id;
 	struct _drm_intel_bufmgr *bufmgr;
+	/** Unique within the bufmgr, unlike ctx_id which the kernel reuses */
+	uint32_t serial;
 };
 
 #define ALIGN(value, alignment)	((value + alignment - 1) & ~(alignment - 1))
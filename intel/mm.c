@@ -23,18 +23,140 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <assert.h>
 
 #include "xf86drm.h"
 #include "mm.h"
 
+/**
+ * Free blocks are kept on segregated lists: bin n holds the free blocks
+ * whose size is in [2^n, 2^(n+1)).  bin_mask has bit n set when bin n is
+ * non-empty, so an allocation only looks at the one bin that may hold
+ * blocks smaller than the request and then takes the first block of the
+ * next non-empty bin, instead of walking every free block in the heap.
+ */
+#define MM_NUM_BINS	32
+
+/** Number of mem_blocks carved out of each pool allocation. */
+#define MM_POOL_BLOCKS	64
+
+struct mem_pool {
+	struct mem_pool *next;
+	struct mem_block blocks[MM_POOL_BLOCKS];
+};
+
+struct mem_heap {
+	/** Sentinel of the address-ordered block list; what mmInit returns. */
+	struct mem_block head;
+	/** Sentinels of the free lists. */
+	struct mem_block bins[MM_NUM_BINS];
+	unsigned int bin_mask;
+
+	/** Pool allocations, and unused blocks chained through ->next. */
+	struct mem_pool *pools;
+	struct mem_block *spare;
+
+	int size;
+	int free_size;
+	int free_blocks;
+	int used_blocks;
+};
+
+static struct mem_heap *to_heap(const struct mem_block *heap)
+{
+	return (struct mem_heap *)heap;
+}
+
+static int size_bin(int size)
+{
+	int bin = 0;
+
+	while (size >>= 1)
+		bin++;
+
+	return bin;
+}
+
+static struct mem_block *get_block(struct mem_heap *heap)
+{
+	struct mem_block *block;
+
+	if (!heap->spare) {
+		struct mem_pool *pool;
+		int i;
+
+		pool = (struct mem_pool *)malloc(sizeof(*pool));
+		if (!pool)
+			return NULL;
+
+		pool->next = heap->pools;
+		heap->pools = pool;
+
+		for (i = 0; i < MM_POOL_BLOCKS; i++) {
+			pool->blocks[i].next = heap->spare;
+			heap->spare = &pool->blocks[i];
+		}
+	}
+
+	block = heap->spare;
+	heap->spare = block->next;
+
+	memset(block, 0, sizeof(*block));
+	block->heap = &heap->head;
+
+	return block;
+}
+
+static void put_block(struct mem_heap *heap, struct mem_block *block)
+{
+	block->next = heap->spare;
+	heap->spare = block;
+}
+
+static void insert_free(struct mem_heap *heap, struct mem_block *p)
+{
+	int bin = size_bin(p->size);
+	struct mem_block *head = &heap->bins[bin];
+
+	p->free = 1;
+	p->next_free = head->next_free;
+	p->prev_free = head;
+	head->next_free->prev_free = p;
+	head->next_free = p;
+
+	heap->bin_mask |= 1u << bin;
+	heap->free_size += p->size;
+	heap->free_blocks++;
+}
+
+static void remove_free(struct mem_heap *heap, struct mem_block *p)
+{
+	int bin = size_bin(p->size);
+
+	p->next_free->prev_free = p->prev_free;
+	p->prev_free->next_free = p->next_free;
+	p->next_free = NULL;
+	p->prev_free = NULL;
+	p->free = 0;
+
+	if (heap->bins[bin].next_free == &heap->bins[bin])
+		heap->bin_mask &= ~(1u << bin);
+	heap->free_size -= p->size;
+	heap->free_blocks--;
+}
+
 void mmDumpMemInfo(const struct mem_block *heap)
 {
 	drmMsg("Memory heap %p:\n", (void *)heap);
 	if (heap == 0) {
 		drmMsg("  heap == 0\n");
 	} else {
+		const struct mem_heap *h = to_heap(heap);
 		const struct mem_block *p;
+		struct mem_stats stats;
+		int bin;
 
 		for (p = heap->next; p != heap; p = p->next) {
 			drmMsg("  Offset:%08x, Size:%08x, %c%c\n", p->ofs,
@@ -44,151 +166,206 @@ void mmDumpMemInfo(const struct mem_block *heap)
 
 		drmMsg("\nFree list:\n");
 
-		for (p = heap->next_free; p != heap; p = p->next_free) {
-			drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n", p->ofs,
-			       p->size, p->free ? 'F' : '.',
-			       p->reserved ? 'R' : '.');
+		for (bin = 0; bin < MM_NUM_BINS; bin++) {
+			const struct mem_block *head = &h->bins[bin];
+
+			for (p = head->next_free; p != head; p = p->next_free) {
+				drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n",
+				       p->ofs, p->size, p->free ? 'F' : '.',
+				       p->reserved ? 'R' : '.');
+			}
 		}
 
+		mmGetStats(heap, &stats);
+		drmMsg("\n%d bytes free in %d blocks, largest %d, "
+		       "%d blocks allocated, fragmentation %d%%\n",
+		       stats.free_size, stats.free_blocks,
+		       stats.largest_free, stats.used_blocks,
+		       stats.fragmentation);
 	}
 	drmMsg("End of memory blocks\n");
 }
 
 struct mem_block *mmInit(int ofs, int size)
 {
-	struct mem_block *heap, *block;
+	struct mem_heap *heap;
+	struct mem_block *block;
+	int i;
 
 	if (size <= 0)
 		return NULL;
 
-	heap = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+	heap = (struct mem_heap *)calloc(1, sizeof(struct mem_heap));
 	if (!heap)
 		return NULL;
 
-	block = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+	heap->head.next = &heap->head;
+	heap->head.prev = &heap->head;
+	for (i = 0; i < MM_NUM_BINS; i++) {
+		heap->bins[i].next_free = &heap->bins[i];
+		heap->bins[i].prev_free = &heap->bins[i];
+	}
+
+	block = get_block(heap);
 	if (!block) {
 		free(heap);
 		return NULL;
 	}
 
-	heap->next = block;
-	heap->prev = block;
-	heap->next_free = block;
-	heap->prev_free = block;
-
-	block->heap = heap;
-	block->next = heap;
-	block->prev = heap;
-	block->next_free = heap;
-	block->prev_free = heap;
+	block->next = &heap->head;
+	block->prev = &heap->head;
+	heap->head.next = block;
+	heap->head.prev = block;
 
 	block->ofs = ofs;
 	block->size = size;
-	block->free = 1;
+	heap->size = size;
+	insert_free(heap, block);
 
-	return heap;
+	return &heap->head;
+}
+
+/* Inserts a new block of the given extent after p in address order. */
+static struct mem_block *InsertBlock(struct mem_heap *heap,
+				     struct mem_block *p, int ofs, int size)
+{
+	struct mem_block *newblock;
+
+	newblock = get_block(heap);
+	if (!newblock)
+		return NULL;
+
+	newblock->ofs = ofs;
+	newblock->size = size;
+
+	newblock->next = p->next;
+	newblock->prev = p;
+	p->next->prev = newblock;
+	p->next = newblock;
+
+	return newblock;
 }
 
 static struct mem_block *SliceBlock(struct mem_block *p,
 				    int startofs, int size,
 				    int reserved, int alignment)
 {
+	struct mem_heap *heap = to_heap(p->heap);
 	struct mem_block *newblock;
 
+	remove_free(heap, p);
+
 	/* break left  [p, newblock, p->next], then p = newblock */
 	if (startofs > p->ofs) {
-		newblock =
-		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+		newblock = InsertBlock(heap, p, startofs,
+				       p->size - (startofs - p->ofs));
+		if (!newblock) {
+			insert_free(heap, p);
 			return NULL;
-		newblock->ofs = startofs;
-		newblock->size = p->size - (startofs - p->ofs);
-		newblock->free = 1;
-		newblock->heap = p->heap;
-
-		newblock->next = p->next;
-		newblock->prev = p;
-		p->next->prev = newblock;
-		p->next = newblock;
-
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
+		}
 
 		p->size -= newblock->size;
+		insert_free(heap, p);
 		p = newblock;
 	}
 
 	/* break right, also [p, newblock, p->next] */
 	if (size < p->size) {
-		newblock =
-		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+		newblock = InsertBlock(heap, p, startofs + size,
+				       p->size - size);
+		if (!newblock) {
+			insert_free(heap, p);
 			return NULL;
-		newblock->ofs = startofs + size;
-		newblock->size = p->size - size;
-		newblock->free = 1;
-		newblock->heap = p->heap;
-
-		newblock->next = p->next;
-		newblock->prev = p;
-		p->next->prev = newblock;
-		p->next = newblock;
-
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
+		}
 
 		p->size = size;
+		insert_free(heap, newblock);
 	}
 
 	/* p = middle block */
-	p->free = 0;
+	p->reserved = reserved;
+	heap->used_blocks++;
+	return p;
+}
 
-	/* Remove p from the free list: 
-	 */
-	p->next_free->prev_free = p->prev_free;
-	p->prev_free->next_free = p->next_free;
+/* Returns where a block of the given size and alignment could start in
+ * free block p, or -1 if it doesn't fit.
+ */
+static int FitBlock(const struct mem_block *p, int size, int mask,
+		    int startSearch)
+{
+	int startofs = (p->ofs + mask) & ~mask;
 
-	p->next_free = 0;
-	p->prev_free = 0;
+	if (startofs < startSearch)
+		startofs = startSearch;
+	if (startofs + size > p->ofs + p->size)
+		return -1;
 
-	p->reserved = reserved;
-	return p;
+	return startofs;
+}
+
+static struct mem_block *SearchBin(struct mem_heap *heap, int bin,
+				   int size, int mask, int startSearch)
+{
+	struct mem_block *head = &heap->bins[bin];
+	struct mem_block *p;
+	int startofs;
+
+	for (p = head->next_free; p != head; p = p->next_free) {
+		assert(p->free);
+
+		startofs = FitBlock(p, size, mask, startSearch);
+		if (startofs >= 0)
+			return SliceBlock(p, startofs, size, 0, mask + 1);
+	}
+
+	return NULL;
 }
 
 struct mem_block *mmAllocMem(struct mem_block *heap, int size, int align2,
 			     int startSearch)
 {
+	struct mem_heap *h = to_heap(heap);
 	struct mem_block *p;
 	const int mask = (1 << align2) - 1;
-	int startofs = 0;
-	int endofs;
+	unsigned int bins;
+	int bin, fit_bin;
 
 	if (!heap || align2 < 0 || size <= 0)
 		return NULL;
 
-	for (p = heap->next_free; p != heap; p = p->next_free) {
-		assert(p->free);
+	/* Blocks in fit_bin and above are at least size + mask bytes and
+	 * so fit whatever their alignment.  Blocks in the bins below it
+	 * may or may not fit; look there first so that small requests
+	 * don't carve up large free blocks.
+	 */
+	fit_bin = size_bin(size + mask);
+	if ((size + mask) & (size + mask - 1))
+		fit_bin++;
 
-		startofs = (p->ofs + mask) & ~mask;
-		if (startofs < startSearch) {
-			startofs = startSearch;
-		}
-		endofs = startofs + size;
-		if (endofs <= (p->ofs + p->size))
-			break;
+	for (bin = size_bin(size); bin < fit_bin && bin < MM_NUM_BINS; bin++) {
+		if (!(h->bin_mask & (1u << bin)))
+			continue;
+
+		p = SearchBin(h, bin, size, mask, startSearch);
+		if (p)
+			return p;
 	}
 
-	if (p == heap)
-		return NULL;
+	bins = 0;
+	if (fit_bin < MM_NUM_BINS)
+		bins = h->bin_mask & ~((1u << fit_bin) - 1);
+	while (bins) {
+		bin = ffs(bins) - 1;
 
-	assert(p->free);
-	p = SliceBlock(p, startofs, size, 0, mask + 1);
+		p = SearchBin(h, bin, size, mask, startSearch);
+		if (p)
+			return p;
 
-	return p;
+		bins &= ~(1u << bin);
+	}
+
+	return NULL;
 }
 
 struct mem_block *mmFindBlock(struct mem_block *heap, int start)
@@ -203,32 +380,26 @@ struct mem_block *mmFindBlock(struct mem_block *heap, int start)
 	return NULL;
 }
 
-static int Join2Blocks(struct mem_block *p)
+/* Merges the block after p into p; both must be free and off the free
+ * lists.
+ */
+static void Join2Blocks(struct mem_heap *heap, struct mem_block *p)
 {
-	/* XXX there should be some assertions here */
-
-	/* NOTE: heap->free == 0 */
-
-	if (p->free && p->next->free) {
-		struct mem_block *q = p->next;
+	struct mem_block *q = p->next;
 
-		assert(p->ofs + p->size == q->ofs);
-		p->size += q->size;
+	assert(p->ofs + p->size == q->ofs);
+	p->size += q->size;
 
-		p->next = q->next;
-		q->next->prev = p;
+	p->next = q->next;
+	q->next->prev = p;
 
-		q->next_free->prev_free = q->prev_free;
-		q->prev_free->next_free = q->next_free;
-
-		free(q);
-		return 1;
-	}
-	return 0;
+	put_block(heap, q);
 }
 
 int mmFreeMem(struct mem_block *b)
 {
+	struct mem_heap *heap;
+
 	if (!b)
 		return 0;
 
@@ -241,31 +412,73 @@ int mmFreeMem(struct mem_block *b)
 		return -1;
 	}
 
-	b->free = 1;
-	b->next_free = b->heap->next_free;
-	b->prev_free = b->heap;
-	b->next_free->prev_free = b;
-	b->prev_free->next_free = b;
+	heap = to_heap(b->heap);
+	heap->used_blocks--;
+
+	/* NOTE: heap->head.free == 0 */
+	if (b->next->free) {
+		remove_free(heap, b->next);
+		Join2Blocks(heap, b);
+	}
+	if (b->prev->free) {
+		b = b->prev;
+		remove_free(heap, b);
+		Join2Blocks(heap, b);
+	}
 
-	Join2Blocks(b);
-	if (b->prev != b->heap)
-		Join2Blocks(b->prev);
+	insert_free(heap, b);
 
 	return 0;
 }
 
+void mmGetStats(const struct mem_block *heap, struct mem_stats *stats)
+{
+	const struct mem_heap *h = to_heap(heap);
+	const struct mem_block *p, *head;
+	int bin;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!heap)
+		return;
+
+	stats->size = h->size;
+	stats->free_size = h->free_size;
+	stats->free_blocks = h->free_blocks;
+	stats->used_blocks = h->used_blocks;
+
+	/* The largest free block is in the highest non-empty bin. */
+	for (bin = MM_NUM_BINS - 1; bin >= 0; bin--) {
+		if (!(h->bin_mask & (1u << bin)))
+			continue;
+
+		head = &h->bins[bin];
+		for (p = head->next_free; p != head; p = p->next_free) {
+			if (p->size > stats->largest_free)
+				stats->largest_free = p->size;
+		}
+		break;
+	}
+
+	/* Share of the free space that is not in the largest free block. */
+	if (stats->free_size) {
+		stats->fragmentation = 100 -
+			(int)((long long)stats->largest_free * 100 /
+			      stats->free_size);
+	}
+}
+
 void mmDestroy(struct mem_block *heap)
 {
-	struct mem_block *p;
+	struct mem_heap *h = to_heap(heap);
+	struct mem_pool *pool;
 
 	if (!heap)
 		return;
 
-	for (p = heap->next; p != heap;) {
-		struct mem_block *next = p->next;
-		free(p);
-		p = next;
+	while ((pool = h->pools) != NULL) {
+		h->pools = pool->next;
+		free(pool);
 	}
 
-	free(heap);
+	free(h);
 }
@@ -47,6 +47,18 @@ struct mem_block {
 #define mmFindBlock drm_mmFindBlock
 #define mmDestroy drm_mmDestroy
 #define mmDumpMemInfo drm_mmDumpMemInfo
+#define mmGetStats drm_mmGetStats
+
+/** Heap usage and fragmentation, as reported by mmGetStats(). */
+struct mem_stats {
+	int size;		/**< total size of the heap */
+	int free_size;		/**< bytes in free blocks */
+	int free_blocks;	/**< number of free blocks */
+	int largest_free;	/**< size of the largest free block */
+	int used_blocks;	/**< number of allocated blocks */
+	/** Percentage of the free space outside the largest free block. */
+	int fragmentation;
+};
 
 /** 
  * input: total size in bytes
@@ -91,4 +103,10 @@ extern void mmDestroy(struct mem_block *mmInit);
  */
 extern void mmDumpMemInfo(const struct mem_block *mmInit);
 
+/**
+ * Report usage and fragmentation statistics
+ * input: pointer to a heap, statistics to fill in
+ */
+extern void mmGetStats(const struct mem_block *heap, struct mem_stats *stats);
+
 #endif
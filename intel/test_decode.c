@@ -33,6 +33,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include "libdrm.h"
 #include "intel_bufmgr.h"
@@ -45,7 +47,7 @@ usage(void)
 {
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "  test_decode <batch>\n");
-	fprintf(stderr, "  test_decode <batch> -dump\n");
+	fprintf(stderr, "  test_decode <batch> -dump [-json] [-j <threads>]\n");
 	exit(1);
 }
 
@@ -86,6 +88,230 @@ dump_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	drm_intel_decode(ctx);
 }
 
+struct decode_chunk {
+	uint32_t *data;
+	uint32_t hw_offset;
+	uint32_t count;
+
+	char *text;
+	size_t size;
+	bool done;
+};
+
+struct decode_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	uint32_t devid;
+	enum drm_intel_decode_format format;
+
+	struct decode_chunk *chunks;
+	int num_chunks;
+	/** Next chunk to hand to a worker. */
+	int next;
+	/** Number of chunks already written out, in order. */
+	int written;
+	/** How far the workers may run ahead of the writer. */
+	int window;
+};
+
+/**
+ * Splits the batch into chunks ending at each MI_BATCH_BUFFER_END.
+ *
+ * Packet boundaries come from a serial pass in the binary record format,
+ * which is cheap next to the text decode, so that dwords which merely
+ * look like MI_BATCH_BUFFER_END inside a packet don't split it.
+ */
+static int
+split_batch(struct drm_intel_decode *ctx, uint32_t *data, uint32_t count,
+	    struct decode_chunk **chunks_out)
+{
+	struct drm_intel_decode_record *records;
+	struct decode_chunk *chunks = NULL;
+	int num_chunks = 0, max_chunks = 0;
+	uint32_t start = 0, end;
+	size_t i, size;
+	char *buf;
+	FILE *out;
+
+#ifdef HAVE_OPEN_MEMSTREAM
+	out = open_memstream(&buf, &size);
+#else
+	errx(1, "platform lacks open_memstream");
+#endif
+	if (!out)
+		errx(1, "out of memory");
+
+	drm_intel_decode_set_batch_pointer(ctx, data, HW_OFFSET, count);
+	drm_intel_decode_set_output_file(ctx, out);
+	drm_intel_decode_set_output_format(ctx, DRM_INTEL_DECODE_FORMAT_BINARY);
+	drm_intel_decode_set_dump_past_end(ctx, 1);
+	drm_intel_decode(ctx);
+	fclose(out);
+
+	records = (struct drm_intel_decode_record *)buf;
+	for (i = 0; i <= size / sizeof(*records); i++) {
+		if (i < size / sizeof(*records)) {
+			/* MI_BATCH_BUFFER_END */
+			if ((records[i].header & 0xff800000) != 0x05000000)
+				continue;
+
+			end = (records[i].hw_offset - HW_OFFSET) / 4 + 1;
+		} else {
+			end = count;
+		}
+		if (end > count)
+			end = count;
+		if (end <= start)
+			continue;
+
+		if (num_chunks == max_chunks) {
+			max_chunks = max_chunks ? max_chunks * 2 : 64;
+			chunks = realloc(chunks, max_chunks * sizeof(*chunks));
+			if (!chunks)
+				errx(1, "out of memory");
+		}
+
+		memset(&chunks[num_chunks], 0, sizeof(*chunks));
+		chunks[num_chunks].data = data + start;
+		chunks[num_chunks].hw_offset = HW_OFFSET + start * 4;
+		chunks[num_chunks].count = end - start;
+		num_chunks++;
+
+		start = end;
+	}
+
+	free(records);
+
+	*chunks_out = chunks;
+	return num_chunks;
+}
+
+/*
+ * Each chunk gets a fresh decode context: the gen2/3 S2/S4 vertex state
+ * a context keeps between calls would otherwise come from whichever chunk
+ * the worker happened to decode before.
+ */
+static void *
+decode_worker(void *arg)
+{
+	struct decode_pool *pool = arg;
+	struct drm_intel_decode *ctx;
+	struct decode_chunk *chunk;
+	FILE *out = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->num_chunks) {
+		if (pool->next >= pool->written + pool->window) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		chunk = &pool->chunks[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		ctx = drm_intel_decode_context_alloc(pool->devid);
+		if (!ctx)
+			errx(1, "out of memory");
+		drm_intel_decode_set_output_format(ctx, pool->format);
+		drm_intel_decode_set_dump_past_end(ctx, 1);
+
+#ifdef HAVE_OPEN_MEMSTREAM
+		out = open_memstream(&chunk->text, &chunk->size);
+#endif
+		if (!out)
+			errx(1, "out of memory");
+		drm_intel_decode_set_batch_pointer(ctx, chunk->data,
+						   chunk->hw_offset,
+						   chunk->count);
+		drm_intel_decode_set_output_file(ctx, out);
+		drm_intel_decode(ctx);
+		fclose(out);
+		drm_intel_decode_context_free(ctx);
+
+		pthread_mutex_lock(&pool->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * Decodes each batch in the file on a pool of worker threads, each
+ * with its own decode context, and writes the results to stdout in
+ * file order.
+ *
+ * The output matches a serial decode with dump_past_end set, which
+ * also decodes every batch rather than stopping at the first
+ * MI_BATCH_BUFFER_END, with one exception on gen2/3: a serial decode
+ * carries the S2/S4 vertex format from 3DSTATE_LOAD_STATE_IMMEDIATE_1
+ * across batches, whereas here each batch starts without it, so inline
+ * 3DPRIMITIVE data relying on an earlier batch's state is printed as
+ * of unknown vertex format.
+ */
+static void
+dump_batch_parallel(uint32_t devid, enum drm_intel_decode_format format,
+		    const char *batch_filename, int num_threads)
+{
+	struct drm_intel_decode *ctx;
+	struct decode_pool pool;
+	pthread_t *threads;
+	void *batch_ptr;
+	size_t batch_size;
+	int i;
+
+	read_file(batch_filename, &batch_ptr, &batch_size);
+
+	ctx = drm_intel_decode_context_alloc(devid);
+	if (!ctx)
+		errx(1, "out of memory");
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pool.devid = devid;
+	pool.format = format;
+	pool.window = num_threads * 4;
+	pool.num_chunks = split_batch(ctx, batch_ptr, batch_size / 4,
+				      &pool.chunks);
+	drm_intel_decode_context_free(ctx);
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		errx(1, "out of memory");
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, decode_worker, &pool))
+			errx(1, "couldn't create decode thread");
+	}
+
+	for (i = 0; i < pool.num_chunks; i++) {
+		struct decode_chunk *chunk = &pool.chunks[i];
+
+		pthread_mutex_lock(&pool.lock);
+		while (!chunk->done)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		fwrite(chunk->text, 1, chunk->size, stdout);
+		free(chunk->text);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.written++;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	free(pool.chunks);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+}
+
 static void
 compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 {
@@ -171,6 +397,8 @@ main(int argc, char **argv)
 {
 	uint16_t devid;
 	struct drm_intel_decode *ctx;
+	enum drm_intel_decode_format format = DRM_INTEL_DECODE_FORMAT_TEXT;
+	int i, num_threads = 0;
 
 	if (argc < 2)
 		usage();
@@ -180,11 +408,26 @@ main(int argc, char **argv)
 
 	ctx = drm_intel_decode_context_alloc(devid);
 
-	if (argc == 3) {
-		if (strcmp(argv[2], "-dump") == 0)
-			dump_batch(ctx, argv[1]);
-		else
+	if (argc >= 3) {
+		if (strcmp(argv[2], "-dump") != 0)
 			usage();
+
+		for (i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "-json") == 0)
+				format = DRM_INTEL_DECODE_FORMAT_JSON;
+			else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+				num_threads = atoi(argv[++i]);
+			else
+				usage();
+		}
+
+		if (num_threads > 0) {
+			dump_batch_parallel(devid, format, argv[1],
+					    num_threads);
+		} else {
+			drm_intel_decode_set_output_format(ctx, format);
+			dump_batch(ctx, argv[1]);
+		}
 	} else {
 		compare_batch(ctx, argv[1]);
 	}
@@ -0,0 +1,285 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that the streaming upload buffer never hands out a range that is
+ * still referenced by the batch being built, even when one batch consumes
+ * more data than the ring holds.
+ *
+ * No device is needed: ioctl() is overridden below and reports every
+ * buffer as idle, which is the worst case for the stream since only the
+ * pending batch keeps a block alive.  A temporary file stands in for the
+ * drm fd so that buffers can be mapped through the GTT.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "libdrm.h"
+#include "xf86drm.h"
+#include "i915_drm.h"
+#include "intel_bufmgr.h"
+
+#define BLOCK_SIZE	4096
+#define RANGE_SIZE	3000
+#define NR_RANGES	16
+
+static uint32_t next_handle = 1;
+static unsigned int nr_creates;
+
+drm_public int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	switch (DRM_IOCTL_NR(request)) {
+	case DRM_IOCTL_NR(DRM_IOCTL_I915_GETPARAM):
+	{
+		drm_i915_getparam_t *gp = arg;
+
+		switch (gp->param) {
+		case I915_PARAM_CHIPSET_ID:
+			*gp->value = 0x0166;	/* Ivybridge */
+			return 0;
+		case I915_PARAM_HAS_EXECBUF2:
+		case I915_PARAM_HAS_LLC:
+			*gp->value = 1;
+			return 0;
+		default:
+			*gp->value = 0;
+			return 0;
+		}
+	}
+	case DRM_IOCTL_NR(DRM_IOCTL_I915_GEM_GET_APERTURE):
+	{
+		struct drm_i915_gem_get_aperture *aperture = arg;
+
+		aperture->aper_size = 256 << 20;
+		aperture->aper_available_size = 256 << 20;
+		return 0;
+	}
+	case DRM_IOCTL_NR(DRM_IOCTL_I915_GEM_CREATE):
+	{
+		struct drm_i915_gem_create *create = arg;
+
+		create->handle = next_handle++;
+		nr_creates++;
+		return 0;
+	}
+	case DRM_IOCTL_NR(DRM_IOCTL_I915_GEM_MMAP_GTT):
+	{
+		struct drm_i915_gem_mmap_gtt *mmap_arg = arg;
+
+		/* Every buffer gets its own page-aligned window of the file */
+		mmap_arg->offset = (uint64_t) mmap_arg->handle << 20;
+		return 0;
+	}
+	case DRM_IOCTL_NR(DRM_IOCTL_I915_GEM_BUSY):
+	{
+		struct drm_i915_gem_busy *busy = arg;
+
+		busy->busy = 0;
+		return 0;
+	}
+	case DRM_IOCTL_NR(DRM_IOCTL_I915_GEM_MADVISE):
+	{
+		struct drm_i915_gem_madvise *madv = arg;
+
+		madv->retained = 1;
+		return 0;
+	}
+	default:
+		/* set domain, execbuffer2, gem close... */
+		return 0;
+	}
+}
+
+/* Allocates NR_RANGES ranges for one batch and checks none overlap */
+static void
+fill_batch(drm_intel_stream *stream, drm_intel_bo *batch, int pass)
+{
+	drm_intel_bo *bos[NR_RANGES];
+	uint32_t offsets[NR_RANGES];
+	void *ptrs[NR_RANGES];
+	int i, j, ret;
+
+	for (i = 0; i < NR_RANGES; i++) {
+		ret = drm_intel_gem_stream_alloc(stream, RANGE_SIZE, 64,
+						 &bos[i], &offsets[i],
+						 &ptrs[i]);
+		if (ret)
+			errx(1, "pass %d: stream alloc %d failed: %d",
+			     pass, i, ret);
+
+		memset(ptrs[i], pass * NR_RANGES + i, RANGE_SIZE);
+
+		ret = drm_intel_bo_emit_reloc(batch, i * 4, bos[i],
+					      offsets[i],
+					      I915_GEM_DOMAIN_VERTEX, 0);
+		if (ret)
+			errx(1, "pass %d: emit reloc %d failed: %d",
+			     pass, i, ret);
+	}
+
+	for (i = 0; i < NR_RANGES; i++) {
+		const unsigned char *p = ptrs[i];
+
+		for (j = 0; j < i; j++) {
+			if (bos[i] == bos[j] &&
+			    offsets[i] < offsets[j] + RANGE_SIZE &&
+			    offsets[j] < offsets[i] + RANGE_SIZE)
+				errx(1, "pass %d: ranges %d and %d overlap",
+				     pass, j, i);
+		}
+
+		for (j = 0; j < RANGE_SIZE; j++) {
+			if (p[j] != (unsigned char)(pass * NR_RANGES + i))
+				errx(1, "pass %d: range %d overwritten",
+				     pass, i);
+		}
+	}
+}
+
+static void
+test_stream(drm_intel_bufmgr *bufmgr, int max_blocks)
+{
+	drm_intel_stream *stream;
+	drm_intel_bo *batch;
+	unsigned int creates;
+	int pass, ret;
+
+	stream = drm_intel_gem_stream_create(bufmgr, "stream", BLOCK_SIZE,
+					     max_blocks);
+	if (stream == NULL)
+		errx(1, "stream create failed");
+
+	for (pass = 0; pass < 4; pass++) {
+		batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+		if (batch == NULL)
+			errx(1, "batch alloc failed");
+
+		creates = nr_creates;
+		fill_batch(stream, batch, pass);
+
+		ret = drm_intel_bo_exec(batch, 4096, NULL, 0, 0);
+		if (ret)
+			errx(1, "pass %d: exec failed: %d", pass, ret);
+
+		drm_intel_bo_unreference(batch);
+
+		/* Once a batch has consumed them, blocks are recycled */
+		if (pass > 0 && nr_creates != creates)
+			errx(1, "pass %d: blocks were not recycled", pass);
+	}
+
+	drm_intel_gem_stream_destroy(stream);
+}
+
+/* Allocations that no batch ever uses must not grow the ring forever */
+static void
+test_abandoned(drm_intel_bufmgr *bufmgr, int max_blocks)
+{
+	drm_intel_stream *stream;
+	drm_intel_bo *batch, *bo;
+	unsigned int creates = 0;
+	uint32_t offset;
+	void *ptr;
+	int pass, i, ret;
+
+	stream = drm_intel_gem_stream_create(bufmgr, "stream", BLOCK_SIZE,
+					     max_blocks);
+	if (stream == NULL)
+		errx(1, "stream create failed");
+
+	for (pass = 0; pass < 8; pass++) {
+		batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+		if (batch == NULL)
+			errx(1, "batch alloc failed");
+
+		if (pass == 1)
+			creates = nr_creates;
+
+		for (i = 0; i < NR_RANGES; i++) {
+			ret = drm_intel_gem_stream_alloc(stream, RANGE_SIZE, 64,
+							 &bo, &offset, &ptr);
+			if (ret)
+				errx(1, "pass %d: stream alloc %d failed: %d",
+				     pass, i, ret);
+		}
+
+		/* The batch does not reference anything from the stream */
+		ret = drm_intel_bo_exec(batch, 4096, NULL, 0, 0);
+		if (ret)
+			errx(1, "pass %d: exec failed: %d", pass, ret);
+
+		drm_intel_bo_unreference(batch);
+	}
+
+	/* Batches come back out of the bo cache, blocks must be recycled */
+	if (nr_creates != creates)
+		errx(1, "abandoned blocks were not recycled");
+
+	drm_intel_gem_stream_destroy(stream);
+}
+
+int main(int argc, char **argv)
+{
+	drm_intel_bufmgr *bufmgr;
+	FILE *file;
+
+	/* Stands in for the drm fd so that GTT mappings have backing */
+	file = tmpfile();
+	if (file == NULL)
+		err(1, "tmpfile");
+	if (ftruncate(fileno(file), 256 << 20))
+		err(1, "ftruncate");
+
+	bufmgr = drm_intel_bufmgr_gem_init(fileno(file), 4096);
+	if (bufmgr == NULL)
+		errx(1, "bufmgr init failed");
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+
+	test_stream(bufmgr, 1);
+	test_stream(bufmgr, 4);
+	test_abandoned(bufmgr, 1);
+	test_abandoned(bufmgr, 4);
+
+	drm_intel_bufmgr_destroy(bufmgr);
+	fclose(file);
+
+	return 0;
+}
@@ -69,6 +69,88 @@ nouveau_device_open_existing(struct nouveau_device **pdev, int close, int fd,
 	return -EACCES;
 }
 
+static void
+nouveau_bo_add_bucket(struct nouveau_device_priv *nvdev, uint64_t size)
+{
+	struct nouveau_bo_bucket *bucket =
+		&nvdev->bo_bucket[nvdev->nr_bo_bucket++];
+
+	DRMINITLISTHEAD(&bucket->head);
+	bucket->size = size;
+}
+
+static void
+nouveau_bo_init_buckets(struct nouveau_device_priv *nvdev)
+{
+	uint64_t size;
+
+	/* same layout as the intel and radeon caches: the first few pages,
+	 * then four buckets per power of two up to 64MiB
+	 */
+	nouveau_bo_add_bucket(nvdev, 4096);
+	nouveau_bo_add_bucket(nvdev, 4096 * 2);
+	nouveau_bo_add_bucket(nvdev, 4096 * 3);
+
+	for (size = 4 * 4096; size <= 64 * 1024 * 1024; size *= 2) {
+		nouveau_bo_add_bucket(nvdev, size);
+		nouveau_bo_add_bucket(nvdev, size + size * 1 / 4);
+		nouveau_bo_add_bucket(nvdev, size + size * 2 / 4);
+		nouveau_bo_add_bucket(nvdev, size + size * 3 / 4);
+	}
+}
+
+static struct nouveau_bo_bucket *
+nouveau_bo_bucket(struct nouveau_device_priv *nvdev, uint64_t size)
+{
+	int i;
+
+	for (i = 0; i < nvdev->nr_bo_bucket; i++) {
+		if (nvdev->bo_bucket[i].size >= size)
+			return &nvdev->bo_bucket[i];
+	}
+	return NULL;
+}
+
+static void
+nouveau_bo_free(struct nouveau_bo *bo)
+{
+	struct drm_gem_close req = { bo->handle };
+
+	drmIoctl(bo->device->fd, DRM_IOCTL_GEM_CLOSE, &req);
+	if (bo->map)
+		drm_munmap(bo->map, bo->size);
+	free(nouveau_bo(bo));
+}
+
+/* frees the bos that have sat in the cache for more than a second, or all
+ * of them if time is 0, called with the device lock held
+ */
+static void
+nouveau_bo_cache_cleanup(struct nouveau_device_priv *nvdev, time_t time)
+{
+	struct nouveau_bo_priv *nvbo;
+	int i;
+
+	if (time && nvdev->bo_cache_time == time)
+		return;
+
+	for (i = 0; i < nvdev->nr_bo_bucket; i++) {
+		struct nouveau_bo_bucket *bucket = &nvdev->bo_bucket[i];
+
+		/* buckets are in free order, stop at the first young bo */
+		while (!DRMLISTEMPTY(&bucket->head)) {
+			nvbo = DRMLISTENTRY(struct nouveau_bo_priv,
+					    bucket->head.next, head);
+			if (time && time - nvbo->free_time <= 1)
+				break;
+			DRMLISTDEL(&nvbo->head);
+			nouveau_bo_free(&nvbo->base);
+		}
+	}
+
+	nvdev->bo_cache_time = time;
+}
+
 drm_public int
 nouveau_device_wrap(int fd, int close, struct nouveau_device **pdev)
 {
@@ -92,6 +174,13 @@ nouveau_device_wrap(int fd, int close, struct nouveau_device **pdev)
 	}
 
 	nvdev->base.fd = fd;
+	nouveau_bo_init_buckets(nvdev);
+
+	nvdev->name_table = drmHashCreate();
+	if (!nvdev->name_table) {
+		nouveau_device_del(&dev);
+		return -ENOMEM;
+	}
 
 	ver = drmGetVersion(fd);
 	if (ver) dev->drm_version = (ver->version_major << 24) |
@@ -132,7 +221,6 @@ nouveau_device_wrap(int fd, int close, struct nouveau_device **pdev)
 		nvdev->gart_limit_percent = atoi(tmp);
 	else
 		nvdev->gart_limit_percent = 80;
-	DRMINITLISTHEAD(&nvdev->bo_list);
 	nvdev->base.object.oclass = NOUVEAU_DEVICE_CLASS;
 	nvdev->base.lib_version = 0x01000000;
 	nvdev->base.chipset = chipset;
@@ -164,6 +252,11 @@ nouveau_device_del(struct nouveau_device **pdev)
 {
 	struct nouveau_device_priv *nvdev = nouveau_device(*pdev);
 	if (nvdev) {
+		pushbuf_async_fini(nvdev);
+		nouveau_bo_cache_cleanup(nvdev, 0);
+		if (nvdev->name_table)
+			drmHashDestroy(nvdev->name_table);
+		free(nvdev->bo_handle);
 		if (nvdev->close)
 			drmClose(nvdev->base.fd);
 		free(nvdev->client);
@@ -173,6 +266,19 @@ nouveau_device_del(struct nouveau_device **pdev)
 	}
 }
 
+/*
+ * Makes nouveau_bo_new() hand out bos that have been freed instead of
+ * allocating new ones.  Sizes are rounded up to a bucket, and freed bos
+ * are kept for a second before being closed.  The content of a reused bo
+ * is undefined.  Bos that have been given a name or exported to a prime
+ * fd are never reused.
+ */
+drm_public void
+nouveau_device_enable_bo_reuse(struct nouveau_device *dev)
+{
+	nouveau_device(dev)->bo_reuse = true;
+}
+
 drm_public int
 nouveau_getparam(struct nouveau_device *dev, uint64_t param, uint64_t *value)
 {
@@ -342,6 +448,79 @@ nouveau_object_find(struct nouveau_object *obj, uint32_t pclass)
 	return obj;
 }
 
+/* called with the device lock held */
+static int
+nouveau_bo_handle_set(struct nouveau_device_priv *nvdev, uint32_t handle,
+		      struct nouveau_bo_priv *nvbo)
+{
+	struct nouveau_bo_priv **bo_handle;
+	uint32_t nr;
+
+	if (handle >= nvdev->bo_handle_nr) {
+		nr = (handle + 1) * 2;
+		bo_handle = realloc(nvdev->bo_handle, sizeof(*bo_handle) * nr);
+		if (!bo_handle)
+			return -ENOMEM;
+		memset(bo_handle + nvdev->bo_handle_nr, 0,
+		       sizeof(*bo_handle) * (nr - nvdev->bo_handle_nr));
+		nvdev->bo_handle = bo_handle;
+		nvdev->bo_handle_nr = nr;
+	}
+
+	nvdev->bo_handle[handle] = nvbo;
+	return 0;
+}
+
+/* called with the device lock held, the mapping is kept with the bo */
+static bool
+nouveau_bo_cache_put(struct nouveau_device_priv *nvdev,
+		     struct nouveau_bo_priv *nvbo)
+{
+	struct nouveau_bo_bucket *bucket;
+	struct timespec now;
+
+	if (!nvdev->bo_reuse || !nvbo->reusable)
+		return false;
+
+	bucket = nouveau_bo_bucket(nvdev, nvbo->base.size);
+	if (!bucket || bucket->size != nvbo->base.size)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nvbo->free_time = now.tv_sec;
+	DRMLISTADDTAIL(&nvbo->head, &bucket->head);
+	nouveau_bo_cache_cleanup(nvdev, now.tv_sec);
+	return true;
+}
+
+/* takes the oldest cached bo matching the request, if it is idle; the
+ * younger ones are unlikely to be idle when the oldest one isn't.  Called
+ * with the device lock held.
+ */
+static struct nouveau_bo_priv *
+nouveau_bo_cache_get(struct nouveau_bo_bucket *bucket, uint32_t flags,
+		     uint32_t align, const uint32_t *config)
+{
+	struct nouveau_bo_priv *nvbo;
+
+	DRMLISTFOREACHENTRY(nvbo, &bucket->head, head) {
+		if (nvbo->reuse_flags != flags ||
+		    nvbo->reuse_config[0] != config[0] ||
+		    nvbo->reuse_config[1] != config[1] ||
+		    (align && (nvbo->reuse_align < align ||
+			       nvbo->reuse_align % align)))
+			continue;
+		/* the new owner may write it while the gpu still reads */
+		if (nouveau_bo_wait(&nvbo->base, NOUVEAU_BO_WR |
+				    NOUVEAU_BO_NOBLOCK, NULL))
+			return NULL;
+		DRMLISTDEL(&nvbo->head);
+		return nvbo;
+	}
+
+	return NULL;
+}
+
 static void
 nouveau_bo_del(struct nouveau_bo *bo)
 {
@@ -365,7 +544,9 @@ nouveau_bo_del(struct nouveau_bo *bo)
 			pthread_mutex_unlock(&nvdev->lock);
 			return;
 		}
-		DRMLISTDEL(&nvbo->head);
+		nvdev->bo_handle[bo->handle] = NULL;
+		if (nvbo->name != ~0U)
+			drmHashDelete(nvdev->name_table, nvbo->name);
 		/*
 		 * This bo has to be closed with the lock held because gem
 		 * handles are not refcounted. If a shared bo is closed and
@@ -376,7 +557,11 @@ nouveau_bo_del(struct nouveau_bo *bo)
 		drmIoctl(bo->device->fd, DRM_IOCTL_GEM_CLOSE, &req);
 		pthread_mutex_unlock(&nvdev->lock);
 	} else {
-		DRMLISTDEL(&nvbo->head);
+		nvdev->bo_handle[bo->handle] = NULL;
+		if (nouveau_bo_cache_put(nvdev, nvbo)) {
+			pthread_mutex_unlock(&nvdev->lock);
+			return;
+		}
 		pthread_mutex_unlock(&nvdev->lock);
 		drmIoctl(bo->device->fd, DRM_IOCTL_GEM_CLOSE, &req);
 	}
@@ -391,12 +576,40 @@ nouveau_bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
 	       struct nouveau_bo **pbo)
 {
 	struct nouveau_device_priv *nvdev = nouveau_device(dev);
-	struct nouveau_bo_priv *nvbo = calloc(1, sizeof(*nvbo));
-	struct nouveau_bo *bo = &nvbo->base;
+	struct nouveau_bo_bucket *bucket = NULL;
+	struct nouveau_bo_priv *nvbo;
+	struct nouveau_bo *bo;
+	uint32_t reuse_config[2] = {};
 	int ret;
 
+	if (nvdev->bo_reuse)
+		bucket = nouveau_bo_bucket(nvdev, size);
+
+	if (bucket) {
+		/* all the per-chipset configs live in the first two words */
+		if (config) {
+			reuse_config[0] = config->data[0];
+			reuse_config[1] = config->data[1];
+		}
+
+		pthread_mutex_lock(&nvdev->lock);
+		nvbo = nouveau_bo_cache_get(bucket, flags, align, reuse_config);
+		if (nvbo) {
+			/* the slot was grown when the bo was created */
+			atomic_set(&nvbo->refcnt, 1);
+			nvdev->bo_handle[nvbo->base.handle] = nvbo;
+			pthread_mutex_unlock(&nvdev->lock);
+			*pbo = &nvbo->base;
+			return 0;
+		}
+		pthread_mutex_unlock(&nvdev->lock);
+		size = bucket->size;
+	}
+
+	nvbo = calloc(1, sizeof(*nvbo));
 	if (!nvbo)
 		return -ENOMEM;
+	bo = &nvbo->base;
 	atomic_set(&nvbo->refcnt, 1);
 	bo->device = dev;
 	bo->flags = flags;
@@ -408,9 +621,21 @@ nouveau_bo_new(struct nouveau_device *dev, uint32_t flags, uint32_t align,
 		return ret;
 	}
 
+	if (bucket) {
+		nvbo->reusable = true;
+		nvbo->reuse_flags = flags;
+		nvbo->reuse_align = align;
+		nvbo->reuse_config[0] = reuse_config[0];
+		nvbo->reuse_config[1] = reuse_config[1];
+	}
+
 	pthread_mutex_lock(&nvdev->lock);
-	DRMLISTADD(&nvbo->head, &nvdev->bo_list);
+	ret = nouveau_bo_handle_set(nvdev, bo->handle, nvbo);
 	pthread_mutex_unlock(&nvdev->lock);
+	if (ret) {
+		nouveau_bo_free(bo);
+		return ret;
+	}
 
 	*pbo = bo;
 	return 0;
@@ -425,12 +650,10 @@ nouveau_bo_wrap_locked(struct nouveau_device *dev, uint32_t handle,
 	struct nouveau_bo_priv *nvbo;
 	int ret;
 
-	DRMLISTFOREACHENTRY(nvbo, &nvdev->bo_list, head) {
-		if (nvbo->base.handle == handle) {
-			*pbo = NULL;
-			nouveau_bo_ref(&nvbo->base, pbo);
-			return 0;
-		}
+	if (handle < nvdev->bo_handle_nr && nvdev->bo_handle[handle]) {
+		*pbo = NULL;
+		nouveau_bo_ref(&nvdev->bo_handle[handle]->base, pbo);
+		return 0;
 	}
 
 	ret = drmCommandWriteRead(dev->fd, DRM_NOUVEAU_GEM_INFO,
@@ -439,15 +662,16 @@ nouveau_bo_wrap_locked(struct nouveau_device *dev, uint32_t handle,
 		return ret;
 
 	nvbo = calloc(1, sizeof(*nvbo));
-	if (nvbo) {
+	if (nvbo && !nouveau_bo_handle_set(nvdev, handle, nvbo)) {
 		atomic_set(&nvbo->refcnt, 1);
 		nvbo->base.device = dev;
 		abi16_bo_info(&nvbo->base, &req);
-		DRMLISTADD(&nvbo->head, &nvdev->bo_list);
 		*pbo = &nvbo->base;
 		return 0;
 	}
 
+	free(nvbo);
+
 	return -ENOMEM;
 }
 
@@ -470,24 +694,27 @@ nouveau_bo_name_ref(struct nouveau_device *dev, uint32_t name,
 	struct nouveau_device_priv *nvdev = nouveau_device(dev);
 	struct nouveau_bo_priv *nvbo;
 	struct drm_gem_open req = { .name = name };
+	void *value;
 	int ret;
 
 	pthread_mutex_lock(&nvdev->lock);
-	DRMLISTFOREACHENTRY(nvbo, &nvdev->bo_list, head) {
-		if (nvbo->name == name) {
-			*pbo = NULL;
-			nouveau_bo_ref(&nvbo->base, pbo);
-			pthread_mutex_unlock(&nvdev->lock);
-			return 0;
-		}
+	if (!drmHashLookup(nvdev->name_table, name, &value)) {
+		nvbo = value;
+		*pbo = NULL;
+		nouveau_bo_ref(&nvbo->base, pbo);
+		pthread_mutex_unlock(&nvdev->lock);
+		return 0;
 	}
 
 	ret = drmIoctl(dev->fd, DRM_IOCTL_GEM_OPEN, &req);
 	if (ret == 0) {
 		ret = nouveau_bo_wrap_locked(dev, req.handle, pbo);
-		nouveau_bo((*pbo))->name = name;
-		pthread_mutex_unlock(&nvdev->lock);
+		if (ret == 0) {
+			nouveau_bo((*pbo))->name = name;
+			drmHashInsert(nvdev->name_table, name, *pbo);
+		}
 	}
+	pthread_mutex_unlock(&nvdev->lock);
 
 	return ret;
 }
@@ -495,6 +722,7 @@ nouveau_bo_name_ref(struct nouveau_device *dev, uint32_t name,
 drm_public int
 nouveau_bo_name_get(struct nouveau_bo *bo, uint32_t *name)
 {
+	struct nouveau_device_priv *nvdev = nouveau_device(bo->device);
 	struct drm_gem_flink req = { .handle = bo->handle };
 	struct nouveau_bo_priv *nvbo = nouveau_bo(bo);
 
@@ -506,6 +734,10 @@ nouveau_bo_name_get(struct nouveau_bo *bo, uint32_t *name)
 			return ret;
 		}
 		nvbo->name = *name = req.name;
+
+		pthread_mutex_lock(&nvdev->lock);
+		drmHashInsert(nvdev->name_table, *name, nvbo);
+		pthread_mutex_unlock(&nvdev->lock);
 	}
 	return 0;
 }
@@ -579,10 +811,16 @@ nouveau_bo_wait(struct nouveau_bo *bo, uint32_t access,
 	if (!(access & NOUVEAU_BO_RDWR))
 		return 0;
 
-	push = cli_push_get(client, bo);
+	/* without a client, the caller knows no pushbuf references the bo */
+	push = client ? cli_push_get(client, bo) : NULL;
 	if (push && push->channel)
 		nouveau_pushbuf_kick(push, push->channel);
 
+	/* a submission still queued counts as busy for NOBLOCK callers */
+	ret = pushbuf_async_wait(bo, access);
+	if (ret)
+		return ret;
+
 	if (!nvbo->name && !(nvbo->access & NOUVEAU_BO_WR) &&
 			   !(      access & NOUVEAU_BO_WR))
 		return 0;
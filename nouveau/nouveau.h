@@ -84,6 +84,7 @@ struct nouveau_device {
 int  nouveau_device_wrap(int fd, int close, struct nouveau_device **);
 int  nouveau_device_open(const char *busid, struct nouveau_device **);
 void nouveau_device_del(struct nouveau_device **);
+void nouveau_device_enable_bo_reuse(struct nouveau_device *);
 int  nouveau_getparam(struct nouveau_device *, uint64_t param, uint64_t *value);
 int  nouveau_setparam(struct nouveau_device *, uint64_t param, uint64_t value);
 
@@ -225,6 +226,7 @@ void nouveau_pushbuf_reloc(struct nouveau_pushbuf *, struct nouveau_bo *,
 int  nouveau_pushbuf_validate(struct nouveau_pushbuf *);
 uint32_t nouveau_pushbuf_refd(struct nouveau_pushbuf *, struct nouveau_bo *);
 int  nouveau_pushbuf_kick(struct nouveau_pushbuf *, struct nouveau_object *channel);
+int  nouveau_pushbuf_set_async(struct nouveau_pushbuf *, bool async);
 struct nouveau_bufctx *
 nouveau_pushbuf_bufctx(struct nouveau_pushbuf *, struct nouveau_bufctx *);
 
@@ -5,6 +5,7 @@
 #include <xf86drm.h>
 #include <xf86atomic.h>
 #include <pthread.h>
+#include <time.h>
 #include "nouveau_drm.h"
 
 #include "nouveau.h"
@@ -80,11 +81,21 @@ cli_kref_set(struct nouveau_client *client, struct nouveau_bo *bo,
 
 struct nouveau_bo_priv {
 	struct nouveau_bo base;
-	struct nouveau_list head;
+	struct nouveau_list head; /* cache bucket, while freed */
 	atomic_t refcnt;
 	uint64_t map_handle;
 	uint32_t name;
 	uint32_t access;
+
+	/* allocation request, matched against when reusing a cached bo */
+	bool reusable;
+	uint32_t reuse_flags;
+	uint32_t reuse_align;
+	uint32_t reuse_config[2];
+	time_t free_time;
+
+	/* last asynchronous pushbuf submission referencing the bo */
+	uint64_t async_seq;
 };
 
 static inline struct nouveau_bo_priv *
@@ -93,15 +104,28 @@ nouveau_bo(struct nouveau_bo *bo)
 	return (struct nouveau_bo_priv *)bo;
 }
 
+struct nouveau_bo_bucket {
+	struct nouveau_list head;
+	uint64_t size;
+};
+
 struct nouveau_device_priv {
 	struct nouveau_device base;
 	int close;
 	pthread_mutex_t lock;
-	struct nouveau_list bo_list;
+	/* live bos, indexed by gem handle and hashed by flink name */
+	struct nouveau_bo_priv **bo_handle;
+	uint32_t bo_handle_nr;
+	void *name_table;
+	struct nouveau_bo_bucket bo_bucket[14 * 4];
+	int nr_bo_bucket;
+	bool bo_reuse;
+	time_t bo_cache_time;
 	uint32_t *client;
 	int nr_client;
 	bool have_bo_usage;
 	int gart_limit_percent, vram_limit_percent;
+	struct nouveau_pushbuf_async *async;
 };
 
 static inline struct nouveau_device_priv *
@@ -123,4 +147,8 @@ void abi16_bo_info(struct nouveau_bo *, struct drm_nouveau_gem_info *);
 int  abi16_bo_init(struct nouveau_bo *, uint32_t alignment,
 		   union nouveau_bo_config *);
 
+/* pushbuf.c */
+void pushbuf_async_fini(struct nouveau_device_priv *);
+int  pushbuf_async_wait(struct nouveau_bo *, uint32_t access);
+
 #endif
@@ -52,6 +52,30 @@ struct nouveau_pushbuf_krec {
 	int nr_push;
 	uint64_t vram_used;
 	uint64_t gart_used;
+
+	/* asynchronous submission, see pushbuf_async_flush() */
+	struct nouveau_pushbuf_krec *queue;
+	struct drm_nouveau_gem_pushbuf req;
+	uint64_t seq;
+	int ret;
+};
+
+/* krecs an asynchronous pushbuf may have queued before it has to wait for
+ * the submission thread, on top of the one being filled
+ */
+#define PUSHBUF_ASYNC_DEPTH 2
+
+struct nouveau_pushbuf_async {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	struct nouveau_pushbuf_krec *head;
+	struct nouveau_pushbuf_krec *tail;
+	uint64_t queued_seq;
+	uint64_t done_seq;
+	bool stop;
+	int fd;
 };
 
 struct nouveau_pushbuf_priv {
@@ -67,6 +91,11 @@ struct nouveau_pushbuf_priv {
 	uint32_t *bgn;
 	int bo_next;
 	int bo_nr;
+	bool async;
+	struct nouveau_pushbuf_krec *async_list; /* queued, oldest first */
+	struct nouveau_pushbuf_krec *async_free;
+	int async_nr;
+	int async_ret;
 	struct nouveau_bo *bos[];
 };
 
@@ -304,19 +333,136 @@ pushbuf_dump(struct nouveau_pushbuf_krec *krec, int krec_id, int chid)
 	}
 }
 
+/* submits a krec, req comes in with the channel and suffix filled in and
+ * goes out with what the kernel returned
+ */
 static int
-pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
+pushbuf_krec_submit(int fd, struct nouveau_pushbuf_krec *krec, int krec_id,
+		    struct drm_nouveau_gem_pushbuf *req)
 {
+	int ret = 0;
+
+	req->nr_buffers = krec->nr_buffer;
+	req->buffers = (uint64_t)(unsigned long)krec->buffer;
+	req->nr_relocs = krec->nr_reloc;
+	req->nr_push = krec->nr_push;
+	req->relocs = (uint64_t)(unsigned long)krec->reloc;
+	req->push = (uint64_t)(unsigned long)krec->push;
+	req->vram_available = 0; /* for valgrind */
+	req->gart_available = 0;
+
+	if (dbg_on(0))
+		pushbuf_dump(krec, krec_id, req->channel);
+
+#ifndef SIMULATE
+	ret = drmCommandWriteRead(fd, DRM_NOUVEAU_GEM_PUSHBUF,
+				  req, sizeof(*req));
+#else
+	if (dbg_on(31))
+		ret = -EINVAL;
+#endif
+
+	if (ret) {
+		err("kernel rejected pushbuf: %s\n", strerror(-ret));
+		pushbuf_dump(krec, krec_id, req->channel);
+	}
+
+	return ret;
+}
+
+static void
+pushbuf_update(struct nouveau_pushbuf *push, struct drm_nouveau_gem_pushbuf *req)
+{
+#ifndef SIMULATE
 	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
-	struct nouveau_pushbuf_krec *krec = nvpb->list;
 	struct nouveau_device *dev = push->client->device;
+
+	nvpb->suffix0 = req->suffix0;
+	nvpb->suffix1 = req->suffix1;
+	dev->vram_limit = (req->vram_available *
+			nouveau_device(dev)->vram_limit_percent) / 100;
+	dev->gart_limit = (req->gart_available *
+			nouveau_device(dev)->gart_limit_percent) / 100;
+#endif
+}
+
+static void
+pushbuf_krec_presumed(struct nouveau_pushbuf_krec *krec)
+{
 	struct drm_nouveau_gem_pushbuf_bo_presumed *info;
 	struct drm_nouveau_gem_pushbuf_bo *kref;
+	struct nouveau_bo *bo;
+	int i;
+
+	kref = krec->buffer;
+	for (i = 0; i < krec->nr_buffer; i++, kref++) {
+		bo = (void *)(unsigned long)kref->user_priv;
+
+		info = &kref->presumed;
+		if (!info->valid) {
+			bo->flags &= ~NOUVEAU_BO_APER;
+			if (info->domain == NOUVEAU_GEM_DOMAIN_VRAM)
+				bo->flags |= NOUVEAU_BO_VRAM;
+			else
+				bo->flags |= NOUVEAU_BO_GART;
+			bo->offset = info->offset;
+		}
+	}
+}
+
+static void
+pushbuf_krec_access(struct nouveau_pushbuf_krec *krec)
+{
+	struct drm_nouveau_gem_pushbuf_bo *kref;
+	struct nouveau_bo *bo;
+	int i;
+
+	kref = krec->buffer;
+	for (i = 0; i < krec->nr_buffer; i++, kref++) {
+		bo = (void *)(unsigned long)kref->user_priv;
+
+		if (kref->write_domains)
+			nouveau_bo(bo)->access |= NOUVEAU_BO_WR;
+		if (kref->read_domains)
+			nouveau_bo(bo)->access |= NOUVEAU_BO_RD;
+	}
+}
+
+static void
+pushbuf_krec_unref(struct nouveau_pushbuf_krec *krec)
+{
+	struct drm_nouveau_gem_pushbuf_bo *kref;
+	struct nouveau_bo *bo;
+	int i;
+
+	kref = krec->buffer;
+	for (i = 0; i < krec->nr_buffer; i++, kref++) {
+		bo = (void *)(unsigned long)kref->user_priv;
+		nouveau_bo_ref(NULL, &bo);
+	}
+}
+
+/* waits until everything queued to the submission thread is submitted */
+static void
+pushbuf_async_drain(struct nouveau_pushbuf_async *async)
+{
+	pthread_mutex_lock(&async->lock);
+	while (async->done_seq < async->queued_seq)
+		pthread_cond_wait(&async->done, &async->lock);
+	pthread_mutex_unlock(&async->lock);
+}
+
+static int
+pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_krec *krec = nvpb->list;
+	struct nouveau_device *dev = push->client->device;
+	struct nouveau_pushbuf_async *async = nouveau_device(dev)->async;
 	struct drm_nouveau_gem_pushbuf req;
 	struct nouveau_fifo *fifo = chan->data;
-	struct nouveau_bo *bo;
 	int krec_id = 0;
-	int ret = 0, i;
+	int ret = 0;
 
 	if (chan->oclass != NOUVEAU_FIFO_CHANNEL_CLASS)
 		return -EINVAL;
@@ -326,68 +472,268 @@ pushbuf_submit(struct nouveau_pushbuf *push, struct nouveau_object *chan)
 
 	nouveau_pushbuf_data(push, NULL, 0, 0);
 
+	/* keep submission order with the asynchronous pushbufs */
+	if (async)
+		pushbuf_async_drain(async);
+
 	while (krec && krec->nr_push) {
 		req.channel = fifo->channel;
-		req.nr_buffers = krec->nr_buffer;
-		req.buffers = (uint64_t)(unsigned long)krec->buffer;
-		req.nr_relocs = krec->nr_reloc;
-		req.nr_push = krec->nr_push;
-		req.relocs = (uint64_t)(unsigned long)krec->reloc;
-		req.push = (uint64_t)(unsigned long)krec->push;
 		req.suffix0 = nvpb->suffix0;
 		req.suffix1 = nvpb->suffix1;
-		req.vram_available = 0; /* for valgrind */
-		req.gart_available = 0;
 
-		if (dbg_on(0))
-			pushbuf_dump(krec, krec_id++, fifo->channel);
+		ret = pushbuf_krec_submit(dev->fd, krec, krec_id++, &req);
+		pushbuf_update(push, &req);
+		if (ret)
+			break;
 
-#ifndef SIMULATE
-		ret = drmCommandWriteRead(dev->fd, DRM_NOUVEAU_GEM_PUSHBUF,
-					  &req, sizeof(req));
-		nvpb->suffix0 = req.suffix0;
-		nvpb->suffix1 = req.suffix1;
-		dev->vram_limit = (req.vram_available *
-				nouveau_device(dev)->vram_limit_percent) / 100;
-		dev->gart_limit = (req.gart_available *
-				nouveau_device(dev)->gart_limit_percent) / 100;
-#else
-		if (dbg_on(31))
-			ret = -EINVAL;
-#endif
+		pushbuf_krec_presumed(krec);
+		pushbuf_krec_access(krec);
+		krec = krec->next;
+	}
 
-		if (ret) {
-			err("kernel rejected pushbuf: %s\n", strerror(-ret));
-			pushbuf_dump(krec, krec_id++, fifo->channel);
+	return ret;
+}
+
+static void *
+pushbuf_async_thread(void *arg)
+{
+	struct nouveau_pushbuf_async *async = arg;
+	struct nouveau_pushbuf_krec *krec;
+	int ret;
+
+	pthread_mutex_lock(&async->lock);
+	for (;;) {
+		while (!async->head && !async->stop)
+			pthread_cond_wait(&async->queued, &async->lock);
+
+		krec = async->head;
+		if (!krec)
 			break;
-		}
+		async->head = krec->queue;
+		if (!async->head)
+			async->tail = NULL;
+		pthread_mutex_unlock(&async->lock);
 
-		kref = krec->buffer;
-		for (i = 0; i < krec->nr_buffer; i++, kref++) {
-			bo = (void *)(unsigned long)kref->user_priv;
+		/* the krec and the bos it references are left alone by the
+		 * client until done_seq has gone past it
+		 */
+		ret = pushbuf_krec_submit(async->fd, krec, 0, &krec->req);
 
-			info = &kref->presumed;
-			if (!info->valid) {
-				bo->flags &= ~NOUVEAU_BO_APER;
-				if (info->domain == NOUVEAU_GEM_DOMAIN_VRAM)
-					bo->flags |= NOUVEAU_BO_VRAM;
-				else
-					bo->flags |= NOUVEAU_BO_GART;
-				bo->offset = info->offset;
-			}
+		pthread_mutex_lock(&async->lock);
+		krec->ret = ret;
+		async->done_seq = krec->seq;
+		pthread_cond_broadcast(&async->done);
+	}
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+static int
+pushbuf_async_init(struct nouveau_device *dev)
+{
+	struct nouveau_device_priv *nvdev = nouveau_device(dev);
+	struct nouveau_pushbuf_async *async;
+	int ret = 0;
+
+	pthread_mutex_lock(&nvdev->lock);
+	if (nvdev->async)
+		goto out;
 
-			if (kref->write_domains)
-				nouveau_bo(bo)->access |= NOUVEAU_BO_WR;
-			if (kref->read_domains)
-				nouveau_bo(bo)->access |= NOUVEAU_BO_RD;
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	async->fd = dev->fd;
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->queued, NULL);
+	pthread_cond_init(&async->done, NULL);
+	ret = -pthread_create(&async->thread, NULL, pushbuf_async_thread,
+			      async);
+	if (ret) {
+		pthread_cond_destroy(&async->done);
+		pthread_cond_destroy(&async->queued);
+		pthread_mutex_destroy(&async->lock);
+		free(async);
+		goto out;
+	}
+
+	nvdev->async = async;
+out:
+	pthread_mutex_unlock(&nvdev->lock);
+	return ret;
+}
+
+void
+pushbuf_async_fini(struct nouveau_device_priv *nvdev)
+{
+	struct nouveau_pushbuf_async *async = nvdev->async;
+
+	if (!async)
+		return;
+
+	pthread_mutex_lock(&async->lock);
+	async->stop = true;
+	pthread_cond_signal(&async->queued);
+	pthread_mutex_unlock(&async->lock);
+	pthread_join(async->thread, NULL);
+
+	pthread_cond_destroy(&async->done);
+	pthread_cond_destroy(&async->queued);
+	pthread_mutex_destroy(&async->lock);
+	free(async);
+	nvdev->async = NULL;
+}
+
+int
+pushbuf_async_wait(struct nouveau_bo *bo, uint32_t access)
+{
+	struct nouveau_pushbuf_async *async = nouveau_device(bo->device)->async;
+	int ret = 0;
+
+	if (!async)
+		return 0;
+
+	pthread_mutex_lock(&async->lock);
+	while (async->done_seq < nouveau_bo(bo)->async_seq) {
+		if (access & NOUVEAU_BO_NOBLOCK) {
+			ret = -EBUSY;
+			break;
 		}
+		pthread_cond_wait(&async->done, &async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+	return ret;
+}
 
-		krec = krec->next;
+/* retires the krecs the submission thread is done with, waiting for the
+ * oldest ones until no more than keep are left in the queue
+ */
+static void
+pushbuf_async_reap(struct nouveau_pushbuf *push, int keep)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_device *dev = push->client->device;
+	struct nouveau_pushbuf_async *async = nouveau_device(dev)->async;
+	struct nouveau_pushbuf_krec *krec;
+
+	pthread_mutex_lock(&async->lock);
+	while ((krec = nvpb->async_list)) {
+		if (krec->seq > async->done_seq) {
+			if (nvpb->async_nr <= keep)
+				break;
+			pthread_cond_wait(&async->done, &async->lock);
+			continue;
+		}
+
+		nvpb->async_list = krec->next;
+		nvpb->async_nr--;
+		pthread_mutex_unlock(&async->lock);
+
+		/* dropping the last reference to a bo takes the device lock */
+		pushbuf_update(push, &krec->req);
+		if (krec->ret == 0)
+			pushbuf_krec_presumed(krec);
+		else
+		if (!nvpb->async_ret)
+			nvpb->async_ret = krec->ret;
+		pushbuf_krec_unref(krec);
+
+		krec->next = nvpb->async_free;
+		nvpb->async_free = krec;
+		pthread_mutex_lock(&async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+}
+
+/* hands the current krec over to the submission thread and switches to a
+ * free one.  Submission errors are returned by a later flush.
+ */
+static int
+pushbuf_async_flush(struct nouveau_pushbuf *push)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_device *dev = push->client->device;
+	struct nouveau_pushbuf_async *async = nouveau_device(dev)->async;
+	struct nouveau_pushbuf_krec *krec = nvpb->krec, **pkrec;
+	struct nouveau_fifo *fifo = push->channel->data;
+	struct drm_nouveau_gem_pushbuf_bo *kref;
+	struct nouveau_bo *bo;
+	int ret, i;
+
+	if (push->kick_notify)
+		push->kick_notify(push);
+
+	nouveau_pushbuf_data(push, NULL, 0, 0);
+
+	/* the krefs stay with the queued krec, further references to the
+	 * same bos get new ones in the next krec
+	 */
+	kref = krec->buffer;
+	for (i = 0; i < krec->nr_buffer; i++, kref++) {
+		bo = (void *)(unsigned long)kref->user_priv;
+		cli_kref_set(push->client, bo, NULL, NULL);
 	}
 
+	if (!krec->nr_push) {
+		pushbuf_krec_unref(krec);
+		goto out;
+	}
+
+	pushbuf_async_reap(push, PUSHBUF_ASYNC_DEPTH - 1);
+
+	/* access flags are set now rather than once submitted, so that
+	 * nouveau_bo_wait() doesn't skip the kernel wait in between
+	 */
+	pushbuf_krec_access(krec);
+	krec->req.channel = fifo->channel;
+	krec->req.suffix0 = nvpb->suffix0;
+	krec->req.suffix1 = nvpb->suffix1;
+	krec->queue = NULL;
+
+	pthread_mutex_lock(&async->lock);
+	krec->seq = ++async->queued_seq;
+	kref = krec->buffer;
+	for (i = 0; i < krec->nr_buffer; i++, kref++) {
+		bo = (void *)(unsigned long)kref->user_priv;
+		nouveau_bo(bo)->async_seq = krec->seq;
+	}
+	if (async->tail)
+		async->tail->queue = krec;
+	else
+		async->head = krec;
+	async->tail = krec;
+	pthread_cond_signal(&async->queued);
+	pthread_mutex_unlock(&async->lock);
+
+	for (pkrec = &nvpb->async_list; *pkrec; pkrec = &(*pkrec)->next);
+	*pkrec = krec;
+	krec->next = NULL;
+	nvpb->async_nr++;
+
+	nvpb->krec = nvpb->async_free;
+	nvpb->async_free = nvpb->krec->next;
+	nvpb->krec->next = NULL;
+	nvpb->list = nvpb->krec;
+
+out:
+	ret = nvpb->async_ret;
+	nvpb->async_ret = 0;
 	return ret;
 }
 
+static void
+pushbuf_async_free(struct nouveau_pushbuf_priv *nvpb)
+{
+	struct nouveau_pushbuf_krec *krec;
+
+	while ((krec = nvpb->async_free)) {
+		nvpb->async_free = krec->next;
+		free(krec);
+	}
+}
+
 static int
 pushbuf_flush(struct nouveau_pushbuf *push)
 {
@@ -398,20 +744,24 @@ pushbuf_flush(struct nouveau_pushbuf *push)
 	struct nouveau_bo *bo;
 	int ret = 0, i;
 
-	if (push->channel) {
-		ret = pushbuf_submit(push, push->channel);
+	if (push->channel && nvpb->async) {
+		ret = pushbuf_async_flush(push);
 	} else {
-		nouveau_pushbuf_data(push, NULL, 0, 0);
-		krec->next = malloc(sizeof(*krec));
-		nvpb->krec = krec->next;
-	}
+		if (push->channel) {
+			ret = pushbuf_submit(push, push->channel);
+		} else {
+			nouveau_pushbuf_data(push, NULL, 0, 0);
+			krec->next = malloc(sizeof(*krec));
+			nvpb->krec = krec->next;
+		}
 
-	kref = krec->buffer;
-	for (i = 0; i < krec->nr_buffer; i++, kref++) {
-		bo = (void *)(unsigned long)kref->user_priv;
-		cli_kref_set(push->client, bo, NULL, NULL);
-		if (push->channel)
-			nouveau_bo_ref(NULL, &bo);
+		kref = krec->buffer;
+		for (i = 0; i < krec->nr_buffer; i++, kref++) {
+			bo = (void *)(unsigned long)kref->user_priv;
+			cli_kref_set(push->client, bo, NULL, NULL);
+			if (push->channel)
+				nouveau_bo_ref(NULL, &bo);
+		}
 	}
 
 	krec = nvpb->krec;
@@ -482,7 +832,7 @@ static int
 pushbuf_validate(struct nouveau_pushbuf *push, bool retry)
 {
 	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
-	struct nouveau_pushbuf_krec *krec = nvpb->krec;
+	struct nouveau_pushbuf_krec *krec;
 	struct drm_nouveau_gem_pushbuf_bo *kref;
 	struct nouveau_bufctx *bctx = push->bufctx;
 	struct nouveau_bufref *bref;
@@ -493,6 +843,8 @@ pushbuf_validate(struct nouveau_pushbuf *push, bool retry)
 	if (ret || bctx == NULL)
 		return ret;
 
+	/* an asynchronous flush in there switched to another krec */
+	krec = nvpb->krec;
 	sref = krec->nr_buffer;
 	srel = krec->nr_reloc;
 
@@ -607,6 +959,10 @@ nouveau_pushbuf_del(struct nouveau_pushbuf **ppush)
 	if (nvpb) {
 		struct drm_nouveau_gem_pushbuf_bo *kref;
 		struct nouveau_pushbuf_krec *krec;
+		if (nvpb->async) {
+			pushbuf_async_reap(&nvpb->base, 0);
+			pushbuf_async_free(nvpb);
+		}
 		while ((krec = nvpb->list)) {
 			kref = krec->buffer;
 			while (krec->nr_buffer--) {
@@ -626,6 +982,65 @@ nouveau_pushbuf_del(struct nouveau_pushbuf **ppush)
 	*ppush = NULL;
 }
 
+/*
+ * Moves the kernel submission of an immediate pushbuf to a thread shared
+ * by the device.  A kick then queues the commands recorded so far and
+ * returns while they are validated and submitted, so the client can go on
+ * recording into the next batch; it only waits once PUSHBUF_ASYNC_DEPTH
+ * batches are queued.  Errors from the kernel are returned by a later
+ * kick.  Submissions keep their order across all the device's pushbufs,
+ * and nouveau_bo_wait() waits for the submission of the last batch that
+ * referenced a bo.
+ *
+ * Only supported on chipsets that return from a pushbuf through IB (NV50
+ * and later) or a CALL (NV25 and later): before NV25 the kernel JUMPs back
+ * to the main ring, and the return address it gives for the next batch is
+ * only known once the previous one has been submitted.
+ */
+drm_public int
+nouveau_pushbuf_set_async(struct nouveau_pushbuf *push, bool async)
+{
+	struct nouveau_pushbuf_priv *nvpb = nouveau_pushbuf(push);
+	struct nouveau_pushbuf_krec *krec;
+	int ret, i;
+
+	if (!push->channel)
+		return -EINVAL;
+	if (nvpb->async == async)
+		return 0;
+	/* suffix0/1 are written at the end of each batch when it is queued,
+	 * so they must not change between submissions
+	 */
+	if (async && push->client->device->chipset < 0x25)
+		return -EINVAL;
+
+	if (!async) {
+		pushbuf_async_reap(push, 0);
+		pushbuf_async_free(nvpb);
+		nvpb->async = false;
+		ret = nvpb->async_ret;
+		nvpb->async_ret = 0;
+		return ret;
+	}
+
+	ret = pushbuf_async_init(push->client->device);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < PUSHBUF_ASYNC_DEPTH; i++) {
+		krec = calloc(1, sizeof(*krec));
+		if (!krec) {
+			pushbuf_async_free(nvpb);
+			return -ENOMEM;
+		}
+		krec->next = nvpb->async_free;
+		nvpb->async_free = krec;
+	}
+
+	nvpb->async = true;
+	return 0;
+}
+
 drm_public struct nouveau_bufctx *
 nouveau_pushbuf_bufctx(struct nouveau_pushbuf *push, struct nouveau_bufctx *ctx)
 {
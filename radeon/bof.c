@@ -24,24 +24,50 @@
  *      Jerome Glisse
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bof.h"
 
+struct bof_mapping {
+	unsigned	refcount;
+	void		*ptr;
+	size_t		size;
+};
+
+#define BOF_WRITER_MAX_DEPTH	16
+
+struct bof_writer {
+	FILE		*file;
+	int		error;
+	unsigned	depth;
+	struct {
+		long		offset;
+		uint32_t	type;
+		uint64_t	size;
+		uint32_t	array_size;
+	} stack[BOF_WRITER_MAX_DEPTH];
+};
+
 /*
  * helpers
  */
 static int bof_entry_grow(bof_t *bof)
 {
 	bof_t **array;
+	unsigned nentry;
 
 	if (bof->array_size < bof->nentry)
 		return 0;
-	array = realloc(bof->array, (bof->nentry + 16) * sizeof(void*));
+	nentry = bof->nentry ? bof->nentry * 2 : 16;
+	array = realloc(bof->array, nentry * sizeof(void*));
 	if (array == NULL)
 		return -ENOMEM;
 	bof->array = array;
-	bof->nentry += 16;
+	bof->nentry = nentry;
 	return 0;
 }
 
@@ -215,7 +241,11 @@ bof_t *bof_int32(int32_t value)
 
 int32_t bof_int32_value(bof_t *bof)
 {
-	return *((uint32_t*)bof->value);
+	int32_t value;
+
+	/* mapped values are not aligned */
+	memcpy(&value, bof->value, 4);
+	return value;
 }
 
 /*
@@ -276,99 +306,166 @@ void bof_print(bof_t *bof)
 	bof_print_rec(bof, 0, 0);
 }
 
-static int bof_read(bof_t *root, FILE *file, long end, int level)
+static struct bof_mapping *bof_mapping_open(const char *filename)
 {
-	bof_t *bof = NULL;
-	int r;
+	struct bof_mapping *mapping;
+	struct stat st;
+	int fd;
 
-	if (ftell(file) >= end) {
-		return 0;
-	}
-	r = bof_entry_grow(root);
-	if (r)
-		return r;
-	bof = bof_object();
-	if (bof == NULL)
-		return -ENOMEM;
-	bof->offset = ftell(file);
-	r = fread(&bof->type, 4, 1, file);
-	if (r != 1)
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	mapping = calloc(1, sizeof(struct bof_mapping));
+	if (mapping == NULL)
 		goto out_err;
-	r = fread(&bof->size, 4, 1, file);
-	if (r != 1)
+	if (fstat(fd, &st) || st.st_size < 12 || (uint64_t)st.st_size > SIZE_MAX)
 		goto out_err;
-	r = fread(&bof->array_size, 4, 1, file);
-	if (r != 1)
+	mapping->size = st.st_size;
+	mapping->ptr = mmap(NULL, mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping->ptr == MAP_FAILED)
 		goto out_err;
-	switch (bof->type) {
-	case BOF_TYPE_STRING:
-	case BOF_TYPE_INT32:
-	case BOF_TYPE_BLOB:
-		bof->value = calloc(1, bof->size - 12);
-		if (bof->value == NULL) {
+	mapping->refcount = 1;
+	close(fd);
+	return mapping;
+out_err:
+	free(mapping);
+	close(fd);
+	return NULL;
+}
+
+static void bof_mapping_unref(struct bof_mapping *mapping)
+{
+	if (--mapping->refcount > 0)
+		return;
+	munmap(mapping->ptr, mapping->size);
+	free(mapping);
+}
+
+static int bof_header(bof_t *bof, struct bof_mapping *mapping,
+		      size_t offset, size_t end)
+{
+	const uint8_t *ptr = mapping->ptr;
+
+	if (end - offset < 12)
+		return -EINVAL;
+	memcpy(&bof->type, ptr + offset, 4);
+	memcpy(&bof->size, ptr + offset + 4, 4);
+	if (bof->size < 12 || bof->size > end - offset)
+		return -EINVAL;
+	bof->offset = offset;
+	return 0;
+}
+
+/*
+ * Parses the entries of a mapped object or array, siblings are walked in a
+ * loop so that only nesting recurses.  Values are copied out of the mapping
+ * if copy is set, otherwise they point into it and hold a reference on it.
+ */
+static int bof_parse(bof_t *parent, struct bof_mapping *mapping,
+		     size_t offset, size_t end, int copy)
+{
+	const uint8_t *ptr = mapping->ptr;
+	uint32_t array_size;
+	bof_t *bof;
+	int r;
+
+	memcpy(&array_size, ptr + offset + 8, 4);
+	offset += 12;
+	while (offset < end) {
+		r = bof_entry_grow(parent);
+		if (r)
+			return r;
+		bof = bof_object();
+		if (bof == NULL)
+			return -ENOMEM;
+		r = bof_header(bof, mapping, offset, end);
+		if (r)
 			goto out_err;
-		}
-		r = fread(bof->value, bof->size - 12, 1, file);
-		if (r != 1) {
-			fprintf(stderr, "error reading %d\n", bof->size - 12);
+		switch (bof->type) {
+		case BOF_TYPE_INT32:
+			if (bof->size != 16) {
+				r = -EINVAL;
+				goto out_err;
+			}
+			/* fallthrough */
+		case BOF_TYPE_STRING:
+		case BOF_TYPE_BLOB:
+			if (copy) {
+				bof->value = calloc(1, bof->size - 12);
+				if (bof->value == NULL) {
+					r = -ENOMEM;
+					goto out_err;
+				}
+				memcpy(bof->value, ptr + offset + 12, bof->size - 12);
+			} else {
+				bof->value = (void *)(ptr + offset + 12);
+				bof->mapping = mapping;
+				mapping->refcount++;
+			}
+			break;
+		case BOF_TYPE_NULL:
+			break;
+		case BOF_TYPE_OBJECT:
+		case BOF_TYPE_ARRAY:
+			r = bof_parse(bof, mapping, offset, offset + bof->size, copy);
+			if (r)
+				goto out_err;
+			break;
+		default:
+			fprintf(stderr, "invalid type %d\n", bof->type);
+			r = -EINVAL;
 			goto out_err;
 		}
-		break;
-	case BOF_TYPE_NULL:
-		return 0;
-	case BOF_TYPE_OBJECT:
-	case BOF_TYPE_ARRAY:
-		r = bof_read(bof, file, bof->offset + bof->size, level + 2);
-		if (r)
-			goto out_err;
-		break;
-	default:
-		fprintf(stderr, "invalid type %d\n", bof->type);
-		goto out_err;
+		parent->array[parent->array_size++] = bof;
+		offset += bof->size;
 	}
-	root->array[root->centry++] = bof;
-	return bof_read(root, file, end, level);
+	parent->centry = parent->array_size;
+	return parent->array_size == array_size ? 0 : -EINVAL;
 out_err:
 	bof_decref(bof);
-	return -EINVAL;
+	return r;
 }
 
-bof_t *bof_load_file(const char *filename)
+static bof_t *bof_parse_file(const char *filename, int copy)
 {
-	bof_t *root = bof_object();
-	int r;
+	struct bof_mapping *mapping;
+	bof_t *root;
 
-	if (root == NULL) {
-		fprintf(stderr, "%s failed to create root object\n", __func__);
+	mapping = bof_mapping_open(filename);
+	if (mapping == NULL) {
+		fprintf(stderr, "%s failed to map file %s\n", __func__, filename);
 		return NULL;
 	}
-	root->file = fopen(filename, "r");
-	if (root->file == NULL)
+	root = bof_object();
+	if (root == NULL)
 		goto out_err;
-	r = fseek(root->file, 0L, SEEK_SET);
-	if (r) {
-		fprintf(stderr, "%s failed to seek into file %s\n", __func__, filename);
+	if (bof_header(root, mapping, 0, mapping->size))
 		goto out_err;
-	}
-	root->offset = ftell(root->file);
-	r = fread(&root->type, 4, 1, root->file);
-	if (r != 1)
+	if (root->type != BOF_TYPE_OBJECT && root->type != BOF_TYPE_ARRAY)
 		goto out_err;
-	r = fread(&root->size, 4, 1, root->file);
-	if (r != 1)
-		goto out_err;
-	r = fread(&root->array_size, 4, 1, root->file);
-	if (r != 1)
-		goto out_err;
-	r = bof_read(root, root->file, root->offset + root->size, 2);
-	if (r)
+	if (copy)
+		madvise(mapping->ptr, mapping->size, MADV_SEQUENTIAL);
+	if (bof_parse(root, mapping, 0, root->size, copy))
 		goto out_err;
+	/* values hold their own reference on the mapping */
+	bof_mapping_unref(mapping);
 	return root;
 out_err:
 	bof_decref(root);
+	bof_mapping_unref(mapping);
 	return NULL;
 }
 
+bof_t *bof_load_file(const char *filename)
+{
+	return bof_parse_file(filename, 1);
+}
+
+bof_t *bof_map_file(const char *filename)
+{
+	return bof_parse_file(filename, 0);
+}
+
 void bof_incref(bof_t *bof)
 {
 	bof->refcount++;
@@ -392,7 +489,10 @@ void bof_decref(bof_t *bof)
 		bof->file = NULL;
 	}
 	free(bof->array);
-	free(bof->value);
+	if (bof->mapping)
+		bof_mapping_unref(bof->mapping);
+	else
+		free(bof->value);
 	free(bof);
 }
 
@@ -475,3 +575,197 @@ out_err:
 	bof->file = NULL;
 	return r;
 }
+
+/*
+ * streaming writer
+ */
+static int bof_writer_header(bof_writer_t *writer, uint32_t type,
+			     uint32_t size, uint32_t array_size)
+{
+	uint32_t header[3] = { type, size, array_size };
+
+	if (fwrite(header, 12, 1, writer->file) != 1)
+		return -EIO;
+	return 0;
+}
+
+/* accounts an entry of the given size in the innermost open container */
+static int bof_writer_account(bof_writer_t *writer, uint64_t size, unsigned n)
+{
+	unsigned top = writer->depth - 1;
+
+	writer->stack[top].size += size;
+	writer->stack[top].array_size += n;
+	if (writer->stack[top].size > UINT32_MAX)
+		return -EFBIG;
+	return 0;
+}
+
+static int bof_writer_leaf(bof_writer_t *writer, uint32_t type,
+			   const void *value, unsigned size)
+{
+	int r;
+
+	r = bof_writer_header(writer, type, size + 12, 0);
+	if (r)
+		return r;
+	if (size && fwrite(value, size, 1, writer->file) != 1)
+		return -EIO;
+	return bof_writer_account(writer, size + 12ULL, 1);
+}
+
+/* checks the writer state and writes the key of an object entry */
+static int bof_writer_key(bof_writer_t *writer, const char *key)
+{
+	int r;
+
+	if (writer->error)
+		return writer->error;
+	if (!writer->depth)
+		return -EINVAL;
+	if (writer->stack[writer->depth - 1].type == BOF_TYPE_OBJECT) {
+		if (key == NULL)
+			return -EINVAL;
+		r = bof_writer_leaf(writer, BOF_TYPE_STRING, key, strlen(key) + 1);
+		if (r)
+			writer->error = r;
+		return r;
+	}
+	return key == NULL ? 0 : -EINVAL;
+}
+
+static int bof_writer_begin(bof_writer_t *writer, uint32_t type)
+{
+	int r;
+
+	if (writer->depth >= BOF_WRITER_MAX_DEPTH)
+		return -EINVAL;
+	writer->stack[writer->depth].offset = ftell(writer->file);
+	writer->stack[writer->depth].type = type;
+	writer->stack[writer->depth].size = 12;
+	writer->stack[writer->depth].array_size = 0;
+	/* size and array_size are filled in by bof_writer_end */
+	r = bof_writer_header(writer, type, 0, 0);
+	if (r)
+		return r;
+	writer->depth++;
+	return 0;
+}
+
+bof_writer_t *bof_writer_new(const char *filename)
+{
+	bof_writer_t *writer;
+
+	writer = calloc(1, sizeof(bof_writer_t));
+	if (writer == NULL)
+		return NULL;
+	writer->file = fopen(filename, "w");
+	if (writer->file == NULL) {
+		fprintf(stderr, "%s failed to open file %s\n", __func__, filename);
+		free(writer);
+		return NULL;
+	}
+	if (bof_writer_begin(writer, BOF_TYPE_OBJECT)) {
+		fclose(writer->file);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+int bof_writer_begin_object(bof_writer_t *writer, const char *key)
+{
+	int r;
+
+	r = bof_writer_key(writer, key);
+	if (r)
+		return r;
+	r = bof_writer_begin(writer, BOF_TYPE_OBJECT);
+	if (r)
+		writer->error = r;
+	return r;
+}
+
+int bof_writer_begin_array(bof_writer_t *writer, const char *key)
+{
+	int r;
+
+	r = bof_writer_key(writer, key);
+	if (r)
+		return r;
+	r = bof_writer_begin(writer, BOF_TYPE_ARRAY);
+	if (r)
+		writer->error = r;
+	return r;
+}
+
+int bof_writer_end(bof_writer_t *writer)
+{
+	unsigned top;
+	int r = 0;
+
+	if (writer->error)
+		return writer->error;
+	if (!writer->depth)
+		return -EINVAL;
+	top = --writer->depth;
+	/* patch the header now that the content is known */
+	if (fseek(writer->file, writer->stack[top].offset, SEEK_SET) ||
+	    bof_writer_header(writer, writer->stack[top].type,
+			      writer->stack[top].size,
+			      writer->stack[top].array_size) ||
+	    fseek(writer->file, 0L, SEEK_END))
+		r = -EIO;
+	if (!r && writer->depth)
+		r = bof_writer_account(writer, writer->stack[top].size, 1);
+	writer->error = r;
+	return r;
+}
+
+int bof_writer_blob(bof_writer_t *writer, const char *key, unsigned size, const void *value)
+{
+	int r;
+
+	r = bof_writer_key(writer, key);
+	if (r)
+		return r;
+	r = bof_writer_leaf(writer, BOF_TYPE_BLOB, value, size);
+	writer->error = r;
+	return r;
+}
+
+int bof_writer_string(bof_writer_t *writer, const char *key, const char *value)
+{
+	int r;
+
+	r = bof_writer_key(writer, key);
+	if (r)
+		return r;
+	r = bof_writer_leaf(writer, BOF_TYPE_STRING, value, strlen(value) + 1);
+	writer->error = r;
+	return r;
+}
+
+int bof_writer_int32(bof_writer_t *writer, const char *key, int32_t value)
+{
+	int r;
+
+	r = bof_writer_key(writer, key);
+	if (r)
+		return r;
+	r = bof_writer_leaf(writer, BOF_TYPE_INT32, &value, 4);
+	writer->error = r;
+	return r;
+}
+
+int bof_writer_close(bof_writer_t *writer)
+{
+	int r = 0;
+
+	while (writer->depth && !r)
+		r = bof_writer_end(writer);
+	if (fclose(writer->file) && !r)
+		r = -EIO;
+	free(writer);
+	return r;
+}
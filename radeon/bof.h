@@ -37,6 +37,8 @@
 #define BOF_TYPE_INT32		5
 
 struct bof;
+struct bof_mapping;
+struct bof_writer;
 
 typedef struct bof {
 	struct bof	**array;
@@ -49,8 +51,12 @@ typedef struct bof {
 	uint32_t	array_size;
 	void		*value;
 	long		offset;
+	/* set when value points into a file mapping */
+	struct bof_mapping	*mapping;
 } bof_t;
 
+typedef struct bof_writer bof_writer_t;
+
 extern int bof_file_flush(bof_t *root);
 extern bof_t *bof_file_new(const char *filename);
 extern int bof_object_dump(bof_t *object, const char *filename);
@@ -77,9 +83,25 @@ extern int32_t bof_int32_value(bof_t *bof);
 extern void bof_decref(bof_t *bof);
 extern void bof_incref(bof_t *bof);
 extern bof_t *bof_load_file(const char *filename);
+/* like bof_load_file, but string, int32 and blob values point into a read
+ * only mapping of the file instead of being copied, so they may not be
+ * aligned */
+extern bof_t *bof_map_file(const char *filename);
 extern int bof_dump_file(bof_t *bof, const char *filename);
 extern void bof_print(bof_t *bof);
 
+/* streaming writer, the root object is written as entries are added and
+ * only the headers of the open objects and arrays are kept in memory; key
+ * must be given inside an object and be NULL inside an array */
+extern bof_writer_t *bof_writer_new(const char *filename);
+extern int bof_writer_begin_object(bof_writer_t *writer, const char *key);
+extern int bof_writer_begin_array(bof_writer_t *writer, const char *key);
+extern int bof_writer_end(bof_writer_t *writer);
+extern int bof_writer_blob(bof_writer_t *writer, const char *key, unsigned size, const void *value);
+extern int bof_writer_string(bof_writer_t *writer, const char *key, const char *value);
+extern int bof_writer_int32(bof_writer_t *writer, const char *key, int32_t value);
+extern int bof_writer_close(bof_writer_t *writer);
+
 static inline int bof_is_object(bof_t *bof){return (bof->type == BOF_TYPE_OBJECT);}
 static inline int bof_is_blob(bof_t *bof){return (bof->type == BOF_TYPE_BLOB);}
 static inline int bof_is_null(bof_t *bof){return (bof->type == BOF_TYPE_NULL);}
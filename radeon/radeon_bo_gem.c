@@ -37,7 +37,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include "libdrm.h"
+#include "libdrm_lists.h"
 #include "xf86drm.h"
 #include "xf86atomic.h"
 #include "drm.h"
@@ -52,14 +55,133 @@ struct radeon_bo_gem {
     int                     map_count;
     atomic_t                reloc_in_cs;
     void                    *priv_ptr;
+    /* Buffer cache link, and the time the buffer was put in the cache. */
+    drmMMListHead           cache_head;
+    time_t                  free_time;
+    /* Whether the buffer may go back into the cache on its last unref:
+     * false once it has been shared through a name or a prime fd. */
+    int                     reusable;
+    uint32_t                tiling_flags;
+    uint32_t                pitch;
+};
+
+struct bo_gem_bucket {
+    drmMMListHead   head;
+    uint32_t        size;
 };
 
 struct bo_manager_gem {
     struct radeon_bo_manager    base;
+    struct bo_gem_bucket        cache_bucket[14 * 4];
+    int                         num_buckets;
+    int                         reuse;
+    time_t                      time;
+    /* Protects the cache buckets and time, for unrefs from other threads */
+    pthread_mutex_t             lock;
 };
 
 static int bo_wait(struct radeon_bo_int *boi);
-    
+static int bo_is_busy(struct radeon_bo_int *boi, uint32_t *domain);
+static int bo_set_tiling(struct radeon_bo_int *boi, uint32_t tiling_flags,
+                         uint32_t pitch);
+
+static void bo_free(struct radeon_bo_gem *bo_gem)
+{
+    struct radeon_bo_int *boi = &bo_gem->base;
+    struct drm_gem_close args;
+
+    if (bo_gem->priv_ptr) {
+        drm_munmap(bo_gem->priv_ptr, boi->size);
+    }
+
+    /* Zero out args to make valgrind happy */
+    memset(&args, 0, sizeof(args));
+
+    /* close object */
+    args.handle = boi->handle;
+    drmIoctl(boi->bom->fd, DRM_IOCTL_GEM_CLOSE, &args);
+    memset(bo_gem, 0, sizeof(struct radeon_bo_gem));
+    free(bo_gem);
+}
+
+static struct bo_gem_bucket *bo_bucket_for_size(struct bo_manager_gem *bomg,
+                                                uint32_t size)
+{
+    int i;
+
+    for (i = 0; i < bomg->num_buckets; i++) {
+        struct bo_gem_bucket *bucket = &bomg->cache_bucket[i];
+        if (bucket->size >= size) {
+            return bucket;
+        }
+    }
+    return NULL;
+}
+
+/* Frees cached buffers that have been idle in the cache for more than a
+ * second, or all of them if time is 0.  Buckets are kept in free order, so
+ * each scan stops at the first buffer that is young enough.
+ */
+static void bo_cleanup_cache(struct bo_manager_gem *bomg, time_t time)
+{
+    int i;
+
+    if (time && bomg->time == time) {
+        return;
+    }
+    for (i = 0; i < bomg->num_buckets; i++) {
+        struct bo_gem_bucket *bucket = &bomg->cache_bucket[i];
+
+        while (!DRMLISTEMPTY(&bucket->head)) {
+            struct radeon_bo_gem *bo_gem;
+
+            bo_gem = DRMLISTENTRY(struct radeon_bo_gem,
+                                  bucket->head.next, cache_head);
+            if (time && time - bo_gem->free_time <= 1) {
+                break;
+            }
+            DRMLISTDEL(&bo_gem->cache_head);
+            bo_free(bo_gem);
+        }
+    }
+    bomg->time = time;
+}
+
+/* Takes a buffer compatible with the request out of the bucket.  The oldest
+ * compatible buffer is the one most likely to be idle; if the GPU still uses
+ * it, the younger ones are not worth a busy ioctl each.
+ */
+static struct radeon_bo_gem *bo_cache_find(struct bo_gem_bucket *bucket,
+                                           uint32_t alignment,
+                                           uint32_t domains,
+                                           uint32_t flags)
+{
+    struct radeon_bo_gem *bo_gem;
+    drmMMListHead *item;
+    uint32_t domain;
+
+    DRMLISTFOREACH(item, &bucket->head) {
+        bo_gem = DRMLISTENTRY(struct radeon_bo_gem, item, cache_head);
+        if (bo_gem->base.domains != domains ||
+            bo_gem->base.flags != flags ||
+            (alignment && (bo_gem->base.alignment % alignment))) {
+            continue;
+        }
+        if (bo_is_busy(&bo_gem->base, &domain)) {
+            return NULL;
+        }
+        DRMLISTDEL(&bo_gem->cache_head);
+        if (bo_gem->tiling_flags || bo_gem->pitch) {
+            if (bo_set_tiling(&bo_gem->base, 0, 0)) {
+                bo_free(bo_gem);
+                return NULL;
+            }
+        }
+        return bo_gem;
+    }
+    return NULL;
+}
+
 static struct radeon_bo *bo_open(struct radeon_bo_manager *bom,
                                  uint32_t handle,
                                  uint32_t size,
@@ -67,9 +189,30 @@ static struct radeon_bo *bo_open(struct radeon_bo_manager *bom,
                                  uint32_t domains,
                                  uint32_t flags)
 {
+    struct bo_manager_gem *bomg = (struct bo_manager_gem*)bom;
+    struct bo_gem_bucket *bucket = NULL;
     struct radeon_bo_gem *bo;
     int r;
 
+    if (!handle && bomg->reuse) {
+        bucket = bo_bucket_for_size(bomg, size);
+    }
+    if (bucket) {
+        size = bucket->size;
+        pthread_mutex_lock(&bomg->lock);
+        bo = bo_cache_find(bucket, alignment, domains, flags);
+        pthread_mutex_unlock(&bomg->lock);
+        if (bo) {
+            bo->base.ptr = NULL;
+            bo->base.cref = 0;
+            bo->base.space_accounted = 0;
+            bo->base.referenced_in_cs = 0;
+            bo->map_count = 0;
+            radeon_bo_ref((struct radeon_bo*)bo);
+            return (struct radeon_bo*)bo;
+        }
+    }
+
     bo = (struct radeon_bo_gem*)calloc(1, sizeof(struct radeon_bo_gem));
     if (bo == NULL) {
         return NULL;
@@ -116,6 +259,7 @@ static struct radeon_bo *bo_open(struct radeon_bo_manager *bom,
             free(bo);
             return NULL;
         }
+        bo->reusable = bucket != NULL;
     }
     radeon_bo_ref((struct radeon_bo*)bo);
     return (struct radeon_bo*)bo;
@@ -128,23 +272,32 @@ static void bo_ref(struct radeon_bo_int *boi)
 static struct radeon_bo *bo_unref(struct radeon_bo_int *boi)
 {
     struct radeon_bo_gem *bo_gem = (struct radeon_bo_gem*)boi;
-    struct drm_gem_close args;
+    struct bo_manager_gem *bomg = (struct bo_manager_gem*)boi->bom;
+    struct bo_gem_bucket *bucket = NULL;
+    struct timespec time;
 
     if (boi->cref) {
         return (struct radeon_bo *)boi;
     }
-    if (bo_gem->priv_ptr) {
-        drm_munmap(bo_gem->priv_ptr, boi->size);
+    if (!bomg->reuse) {
+        bo_free(bo_gem);
+        return NULL;
     }
-
-    /* Zero out args to make valgrind happy */
-    memset(&args, 0, sizeof(args));
-
-    /* close object */
-    args.handle = boi->handle;
-    drmIoctl(boi->bom->fd, DRM_IOCTL_GEM_CLOSE, &args);
-    memset(bo_gem, 0, sizeof(struct radeon_bo_gem));
-    free(bo_gem);
+    if (bo_gem->reusable) {
+        bucket = bo_bucket_for_size(bomg, boi->size);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    pthread_mutex_lock(&bomg->lock);
+    /* The CPU mapping stays with the cached buffer: it is only torn down
+     * when the GEM handle is closed, so a reused buffer maps for free. */
+    if (bucket && bucket->size == boi->size) {
+        bo_gem->free_time = time.tv_sec;
+        DRMLISTADDTAIL(&bo_gem->cache_head, &bucket->head);
+    } else {
+        bo_free(bo_gem);
+    }
+    bo_cleanup_cache(bomg, time.tv_sec);
+    pthread_mutex_unlock(&bomg->lock);
     return NULL;
 }
 
@@ -246,6 +399,12 @@ static int bo_set_tiling(struct radeon_bo_int *boi, uint32_t tiling_flags,
                             DRM_RADEON_GEM_SET_TILING,
                             &args,
                             sizeof(args));
+    if (r == 0) {
+        struct radeon_bo_gem *bo_gem = (struct radeon_bo_gem*)boi;
+
+        bo_gem->tiling_flags = tiling_flags;
+        bo_gem->pitch = pitch;
+    }
     return r;
 }
 
@@ -283,6 +442,33 @@ static struct radeon_bo_funcs bo_gem_funcs = {
     bo_is_busy,
 };
 
+static void bo_add_bucket(struct bo_manager_gem *bomg, uint32_t size)
+{
+    struct bo_gem_bucket *bucket = &bomg->cache_bucket[bomg->num_buckets++];
+
+    DRMINITLISTHEAD(&bucket->head);
+    bucket->size = size;
+}
+
+static void bo_init_cache_buckets(struct bo_manager_gem *bomg)
+{
+    uint32_t size, cache_max_size = 64 * 1024 * 1024;
+
+    /* Same bucket sizes as intel: the first few pages, then four buckets
+     * per power of two so that rounding up wastes at most a quarter.
+     */
+    bo_add_bucket(bomg, 4096);
+    bo_add_bucket(bomg, 4096 * 2);
+    bo_add_bucket(bomg, 4096 * 3);
+
+    for (size = 4 * 4096; size <= cache_max_size; size *= 2) {
+        bo_add_bucket(bomg, size);
+        bo_add_bucket(bomg, size + size * 1 / 4);
+        bo_add_bucket(bomg, size + size * 2 / 4);
+        bo_add_bucket(bomg, size + size * 3 / 4);
+    }
+}
+
 drm_public struct radeon_bo_manager *radeon_bo_manager_gem_ctor(int fd)
 {
     struct bo_manager_gem *bomg;
@@ -293,9 +479,27 @@ drm_public struct radeon_bo_manager *radeon_bo_manager_gem_ctor(int fd)
     }
     bomg->base.funcs = &bo_gem_funcs;
     bomg->base.fd = fd;
+    pthread_mutex_init(&bomg->lock, NULL);
+    bo_init_cache_buckets(bomg);
     return (struct radeon_bo_manager*)bomg;
 }
 
+/**
+ * Enables reuse of freed buffers for later radeon_bo_open() calls.
+ *
+ * Buffers are rounded up to a bucket size and kept for a second after their
+ * last unref, so that a new buffer of similar size can be taken over without
+ * a GEM create.  The contents of a reused buffer are undefined.  Buffers that
+ * were opened by name or shared through a name or a prime fd are never
+ * cached.
+ */
+drm_public void radeon_bo_manager_gem_enable_reuse(struct radeon_bo_manager *bom)
+{
+    struct bo_manager_gem *bomg = (struct bo_manager_gem*)bom;
+
+    bomg->reuse = 1;
+}
+
 drm_public void radeon_bo_manager_gem_dtor(struct radeon_bo_manager *bom)
 {
     struct bo_manager_gem *bomg = (struct bo_manager_gem*)bom;
@@ -303,6 +507,8 @@ drm_public void radeon_bo_manager_gem_dtor(struct radeon_bo_manager *bom)
     if (bom == NULL) {
         return;
     }
+    bo_cleanup_cache(bomg, 0);
+    pthread_mutex_destroy(&bomg->lock);
     free(bomg);
 }
 
@@ -338,6 +544,7 @@ radeon_gem_get_kernel_name(struct radeon_bo *bo, uint32_t *name)
         return r;
     }
     bo_gem->name = flink.name;
+    bo_gem->reusable = 0;
     *name = flink.name;
     return 0;
 }
@@ -366,6 +573,9 @@ drm_public int radeon_gem_prime_share_bo(struct radeon_bo *bo, int *handle)
     int ret;
 
     ret = drmPrimeHandleToFD(bo_gem->base.bom->fd, bo->handle, DRM_CLOEXEC, handle);
+    if (ret == 0) {
+        bo_gem->reusable = 0;
+    }
     return ret;
 }
 
@@ -112,6 +112,25 @@ int radeon_cs_space_check_with_bo(struct radeon_cs *cs,
                                   uint32_t read_domains,
                                   uint32_t write_domain);
 
+/*
+ * replay of cs captures written with CS_BOF_DUMP, for benchmarking
+ * The capture bos are created in bom at load time, and only filled with
+ * the captured content if RADEON_CS_REPLAY_UPLOAD is set.  Building the cs
+ * copies the packets and redoes the space check and relocation of each
+ * captured bo, the space limits must let the whole capture fit.  The
+ * caller emits or erases the cs afterward.
+ */
+#define RADEON_CS_REPLAY_UPLOAD (1 << 0)
+
+struct radeon_cs_replay;
+
+struct radeon_cs_replay *radeon_cs_replay_load(struct radeon_bo_manager *bom,
+                                               const char *filename,
+                                               uint32_t flags);
+void radeon_cs_replay_free(struct radeon_cs_replay *replay);
+uint32_t radeon_cs_replay_ndw(struct radeon_cs_replay *replay);
+int radeon_cs_replay_build(struct radeon_cs_replay *replay, struct radeon_cs *cs);
+
 static inline void radeon_cs_write_dword(struct radeon_cs *cs, uint32_t dword)
 {
     cs->packets[cs->cdw++] = dword;
@@ -52,10 +52,22 @@
 
 #define CS_BOF_DUMP 0
 
+/* number of destroyed cs kept around for reuse by cs_gem_create */
+#define CS_POOL_SIZE 4
+
+struct cs_gem;
+
 struct radeon_cs_manager_gem {
     struct radeon_cs_manager    base;
     uint32_t                    device_id;
     unsigned                    nbof;
+    /* largest ib the kernel accepts, in dwords */
+    uint32_t                    max_ndw;
+    pthread_mutex_t             pool_mutex;
+    struct cs_gem               *pool[CS_POOL_SIZE];
+    unsigned                    npool;
+    /* largest reloc array a cs has needed so far, new cs start with it */
+    unsigned                    nrelocs_hint;
 };
 
 #pragma pack(1)
@@ -76,10 +88,16 @@ struct cs_gem {
     unsigned                    nrelocs;
     uint32_t                    *relocs;
     struct radeon_bo_int        **relocs_bo;
+    /* open addressing table from bo handle to reloc index + 1, 0 = empty,
+     * kept at most half full */
+    uint32_t                    *reloc_hash;
+    unsigned                    reloc_hash_size;
 };
 
-static pthread_mutex_t id_mutex = PTHREAD_MUTEX_INITIALIZER;
-static uint32_t cs_id_source = 0;
+#define RELOC_HASH_INITIAL_SIZE 512
+#define RELOCS_INITIAL_SIZE (4096 / (4 * 4))
+
+static atomic_t cs_id_source;
 
 /**
  * result is undefined if called with ~0
@@ -87,26 +105,31 @@ static uint32_t cs_id_source = 0;
 static uint32_t get_first_zero(const uint32_t n)
 {
     /* __builtin_ctz returns number of trailing zeros. */
-    return 1 << __builtin_ctz(~n);
+    return 1u << __builtin_ctz(~n);
 }
 
 /**
  * Returns a free id for cs.
  * If there is no free id we return zero
+ *
+ * The id is one bit of the per-bo reloc_in_cs mask, so only 32 cs can have
+ * one at a time.  A cs without an id skips the mask test and always looks
+ * in its reloc hash, which gives the same answer at the cost of a probe.
  **/
 static uint32_t generate_id(void)
 {
-    uint32_t r = 0;
-    pthread_mutex_lock( &id_mutex );
-    /* check for free ids */
-    if (cs_id_source != ~r) {
-        /* find first zero bit */
-        r = get_first_zero(cs_id_source);
+    uint32_t old, r;
 
-        /* set id as reserved */
-        cs_id_source |= r;
-    }
-    pthread_mutex_unlock( &id_mutex );
+    do {
+        old = atomic_read(&cs_id_source);
+        /* check for free ids */
+        if (old == ~0u) {
+            return 0;
+        }
+        /* find first zero bit */
+        r = get_first_zero(old);
+        /* set id as reserved, unless another thread raced us to it */
+    } while ((uint32_t)atomic_cmpxchg(&cs_id_source, old, old | r) != old);
     return r;
 }
 
@@ -115,51 +138,148 @@ static uint32_t generate_id(void)
  **/
 static void free_id(uint32_t id)
 {
-    pthread_mutex_lock( &id_mutex );
+    /* the bit is set, so subtracting it clears exactly that bit */
+    atomic_dec(&cs_id_source, id);
+}
+
+static inline uint32_t reloc_hash_slot(uint32_t handle, unsigned size)
+{
+    /* handles are small and mostly sequential, a multiplicative hash
+     * keeps them spread out over the low bits */
+    return (handle * 0x9E3779B1u) & (size - 1);
+}
+
+static int reloc_hash_find(struct cs_gem *csg, uint32_t handle)
+{
+    unsigned mask = csg->reloc_hash_size - 1;
+    uint32_t slot = reloc_hash_slot(handle, csg->reloc_hash_size);
+    uint32_t entry;
+
+    while ((entry = csg->reloc_hash[slot]) != 0) {
+        if (csg->relocs[(entry - 1) * RELOC_SIZE] == handle)
+            return entry - 1;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
 
-    cs_id_source &= ~id;
+static void reloc_hash_insert(struct cs_gem *csg, uint32_t handle,
+                              unsigned index)
+{
+    unsigned mask = csg->reloc_hash_size - 1;
+    uint32_t slot = reloc_hash_slot(handle, csg->reloc_hash_size);
 
-    pthread_mutex_unlock( &id_mutex );
+    while (csg->reloc_hash[slot] != 0)
+        slot = (slot + 1) & mask;
+    csg->reloc_hash[slot] = index + 1;
 }
 
-static struct radeon_cs_int *cs_gem_create(struct radeon_cs_manager *csm,
-                                       uint32_t ndw)
+/* Double the table and reinsert every reloc of the current CS */
+static int reloc_hash_grow(struct cs_gem *csg)
 {
-    struct cs_gem *csg;
+    unsigned size = csg->reloc_hash_size * 2;
+    uint32_t *hash;
+    unsigned i;
 
-    /* max cmd buffer size is 64Kb */
-    if (ndw > (64 * 1024 / 4)) {
-        return NULL;
+    hash = (uint32_t*)calloc(size, sizeof(uint32_t));
+    if (hash == NULL) {
+        return -ENOMEM;
+    }
+    free(csg->reloc_hash);
+    csg->reloc_hash = hash;
+    csg->reloc_hash_size = size;
+    for (i = 0; i < csg->base.crelocs; i++) {
+        reloc_hash_insert(csg, csg->relocs[i * RELOC_SIZE], i);
     }
+    return 0;
+}
+
+static void cs_gem_free(struct cs_gem *csg)
+{
+    free(csg->reloc_hash);
+    free(csg->relocs_bo);
+    free(csg->relocs);
+    free(csg->base.packets);
+    free(csg);
+}
+
+static struct cs_gem *cs_gem_alloc(uint32_t ndw, unsigned nrelocs)
+{
+    struct cs_gem *csg;
+
     csg = (struct cs_gem*)calloc(1, sizeof(struct cs_gem));
     if (csg == NULL) {
         return NULL;
     }
-    csg->base.csm = csm;
-    csg->base.ndw = 64 * 1024 / 4;
-    csg->base.packets = (uint32_t*)calloc(1, 64 * 1024);
-    if (csg->base.packets == NULL) {
-        free(csg);
-        return NULL;
-    }
-    csg->base.relocs_total_size = 0;
-    csg->base.crelocs = 0;
-    csg->base.id = generate_id();
-    csg->nrelocs = 4096 / (4 * 4) ;
+    csg->base.ndw = ndw;
+    csg->base.packets = (uint32_t*)calloc(ndw, 4);
+    csg->nrelocs = nrelocs;
     csg->relocs_bo = (struct radeon_bo_int**)calloc(1,
                                                 csg->nrelocs*sizeof(void*));
-    if (csg->relocs_bo == NULL) {
-        free(csg->base.packets);
-        free(csg);
+    csg->relocs = (uint32_t*)calloc(csg->nrelocs, RELOC_SIZE * 4);
+    /* keep the hash at most half full without growing it right away */
+    csg->reloc_hash_size = RELOC_HASH_INITIAL_SIZE;
+    while (csg->reloc_hash_size < csg->nrelocs * 2) {
+        csg->reloc_hash_size *= 2;
+    }
+    csg->reloc_hash = (uint32_t*)calloc(csg->reloc_hash_size,
+                                        sizeof(uint32_t));
+    if (csg->base.packets == NULL || csg->relocs_bo == NULL ||
+        csg->relocs == NULL || csg->reloc_hash == NULL) {
+        cs_gem_free(csg);
         return NULL;
     }
-    csg->base.relocs = csg->relocs = (uint32_t*)calloc(1, 4096);
-    if (csg->relocs == NULL) {
-        free(csg->relocs_bo);
-        free(csg->base.packets);
-        free(csg);
+    return csg;
+}
+
+static struct radeon_cs_int *cs_gem_create(struct radeon_cs_manager *csm,
+                                       uint32_t ndw)
+{
+    struct radeon_cs_manager_gem *csmg = (struct radeon_cs_manager_gem*)csm;
+    struct cs_gem *csg = NULL;
+
+    if (ndw > csmg->max_ndw) {
         return NULL;
     }
+    /* round up the required size to a multiple of 1024 */
+    ndw = (ndw + 0x3FF) & (~0x3FF);
+    if (ndw == 0) {
+        ndw = 0x400;
+    }
+
+    /* a recycled cs keeps the packet and reloc arrays its previous user
+     * grew, so sizes follow what the application actually emits */
+    pthread_mutex_lock(&csmg->pool_mutex);
+    if (csmg->npool) {
+        csg = csmg->pool[--csmg->npool];
+    }
+    pthread_mutex_unlock(&csmg->pool_mutex);
+    if (csg) {
+        uint32_t *packets = csg->base.packets;
+        unsigned pool_ndw = csg->base.ndw;
+
+        if (pool_ndw < ndw) {
+            packets = (uint32_t*)realloc(packets, 4 * ndw);
+            if (packets == NULL) {
+                cs_gem_free(csg);
+                return NULL;
+            }
+            pool_ndw = ndw;
+        }
+        memset(&csg->base, 0, sizeof(csg->base));
+        csg->base.packets = packets;
+        csg->base.ndw = pool_ndw;
+    } else {
+        csg = cs_gem_alloc(ndw, csmg->nrelocs_hint);
+        if (csg == NULL) {
+            return NULL;
+        }
+    }
+    csg->base.csm = csm;
+    csg->base.relocs = csg->relocs;
+    csg->base.relocs_total_size = 0;
+    csg->base.crelocs = 0;
+    csg->base.id = generate_id();
     csg->chunks[0].chunk_id = RADEON_CHUNK_ID_IB;
     csg->chunks[0].length_dw = 0;
     csg->chunks[0].chunk_data = (uint64_t)(uintptr_t)csg->base.packets;
@@ -179,7 +299,7 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
     struct cs_gem *csg = (struct cs_gem*)cs;
     struct cs_reloc_gem *reloc;
     uint32_t idx;
-    unsigned i;
+    int i;
 
     assert(boi->space_accounted);
 
@@ -198,65 +318,69 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
     }
     /* use bit field hash function to determine
        if this bo is for sure not in this cs.*/
-    if ((atomic_read((atomic_t *)radeon_gem_get_reloc_in_cs(bo)) & cs->id)) {
-        /* check if bo is already referenced.
-         * Scanning from end to begin reduces cycles with mesa because
-         * it often relocates same shared dma bo again. */
-        for(i = cs->crelocs; i != 0;) {
-            --i;
+    if (!cs->id ||
+        (atomic_read((atomic_t *)radeon_gem_get_reloc_in_cs(bo)) & cs->id)) {
+        /* check if bo is already referenced */
+        i = reloc_hash_find(csg, bo->handle);
+        if (i >= 0) {
             idx = i * RELOC_SIZE;
             reloc = (struct cs_reloc_gem*)&csg->relocs[idx];
-            if (reloc->handle == bo->handle) {
-                /* Check domains must be in read or write. As we check already
-                 * checked that in argument one of the read or write domain was
-                 * set we only need to check that if previous reloc as the read
-                 * domain set then the read_domain should also be set for this
-                 * new relocation.
-                 */
-                /* the DDX expects to read and write from same pixmap */
-                if (write_domain && (reloc->read_domain & write_domain)) {
-                    reloc->read_domain = 0;
-                    reloc->write_domain = write_domain;
-                } else if (read_domain & reloc->write_domain) {
-                    reloc->read_domain = 0;
-                } else {
-                    if (write_domain != reloc->write_domain)
-                        return -EINVAL;
-                    if (read_domain != reloc->read_domain)
-                        return -EINVAL;
-                }
-
-                reloc->read_domain |= read_domain;
-                reloc->write_domain |= write_domain;
-                /* update flags */
-                reloc->flags |= (flags & reloc->flags);
-                /* write relocation packet */
-                radeon_cs_write_dword((struct radeon_cs *)cs, 0xc0001000);
-                radeon_cs_write_dword((struct radeon_cs *)cs, idx);
-                return 0;
+            /* Check domains must be in read or write. As we check already
+             * checked that in argument one of the read or write domain was
+             * set we only need to check that if previous reloc as the read
+             * domain set then the read_domain should also be set for this
+             * new relocation.
+             */
+            /* the DDX expects to read and write from same pixmap */
+            if (write_domain && (reloc->read_domain & write_domain)) {
+                reloc->read_domain = 0;
+                reloc->write_domain = write_domain;
+            } else if (read_domain & reloc->write_domain) {
+                reloc->read_domain = 0;
+            } else {
+                if (write_domain != reloc->write_domain)
+                    return -EINVAL;
+                if (read_domain != reloc->read_domain)
+                    return -EINVAL;
             }
+
+            reloc->read_domain |= read_domain;
+            reloc->write_domain |= write_domain;
+            /* update flags */
+            reloc->flags |= (flags & reloc->flags);
+            /* write relocation packet */
+            radeon_cs_write_dword((struct radeon_cs *)cs, 0xc0001000);
+            radeon_cs_write_dword((struct radeon_cs *)cs, idx);
+            return 0;
         }
     }
     /* new relocation */
     if (csg->base.crelocs >= csg->nrelocs) {
-        /* allocate more memory (TODO: should use a slab allocatore maybe) */
+        /* grow geometrically so that appending stays amortized O(1) */
         uint32_t *tmp, size;
-        size = ((csg->nrelocs + 1) * sizeof(struct radeon_bo*));
+        unsigned nrelocs = csg->nrelocs * 2;
+        size = (nrelocs * sizeof(struct radeon_bo*));
         tmp = (uint32_t*)realloc(csg->relocs_bo, size);
         if (tmp == NULL) {
             return -ENOMEM;
         }
         csg->relocs_bo = (struct radeon_bo_int **)tmp;
-        size = ((csg->nrelocs + 1) * RELOC_SIZE * 4);
+        size = (nrelocs * RELOC_SIZE * 4);
         tmp = (uint32_t*)realloc(csg->relocs, size);
         if (tmp == NULL) {
             return -ENOMEM;
         }
         cs->relocs = csg->relocs = tmp;
-        csg->nrelocs += 1;
+        csg->nrelocs = nrelocs;
         csg->chunks[1].chunk_data = (uint64_t)(uintptr_t)csg->relocs;
     }
+    if ((csg->base.crelocs + 1) * 2 > csg->reloc_hash_size) {
+        if (reloc_hash_grow(csg)) {
+            return -ENOMEM;
+        }
+    }
     csg->relocs_bo[csg->base.crelocs] = boi;
+    reloc_hash_insert(csg, bo->handle, csg->base.crelocs);
     idx = (csg->base.crelocs++) * RELOC_SIZE;
     reloc = (struct cs_reloc_gem*)&csg->relocs[idx];
     reloc->handle = bo->handle;
@@ -338,86 +462,47 @@ static void cs_gem_dump_bof(struct radeon_cs_int *cs)
 {
     struct cs_gem *csg = (struct cs_gem*)cs;
     struct radeon_cs_manager_gem *csm;
-    bof_t *bcs, *blob, *array, *bo, *size, *handle, *device_id, *root;
+    bof_writer_t *writer;
     char tmp[256];
     unsigned i;
+    int r;
 
     csm = (struct radeon_cs_manager_gem *)cs->csm;
-    root = device_id = bcs = blob = array = bo = size = handle = NULL;
-    root = bof_object();
-    if (root == NULL)
-        goto out_err;
-    device_id = bof_int32(csm->device_id);
-    if (device_id == NULL)
+    sprintf(tmp, "d-0x%04X-%08d.bof", csm->device_id, csm->nbof++);
+    /* entries are streamed to the file, bo contents straight from their
+     * mapping, instead of building the whole tree first */
+    writer = bof_writer_new(tmp);
+    if (writer == NULL)
         return;
-    if (bof_object_set(root, "device_id", device_id))
-        goto out_err;
-    bof_decref(device_id);
-    device_id = NULL;
+    if (bof_writer_int32(writer, "device_id", csm->device_id))
+        goto out;
     /* dump relocs */
-    blob = bof_blob(csg->nrelocs * 16, csg->relocs);
-    if (blob == NULL)
-        goto out_err;
-    if (bof_object_set(root, "reloc", blob))
-        goto out_err;
-    bof_decref(blob);
-    blob = NULL;
+    if (bof_writer_blob(writer, "reloc", csg->nrelocs * 16, csg->relocs))
+        goto out;
     /* dump cs */
-    blob = bof_blob(cs->cdw * 4, cs->packets);
-    if (blob == NULL)
-        goto out_err;
-    if (bof_object_set(root, "pm4", blob))
-        goto out_err;
-    bof_decref(blob);
-    blob = NULL;
+    if (bof_writer_blob(writer, "pm4", cs->cdw * 4, cs->packets))
+        goto out;
     /* dump bo */
-    array = bof_array();
-    if (array == NULL)
-        goto out_err;
+    if (bof_writer_begin_array(writer, "bo"))
+        goto out;
     for (i = 0; i < csg->base.crelocs; i++) {
-        bo = bof_object();
-        if (bo == NULL)
-            goto out_err;
-        size = bof_int32(csg->relocs_bo[i]->size);
-        if (size == NULL)
-            goto out_err;
-        if (bof_object_set(bo, "size", size))
-            goto out_err;
-        bof_decref(size);
-        size = NULL;
-        handle = bof_int32(csg->relocs_bo[i]->handle);
-        if (handle == NULL)
-            goto out_err;
-        if (bof_object_set(bo, "handle", handle))
-            goto out_err;
-        bof_decref(handle);
-        handle = NULL;
+        if (bof_writer_begin_object(writer, NULL))
+            goto out;
+        if (bof_writer_int32(writer, "size", csg->relocs_bo[i]->size))
+            goto out;
+        if (bof_writer_int32(writer, "handle", csg->relocs_bo[i]->handle))
+            goto out;
         radeon_bo_map((struct radeon_bo*)csg->relocs_bo[i], 0);
-        blob = bof_blob(csg->relocs_bo[i]->size, csg->relocs_bo[i]->ptr);
+        r = bof_writer_blob(writer, "data", csg->relocs_bo[i]->size,
+                            csg->relocs_bo[i]->ptr);
         radeon_bo_unmap((struct radeon_bo*)csg->relocs_bo[i]);
-        if (blob == NULL)
-            goto out_err;
-        if (bof_object_set(bo, "data", blob))
-            goto out_err;
-        bof_decref(blob);
-        blob = NULL;
-        if (bof_array_append(array, bo))
-            goto out_err;
-        bof_decref(bo);
-        bo = NULL;
+        if (r)
+            goto out;
+        if (bof_writer_end(writer))
+            goto out;
     }
-    if (bof_object_set(root, "bo", array))
-        goto out_err;
-    sprintf(tmp, "d-0x%04X-%08d.bof", csm->device_id, csm->nbof++);
-    bof_dump_file(root, tmp);
-out_err:
-    bof_decref(blob);
-    bof_decref(array);
-    bof_decref(bo);
-    bof_decref(size);
-    bof_decref(handle);
-    bof_decref(device_id);
-    bof_decref(root);
+out:
+    bof_writer_close(writer);
 }
 #endif
 
@@ -434,6 +519,8 @@ static int cs_gem_emit(struct radeon_cs_int *cs)
 #if CS_BOF_DUMP
     cs_gem_dump_bof(cs);
 #endif
+    /* cs_gem_begin may have reallocated the packets since cs_gem_open */
+    csg->chunks[0].chunk_data = (uint64_t)(uintptr_t)cs->packets;
     csg->chunks[0].length_dw = cs->cdw;
 
     chunk_array[0] = (uint64_t)(uintptr_t)&csg->chunks[0];
@@ -455,21 +542,10 @@ static int cs_gem_emit(struct radeon_cs_int *cs)
     cs->csm->read_used = 0;
     cs->csm->vram_write_used = 0;
     cs->csm->gart_write_used = 0;
+    cs->csm->space_epoch++;
     return r;
 }
 
-static int cs_gem_destroy(struct radeon_cs_int *cs)
-{
-    struct cs_gem *csg = (struct cs_gem*)cs;
-
-    free_id(cs->id);
-    free(csg->relocs_bo);
-    free(cs->relocs);
-    free(cs->packets);
-    free(cs);
-    return 0;
-}
-
 static int cs_gem_erase(struct radeon_cs_int *cs)
 {
     struct cs_gem *csg = (struct cs_gem*)cs;
@@ -485,6 +561,7 @@ static int cs_gem_erase(struct radeon_cs_int *cs)
             }
         }
     }
+    memset(csg->reloc_hash, 0, csg->reloc_hash_size * sizeof(uint32_t));
     cs->relocs_total_size = 0;
     cs->cdw = 0;
     cs->section_ndw = 0;
@@ -494,6 +571,29 @@ static int cs_gem_erase(struct radeon_cs_int *cs)
     return 0;
 }
 
+static int cs_gem_destroy(struct radeon_cs_int *cs)
+{
+    struct radeon_cs_manager_gem *csmg = (struct radeon_cs_manager_gem*)cs->csm;
+    struct cs_gem *csg = (struct cs_gem*)cs;
+
+    /* drop the references of relocations that were never emitted */
+    cs_gem_erase(cs);
+    free_id(cs->id);
+    pthread_mutex_lock(&csmg->pool_mutex);
+    if (csg->nrelocs > csmg->nrelocs_hint) {
+        csmg->nrelocs_hint = csg->nrelocs;
+    }
+    if (csmg->npool < CS_POOL_SIZE) {
+        csmg->pool[csmg->npool++] = csg;
+        csg = NULL;
+    }
+    pthread_mutex_unlock(&csmg->pool_mutex);
+    if (csg) {
+        cs_gem_free(csg);
+    }
+    return 0;
+}
+
 static int cs_gem_need_flush(struct radeon_cs_int *cs)
 {
     return 0; //(cs->relocs_total_size > (32*1024*1024));
@@ -536,6 +636,25 @@ static int radeon_get_device_id(int fd, uint32_t *device_id)
     return r;
 }
 
+static uint32_t radeon_get_max_ib_ndw(int fd)
+{
+    struct drm_radeon_info info = {};
+    uint32_t ib_max_size = 0;
+    int r;
+
+    /* Kernels that report the VM ib limit allocate ibs from a suballocator
+     * rather than from fixed 64Kb slots, so the same limit holds for the
+     * legacy cs path. */
+    info.request = RADEON_INFO_IB_VM_MAX_SIZE;
+    info.value = (uintptr_t)&ib_max_size;
+    r = drmCommandWriteRead(fd, DRM_RADEON_INFO, &info,
+                            sizeof(struct drm_radeon_info));
+    if (r || ib_max_size < 64 * 1024 / 4) {
+        return 64 * 1024 / 4;
+    }
+    return ib_max_size;
+}
+
 drm_public struct radeon_cs_manager *radeon_cs_manager_gem_ctor(int fd)
 {
     struct radeon_cs_manager_gem *csm;
@@ -547,10 +666,33 @@ drm_public struct radeon_cs_manager *radeon_cs_manager_gem_ctor(int fd)
     csm->base.funcs = &radeon_cs_gem_funcs;
     csm->base.fd = fd;
     radeon_get_device_id(fd, &csm->device_id);
+    csm->max_ndw = radeon_get_max_ib_ndw(fd);
+    csm->nrelocs_hint = RELOCS_INITIAL_SIZE;
+    pthread_mutex_init(&csm->pool_mutex, NULL);
     return &csm->base;
 }
 
 drm_public void radeon_cs_manager_gem_dtor(struct radeon_cs_manager *csm)
 {
+    struct radeon_cs_manager_gem *csmg = (struct radeon_cs_manager_gem*)csm;
+
+    while (csmg->npool) {
+        cs_gem_free(csmg->pool[--csmg->npool]);
+    }
+    pthread_mutex_destroy(&csmg->pool_mutex);
     free(csm);
 }
+
+/**
+ * Returns the largest size, in dwords, that radeon_cs_create() accepts.
+ *
+ * This is 64Kb worth of dwords unless the kernel reports that it can take
+ * bigger ibs, in which case applications can build longer command streams
+ * and flush less often.
+ */
+drm_public uint32_t radeon_cs_manager_gem_get_max_ndw(struct radeon_cs_manager *csm)
+{
+    struct radeon_cs_manager_gem *csmg = (struct radeon_cs_manager_gem*)csm;
+
+    return csmg->max_ndw;
+}
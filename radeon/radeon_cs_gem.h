@@ -37,5 +37,6 @@
 
 struct radeon_cs_manager *radeon_cs_manager_gem_ctor(int fd);
 void radeon_cs_manager_gem_dtor(struct radeon_cs_manager *csm);
+uint32_t radeon_cs_manager_gem_get_max_ndw(struct radeon_cs_manager *csm);
 
 #endif
@@ -29,6 +29,10 @@ struct radeon_cs_int {
     void                        (*space_flush_fn)(void *);
     void                        *space_flush_data;
     uint32_t                    id;
+    /* bos[0..space_checked) are accounted as of csm->space_epoch ==
+     * space_epoch and need not be looked at again */
+    int                         space_checked;
+    uint32_t                    space_epoch;
 };
 
 /* cs functions */
@@ -63,5 +67,7 @@ struct radeon_cs_manager {
     int32_t vram_limit, gart_limit;
     int32_t vram_write_used, gart_write_used;
     int32_t read_used;
+    /* bumped whenever bo space accounting changes */
+    uint32_t space_epoch;
 };
 #endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NON-INFRINGEMENT. IN NO EVENT SHALL THE COPYRIGHT HOLDERS, AUTHORS
+ * AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ */
+/*
+ * Replay of the cs captures written by cs_gem_dump_bof() (CS_BOF_DUMP).
+ *
+ * A capture holds the pm4 stream, the relocation chunk and the content of
+ * every relocated bo.  Relocations show up in the stream as a type 3 NOP
+ * followed by the dword offset of the relocation in the chunk, which is
+ * what radeon_cs_write_reloc() writes, so rebuilding a cs is a matter of
+ * copying packets and redoing the space check and relocation for each of
+ * these NOPs with the replayed bos.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libdrm.h"
+#include "radeon_cs.h"
+#include "bof.h"
+
+#define RELOC_NOP       0xc0001000
+#define RELOC_SIZE      (sizeof(struct drm_radeon_cs_reloc) / sizeof(uint32_t))
+
+struct radeon_cs_replay {
+    uint32_t                    *pm4;
+    uint32_t                    ndw;
+    uint32_t                    nbos;
+    struct drm_radeon_cs_reloc  *relocs;
+    struct radeon_bo            **bos;
+};
+
+static int replay_load_bo(struct radeon_cs_replay *replay,
+                          struct radeon_bo_manager *bom,
+                          bof_t *bo, unsigned i, uint32_t flags)
+{
+    struct drm_radeon_cs_reloc *reloc = &replay->relocs[i];
+    bof_t *size, *data;
+    int r;
+
+    size = bof_object_get(bo, "size");
+    data = bof_object_get(bo, "data");
+    if (size == NULL || !bof_is_int32(size) || data == NULL) {
+        return -EINVAL;
+    }
+    replay->bos[i] = radeon_bo_open(bom, 0, bof_int32_value(size), 0,
+                                    reloc->read_domains | reloc->write_domain, 0);
+    if (replay->bos[i] == NULL) {
+        return -ENOMEM;
+    }
+    if (!(flags & RADEON_CS_REPLAY_UPLOAD)) {
+        return 0;
+    }
+    if (bof_blob_size(data) > (unsigned)bof_int32_value(size)) {
+        return -EINVAL;
+    }
+    r = radeon_bo_map(replay->bos[i], 1);
+    if (r) {
+        return r;
+    }
+    memcpy(replay->bos[i]->ptr, bof_blob_value(data), bof_blob_size(data));
+    radeon_bo_unmap(replay->bos[i]);
+    return 0;
+}
+
+drm_public struct radeon_cs_replay *
+radeon_cs_replay_load(struct radeon_bo_manager *bom, const char *filename,
+                      uint32_t flags)
+{
+    struct radeon_cs_replay *replay;
+    bof_t *root, *pm4, *relocs, *bos;
+    unsigned i;
+
+    root = bof_map_file(filename);
+    if (root == NULL) {
+        return NULL;
+    }
+    replay = calloc(1, sizeof(struct radeon_cs_replay));
+    if (replay == NULL) {
+        goto out_err;
+    }
+    pm4 = bof_object_get(root, "pm4");
+    relocs = bof_object_get(root, "reloc");
+    bos = bof_object_get(root, "bo");
+    if (pm4 == NULL || !bof_is_blob(pm4) || relocs == NULL ||
+        !bof_is_blob(relocs) || bos == NULL || !bof_is_array(bos)) {
+        goto out_err;
+    }
+    /* the reloc chunk is dumped up to its allocated size, the bo array
+     * has one entry per relocation in use */
+    replay->nbos = bof_array_size(bos);
+    if (bof_blob_size(relocs) < replay->nbos * sizeof(struct drm_radeon_cs_reloc)) {
+        goto out_err;
+    }
+    /* copy out of the mapping so that dwords are aligned */
+    replay->ndw = bof_blob_size(pm4) / 4;
+    replay->pm4 = malloc(replay->ndw * 4);
+    replay->relocs = malloc(replay->nbos * sizeof(struct drm_radeon_cs_reloc));
+    replay->bos = calloc(replay->nbos, sizeof(struct radeon_bo *));
+    if ((replay->ndw && replay->pm4 == NULL) ||
+        (replay->nbos && (replay->relocs == NULL || replay->bos == NULL))) {
+        goto out_err;
+    }
+    memcpy(replay->pm4, bof_blob_value(pm4), replay->ndw * 4);
+    memcpy(replay->relocs, bof_blob_value(relocs),
+           replay->nbos * sizeof(struct drm_radeon_cs_reloc));
+    for (i = 0; i < replay->nbos; i++) {
+        if (replay_load_bo(replay, bom, bof_array_get(bos, i), i, flags)) {
+            goto out_err;
+        }
+    }
+    bof_decref(root);
+    return replay;
+out_err:
+    radeon_cs_replay_free(replay);
+    bof_decref(root);
+    return NULL;
+}
+
+drm_public void radeon_cs_replay_free(struct radeon_cs_replay *replay)
+{
+    unsigned i;
+
+    if (replay == NULL) {
+        return;
+    }
+    for (i = 0; replay->bos && i < replay->nbos; i++) {
+        if (replay->bos[i]) {
+            radeon_bo_unref(replay->bos[i]);
+        }
+    }
+    free(replay->bos);
+    free(replay->relocs);
+    free(replay->pm4);
+    free(replay);
+}
+
+drm_public uint32_t radeon_cs_replay_ndw(struct radeon_cs_replay *replay)
+{
+    return replay->ndw;
+}
+
+drm_public int
+radeon_cs_replay_build(struct radeon_cs_replay *replay, struct radeon_cs *cs)
+{
+    struct drm_radeon_cs_reloc *reloc;
+    struct radeon_bo *bo;
+    uint32_t header, i, n, idx, read_domains;
+    int r;
+
+    if (cs->ndw - cs->cdw < replay->ndw) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < replay->ndw; i += n + 1) {
+        header = replay->pm4[i];
+        switch (header >> 30) {
+        case 0:
+        case 3:
+            n = ((header >> 16) & 0x3fff) + 1;
+            break;
+        case 1:
+            n = 2;
+            break;
+        default:
+            n = 0;
+            break;
+        }
+        if (n > replay->ndw - i - 1) {
+            return -EINVAL;
+        }
+        if (header != RELOC_NOP) {
+            radeon_cs_write_table(cs, replay->pm4 + i, n + 1);
+            continue;
+        }
+        idx = replay->pm4[i + 1] / RELOC_SIZE;
+        if (idx >= replay->nbos) {
+            return -EINVAL;
+        }
+        reloc = &replay->relocs[idx];
+        bo = replay->bos[idx];
+        /* a bo read and written in the same cs ends up with both domains
+         * in the chunk, which radeon_cs_write_reloc does not take */
+        read_domains = reloc->write_domain ? 0 : reloc->read_domains;
+        r = radeon_cs_space_check_with_bo(cs, bo, read_domains,
+                                          reloc->write_domain);
+        if (r) {
+            return r;
+        }
+        r = radeon_cs_write_reloc(cs, bo, read_domains,
+                                  reloc->write_domain, reloc->flags);
+        if (r) {
+            return r;
+        }
+    }
+    return 0;
+}
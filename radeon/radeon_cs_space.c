@@ -36,6 +36,8 @@
 #include "radeon_bo_int.h"
 #include "radeon_cs_int.h"
 
+#define CS_SPACE_CHECK_DEBUG 0
+
 struct rad_sizes {
     int32_t op_read;
     int32_t op_gart_write;
@@ -112,7 +114,7 @@ static inline int radeon_cs_setup_bo(struct radeon_cs_space_check *sc, struct ra
 static int radeon_cs_do_space_check(struct radeon_cs_int *cs, struct radeon_cs_space_check *new_tmp)
 {
     struct radeon_cs_manager *csm = cs->csm;
-    int i;
+    int i, first = 0, settled = 1;
     struct radeon_bo_int *bo;
     struct rad_sizes sizes;
     int ret;
@@ -124,8 +126,30 @@ static int radeon_cs_do_space_check(struct radeon_cs_int *cs, struct radeon_cs_s
 
     memset(&sizes, 0, sizeof(struct rad_sizes));
 
+    /* bos committed by the last check are still accounted in the
+       manager totals unless a flush or another cs touched the
+       accounting since, so only the bos added after it need setup */
+    if (cs->space_epoch == csm->space_epoch)
+        first = cs->space_checked;
+
+#if CS_SPACE_CHECK_DEBUG
+    for (i = 0; i < first; i++) {
+        struct radeon_cs_space_check sc = cs->bos[i];
+        struct rad_sizes full;
+
+        memset(&full, 0, sizeof(struct rad_sizes));
+        ret = radeon_cs_setup_bo(&sc, &full);
+        if (ret || full.op_read || full.op_gart_write || full.op_vram_write) {
+            fprintf(stderr, "space check: bo 0x%x no longer accounted "
+                    "(%d, read %d, gart %d, vram %d)\n", sc.bo->handle, ret,
+                    full.op_read, full.op_gart_write, full.op_vram_write);
+            assert(0);
+        }
+    }
+#endif
+
     /* prepare */
-    for (i = 0; i < cs->bo_count; i++) {
+    for (i = first; i < cs->bo_count; i++) {
         ret = radeon_cs_setup_bo(&cs->bos[i], &sizes);
         if (ret)
             return ret;
@@ -155,12 +179,25 @@ static int radeon_cs_do_space_check(struct radeon_cs_int *cs, struct radeon_cs_s
     csm->vram_write_used += sizes.op_vram_write;
     csm->read_used += sizes.op_read;
     /* commit */
-    for (i = 0; i < cs->bo_count; i++) {
+    for (i = first; i < cs->bo_count; i++) {
         bo = cs->bos[i].bo;
+        if (bo->space_accounted && bo->space_accounted != cs->bos[i].new_accounted)
+            settled = 0;
         bo->space_accounted = cs->bos[i].new_accounted;
     }
-    if (new_tmp)
-        new_tmp->bo->space_accounted = new_tmp->new_accounted;
+    if (new_tmp) {
+        bo = new_tmp->bo;
+        if (bo->space_accounted && bo->space_accounted != new_tmp->new_accounted)
+            settled = 0;
+        bo->space_accounted = new_tmp->new_accounted;
+    }
+    /* a bo that changed domains may be listed again with its old ones,
+       so only trust the list as it is when nothing was re-accounted */
+    csm->space_epoch++;
+    if (settled) {
+        cs->space_epoch = csm->space_epoch;
+        cs->space_checked = cs->bo_count;
+    }
 
     return RADEON_CS_SPACE_OK;
 }
@@ -248,4 +285,5 @@ drm_public void radeon_cs_space_reset_bos(struct radeon_cs *cs)
         csi->bos[i].new_accounted = 0;
     }
     csi->bo_count = 0;
+    csi->space_checked = 0;
 }
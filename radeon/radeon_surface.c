@@ -33,9 +33,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "drm.h"
 #include "libdrm.h"
 #include "xf86drm.h"
@@ -106,6 +113,21 @@ struct radeon_hw_info {
     uint32_t                        macrotile_mode_array[16];
 };
 
+/* Number of surface layouts remembered by a surface manager.  Layouts only
+ * depend on the surface description and the hw info, and applications ask
+ * for the same few texture shapes over and over.
+ */
+#define SURF_CACHE_SIZE 32
+
+struct radeon_surface_cache_entry {
+    struct radeon_surface_cache_entry *next;
+    uint32_t                    hash;
+    int                         best;
+    int                         referenced;
+    struct radeon_surface       in;
+    struct radeon_surface       out;
+};
+
 struct radeon_surface_manager {
     int                         fd;
     uint32_t                    device_id;
@@ -113,6 +135,15 @@ struct radeon_surface_manager {
     unsigned                    family;
     hw_init_surface_t           surface_init;
     hw_best_surface_t           surface_best;
+    pthread_mutex_t             cache_mutex;
+    /* entries are chained from cache_bucket by hash, and replaced in
+     * cache order with a clock hand skipping recently used ones */
+    struct radeon_surface_cache_entry *cache[SURF_CACHE_SIZE];
+    struct radeon_surface_cache_entry *cache_bucket[SURF_CACHE_SIZE];
+    unsigned                    cache_hand;
+    uint64_t                    cache_hits;
+    uint64_t                    cache_misses;
+    uint64_t                    cache_evictions;
 };
 
 /* helper */
@@ -1017,6 +1048,11 @@ static int eg_surface_best(struct radeon_surface_manager *surf_man,
 /* ===========================================================================
  * Southern Islands family
  */
+#define SI__GB_TILE_MODE__MICRO_TILE_MODE(x)    ((x) & 0x3)
+#define     SI__MICRO_TILE_MODE__DISPLAY                0
+#define     SI__MICRO_TILE_MODE__THIN                   1
+#define     SI__MICRO_TILE_MODE__DEPTH                  2
+#define     SI__MICRO_TILE_MODE__ROTATED                3
 #define SI__GB_TILE_MODE__PIPE_CONFIG(x)        (((x) >> 6) & 0x1f)
 #define     SI__PIPE_CONFIG__ADDR_SURF_P2               0
 #define     SI__PIPE_CONFIG__ADDR_SURF_P4_8x16          4
@@ -1817,6 +1853,11 @@ static int si_surface_best(struct radeon_surface_manager *surf_man,
 #define     CIK__TILE_SPLIT__1024B                       4
 #define     CIK__TILE_SPLIT__2048B                       5
 #define     CIK__TILE_SPLIT__4096B                       6
+#define CIK__GB_TILE_MODE__MICRO_TILE_MODE_NEW(x) (((x) >> 22) & 0x7)
+#define     CIK__MICRO_TILE_MODE__DISPLAY                0
+#define     CIK__MICRO_TILE_MODE__THIN                   1
+#define     CIK__MICRO_TILE_MODE__DEPTH                  2
+#define     CIK__MICRO_TILE_MODE__ROTATED                3
 #define CIK__GB_TILE_MODE__SAMPLE_SPLIT(x)         (((x) >> 25) & 0x3)
 #define     CIK__SAMPLE_SPLIT__1                         0
 #define     CIK__SAMPLE_SPLIT__2                         1
@@ -2407,6 +2448,7 @@ radeon_surface_manager_new(int fd)
     if (surf_man == NULL) {
         return NULL;
     }
+    pthread_mutex_init(&surf_man->cache_mutex, NULL);
     surf_man->fd = fd;
     if (radeon_get_value(fd, RADEON_INFO_DEVICE_ID, &surf_man->device_id)) {
         goto out_err;
@@ -2443,6 +2485,7 @@ radeon_surface_manager_new(int fd)
 
     return surf_man;
 out_err:
+    pthread_mutex_destroy(&surf_man->cache_mutex);
     free(surf_man);
     return NULL;
 }
@@ -2450,9 +2493,186 @@ out_err:
 drm_public void
 radeon_surface_manager_free(struct radeon_surface_manager *surf_man)
 {
+    unsigned i;
+
+    if (surf_man == NULL) {
+        return;
+    }
+    for (i = 0; i < SURF_CACHE_SIZE; i++) {
+        free(surf_man->cache[i]);
+    }
+    pthread_mutex_destroy(&surf_man->cache_mutex);
     free(surf_man);
 }
 
+drm_public void
+radeon_surface_manager_get_cache_stats(struct radeon_surface_manager *surf_man,
+                                       uint64_t *hits, uint64_t *misses,
+                                       uint64_t *evictions)
+{
+    pthread_mutex_lock(&surf_man->cache_mutex);
+    *hits = surf_man->cache_hits;
+    *misses = surf_man->cache_misses;
+    *evictions = surf_man->cache_evictions;
+    pthread_mutex_unlock(&surf_man->cache_mutex);
+}
+
+/* Copies the part of a surface the hw functions read or write: the scalar
+ * fields, and the per level arrays up to last_level.  The stencil and tiling
+ * index arrays only exist in newer headers, and are only touched when the
+ * flags ask for them, so they must not be accessed otherwise.
+ */
+static void surf_cache_copy(struct radeon_surface *dst,
+                            const struct radeon_surface *src)
+{
+    unsigned nlevels = src->last_level + 1;
+
+    memcpy(dst, src, offsetof(struct radeon_surface, level));
+    memcpy(dst->level, src->level, nlevels * sizeof(src->level[0]));
+    if (src->flags & RADEON_SURF_HAS_SBUFFER_MIPTREE) {
+        memcpy(dst->stencil_level, src->stencil_level,
+               nlevels * sizeof(src->stencil_level[0]));
+    }
+    if (src->flags & RADEON_SURF_HAS_TILE_MODE_INDEX) {
+        memcpy(dst->tiling_index, src->tiling_index,
+               nlevels * sizeof(src->tiling_index[0]));
+        memcpy(dst->stencil_tiling_index, src->stencil_tiling_index,
+               nlevels * sizeof(src->stencil_tiling_index[0]));
+    }
+}
+
+/* Some hw functions read back fields they also write (bo_size,
+ * bo_alignment, level modes...), so a layout is only reused when everything
+ * they may read matches, not just the fields callers usually fill in.
+ */
+static int surf_cache_match(const struct radeon_surface *a,
+                            const struct radeon_surface *b)
+{
+    unsigned nlevels = a->last_level + 1;
+
+    /* field by field: struct radeon_surface has padding before the 64 bit
+     * members, which the caller does not necessarily clear; the level
+     * structs have none */
+    if (a->npix_x != b->npix_x || a->npix_y != b->npix_y ||
+        a->npix_z != b->npix_z || a->blk_w != b->blk_w ||
+        a->blk_h != b->blk_h || a->blk_d != b->blk_d ||
+        a->array_size != b->array_size || a->last_level != b->last_level ||
+        a->bpe != b->bpe || a->nsamples != b->nsamples ||
+        a->flags != b->flags || a->bo_size != b->bo_size ||
+        a->bo_alignment != b->bo_alignment || a->bankw != b->bankw ||
+        a->bankh != b->bankh || a->mtilea != b->mtilea ||
+        a->tile_split != b->tile_split ||
+        a->stencil_tile_split != b->stencil_tile_split ||
+        a->stencil_offset != b->stencil_offset) {
+        return 0;
+    }
+    if (memcmp(a->level, b->level, nlevels * sizeof(a->level[0]))) {
+        return 0;
+    }
+    if ((a->flags & RADEON_SURF_HAS_SBUFFER_MIPTREE) &&
+        memcmp(a->stencil_level, b->stencil_level,
+               nlevels * sizeof(a->stencil_level[0]))) {
+        return 0;
+    }
+    return 1;
+}
+
+static uint32_t surf_cache_hash(const struct radeon_surface *surf, int best)
+{
+    const uint32_t key[] = {
+        surf->npix_x, surf->npix_y, surf->npix_z,
+        surf->blk_w, surf->blk_h, surf->blk_d,
+        surf->array_size, surf->last_level, surf->bpe,
+        surf->nsamples, surf->flags,
+        surf->bankw, surf->bankh, surf->mtilea,
+        surf->tile_split, surf->stencil_tile_split,
+    };
+    uint32_t h = 2166136261u ^ best;
+    unsigned i;
+
+    for (i = 0; i < sizeof(key) / sizeof(key[0]); i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int surf_cache_lookup(struct radeon_surface_manager *surf_man,
+                             struct radeon_surface *surf, int best)
+{
+    struct radeon_surface_cache_entry *entry;
+    uint32_t hash = surf_cache_hash(surf, best);
+
+    pthread_mutex_lock(&surf_man->cache_mutex);
+    entry = surf_man->cache_bucket[hash % SURF_CACHE_SIZE];
+    for (; entry; entry = entry->next) {
+        if (entry->hash != hash || entry->best != best ||
+            !surf_cache_match(&entry->in, surf)) {
+            continue;
+        }
+        entry->referenced = 1;
+        surf_cache_copy(surf, &entry->out);
+        surf_man->cache_hits++;
+        pthread_mutex_unlock(&surf_man->cache_mutex);
+        return 1;
+    }
+    surf_man->cache_misses++;
+    pthread_mutex_unlock(&surf_man->cache_mutex);
+    return 0;
+}
+
+/* Returns an unused entry, or evicts the first one the clock hand finds
+ * that was not used since the hand last went by.
+ */
+static struct radeon_surface_cache_entry *
+surf_cache_victim(struct radeon_surface_manager *surf_man)
+{
+    struct radeon_surface_cache_entry *entry, **link;
+    unsigned i;
+
+    for (i = 0; i < SURF_CACHE_SIZE; i++) {
+        if (surf_man->cache[i] == NULL) {
+            surf_man->cache[i] = calloc(1, sizeof(struct radeon_surface_cache_entry));
+            return surf_man->cache[i];
+        }
+    }
+    for (;;) {
+        entry = surf_man->cache[surf_man->cache_hand];
+        surf_man->cache_hand = (surf_man->cache_hand + 1) % SURF_CACHE_SIZE;
+        if (!entry->referenced) {
+            break;
+        }
+        entry->referenced = 0;
+    }
+    link = &surf_man->cache_bucket[entry->hash % SURF_CACHE_SIZE];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    surf_man->cache_evictions++;
+    return entry;
+}
+
+static void surf_cache_store(struct radeon_surface_manager *surf_man,
+                             const struct radeon_surface *in,
+                             const struct radeon_surface *out, int best)
+{
+    struct radeon_surface_cache_entry *entry, **bucket;
+
+    pthread_mutex_lock(&surf_man->cache_mutex);
+    entry = surf_cache_victim(surf_man);
+    if (entry) {
+        entry->hash = surf_cache_hash(in, best);
+        entry->best = best;
+        entry->referenced = 0;
+        surf_cache_copy(&entry->in, in);
+        surf_cache_copy(&entry->out, out);
+        bucket = &surf_man->cache_bucket[entry->hash % SURF_CACHE_SIZE];
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    pthread_mutex_unlock(&surf_man->cache_mutex);
+}
+
 static int radeon_surface_sanity(struct radeon_surface_manager *surf_man,
                                  struct radeon_surface *surf,
                                  unsigned type,
@@ -2520,13 +2740,24 @@ static int radeon_surface_sanity(struct radeon_surface_manager *surf_man,
     return 0;
 }
 
-drm_public int
-radeon_surface_init(struct radeon_surface_manager *surf_man,
-                    struct radeon_surface *surf)
+static int radeon_surface_compute(struct radeon_surface_manager *surf_man,
+                                  struct radeon_surface *surf, int best)
 {
+    struct radeon_surface in;
     unsigned mode, type;
     int r;
 
+    if (surf_man == NULL || surf == NULL) {
+        return -EINVAL;
+    }
+    if (surf->last_level >= RADEON_SURF_MAX_LEVEL) {
+        return -EINVAL;
+    }
+    if (surf_cache_lookup(surf_man, surf, best)) {
+        return 0;
+    }
+    surf_cache_copy(&in, surf);
+
     type = RADEON_SURF_GET(surf->flags, TYPE);
     mode = RADEON_SURF_GET(surf->flags, MODE);
 
@@ -2534,22 +2765,545 @@ radeon_surface_init(struct radeon_surface_manager *surf_man,
     if (r) {
         return r;
     }
-    return surf_man->surface_init(surf_man, surf);
+    if (best) {
+        r = surf_man->surface_best(surf_man, surf);
+    } else {
+        r = surf_man->surface_init(surf_man, surf);
+    }
+    if (!r) {
+        surf_cache_store(surf_man, &in, surf, best);
+    }
+    return r;
+}
+
+drm_public int
+radeon_surface_init(struct radeon_surface_manager *surf_man,
+                    struct radeon_surface *surf)
+{
+    return radeon_surface_compute(surf_man, surf, 0);
 }
 
 drm_public int
 radeon_surface_best(struct radeon_surface_manager *surf_man,
                     struct radeon_surface *surf)
 {
-    unsigned mode, type;
-    int r;
+    return radeon_surface_compute(surf_man, surf, 1);
+}
 
-    type = RADEON_SURF_GET(surf->flags, TYPE);
-    mode = RADEON_SURF_GET(surf->flags, MODE);
 
-    r = radeon_surface_sanity(surf_man, surf, type, mode);
-    if (r) {
-        return r;
+/* ===========================================================================
+ * software tiling
+ *
+ * Copies one slice of a mip level between a linear buffer and the tiled
+ * layout computed above.  A 1D tiled level is a row major array of 8x8
+ * micro tiles; inside a micro tile the element index interleaves the bits
+ * of x and y in an order given by the micro tile mode (and, for displayable
+ * tiles, by the element size).  Elements adjacent in x stay adjacent as
+ * long as the order starts with x bits, so a micro tile is moved as 16 byte
+ * units each gathered from (or scattered to) one or more linear runs.
+ */
+#define SURF_X(bit)     (bit)
+#define SURF_Y(bit)     (4 | (bit))
+
+/* displayable order, indexed by log2 of the element size */
+static const uint8_t surf_micro_display[5][6] = {
+    { SURF_X(0), SURF_X(1), SURF_X(2), SURF_Y(1), SURF_Y(0), SURF_Y(2) },
+    { SURF_X(0), SURF_X(1), SURF_X(2), SURF_Y(0), SURF_Y(1), SURF_Y(2) },
+    { SURF_X(0), SURF_X(1), SURF_Y(0), SURF_X(2), SURF_Y(1), SURF_Y(2) },
+    { SURF_X(0), SURF_Y(0), SURF_X(1), SURF_X(2), SURF_Y(1), SURF_Y(2) },
+    { SURF_Y(0), SURF_X(0), SURF_X(1), SURF_X(2), SURF_Y(1), SURF_Y(2) },
+};
+
+/* non displayable (thin) and depth order */
+static const uint8_t surf_micro_thin[6] = {
+    SURF_X(0), SURF_Y(0), SURF_X(1), SURF_Y(1), SURF_X(2), SURF_Y(2)
+};
+
+struct surf_tile_plan {
+    unsigned    bpe;
+    /* bytes of a linear run moved at once, at most 16 */
+    unsigned    piece;
+    unsigned    npieces;
+    /* byte offset in the micro tile of element (x, y), at [y * 8 + x] */
+    uint16_t    offset[64];
+    /* linear position of each piece, in tiled order */
+    uint8_t     piece_x[64];
+    uint8_t     piece_y[64];
+};
+
+static const uint8_t *surf_micro_order(struct radeon_surface_manager *surf_man,
+                                       const struct radeon_surface *surf,
+                                       unsigned level, unsigned bpe_log2)
+{
+    uint32_t gb_tile_mode;
+
+    if (surf_man->family <= CHIP_ARUBA) {
+        /* mesa only sets the non displayable order for depth */
+        if (surf->flags & RADEON_SURF_ZBUFFER) {
+            return surf_micro_thin;
+        }
+        return surf_micro_display[bpe_log2];
+    }
+
+    if (!(surf->flags & RADEON_SURF_HAS_TILE_MODE_INDEX) ||
+        surf->tiling_index[level] >= 32) {
+        return NULL;
+    }
+    gb_tile_mode = surf_man->hw_info.tile_mode_array[surf->tiling_index[level]];
+    if (surf_man->family >= CHIP_BONAIRE) {
+        switch (CIK__GB_TILE_MODE__MICRO_TILE_MODE_NEW(gb_tile_mode)) {
+        case CIK__MICRO_TILE_MODE__DISPLAY:
+            return surf_micro_display[bpe_log2];
+        case CIK__MICRO_TILE_MODE__THIN:
+        case CIK__MICRO_TILE_MODE__DEPTH:
+            return surf_micro_thin;
+        default:
+            return NULL;
+        }
+    }
+    switch (SI__GB_TILE_MODE__MICRO_TILE_MODE(gb_tile_mode)) {
+    case SI__MICRO_TILE_MODE__DISPLAY:
+        return surf_micro_display[bpe_log2];
+    case SI__MICRO_TILE_MODE__THIN:
+    case SI__MICRO_TILE_MODE__DEPTH:
+        return surf_micro_thin;
+    default:
+        return NULL;
+    }
+}
+
+static void surf_tile_plan_init(struct surf_tile_plan *plan,
+                                const uint8_t *order, unsigned bpe)
+{
+    uint8_t inv_x[64], inv_y[64];
+    unsigned x, y, i, index, run, e;
+
+    for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+            index = 0;
+            for (i = 0; i < 6; i++) {
+                unsigned coord = (order[i] & 4) ? y : x;
+
+                index |= ((coord >> (order[i] & 3)) & 1) << i;
+            }
+            plan->offset[y * 8 + x] = index * bpe;
+            inv_x[index] = x;
+            inv_y[index] = y;
+        }
+    }
+
+    /* leading x bits of the order give the contiguous run length */
+    run = 0;
+    while (run < 3 && order[run] == SURF_X(run)) {
+        run++;
+    }
+    plan->bpe = bpe;
+    plan->piece = MIN2(bpe << run, 16);
+    plan->npieces = 64 * bpe / plan->piece;
+    for (i = 0; i < plan->npieces; i++) {
+        e = i * plan->piece / bpe;
+        plan->piece_x[i] = inv_x[e];
+        plan->piece_y[i] = inv_y[e];
+    }
+}
+
+#define SURF_LINEAR(plan, linear, pitch, i) \
+    ((linear) + (plan)->piece_y[i] * (pitch) + (plan)->piece_x[i] * (plan)->bpe)
+
+static void surf_tile_micro(const struct surf_tile_plan *plan, uint8_t *tile,
+                            const uint8_t *linear, uint32_t pitch)
+{
+    unsigned i, n = plan->npieces;
+
+#if defined(__SSE2__)
+    if (plan->piece == 16) {
+        for (i = 0; i < n; i++) {
+            _mm_storeu_si128((__m128i *)(tile + 16 * i),
+                             _mm_loadu_si128((const __m128i *)SURF_LINEAR(plan, linear, pitch, i)));
+        }
+        return;
+    }
+    if (plan->piece == 8) {
+        for (i = 0; i < n; i += 2) {
+            __m128i lo = _mm_loadl_epi64((const __m128i *)SURF_LINEAR(plan, linear, pitch, i));
+            __m128i hi = _mm_loadl_epi64((const __m128i *)SURF_LINEAR(plan, linear, pitch, i + 1));
+
+            _mm_storeu_si128((__m128i *)(tile + 8 * i), _mm_unpacklo_epi64(lo, hi));
+        }
+        return;
+    }
+    if (plan->piece == 4) {
+        for (i = 0; i < n; i += 4) {
+            int32_t v[4];
+
+            memcpy(&v[0], SURF_LINEAR(plan, linear, pitch, i), 4);
+            memcpy(&v[1], SURF_LINEAR(plan, linear, pitch, i + 1), 4);
+            memcpy(&v[2], SURF_LINEAR(plan, linear, pitch, i + 2), 4);
+            memcpy(&v[3], SURF_LINEAR(plan, linear, pitch, i + 3), 4);
+            _mm_storeu_si128((__m128i *)(tile + 4 * i),
+                             _mm_unpacklo_epi64(_mm_unpacklo_epi32(_mm_cvtsi32_si128(v[0]),
+                                                                   _mm_cvtsi32_si128(v[1])),
+                                                _mm_unpacklo_epi32(_mm_cvtsi32_si128(v[2]),
+                                                                   _mm_cvtsi32_si128(v[3]))));
+        }
+        return;
+    }
+#elif defined(__ARM_NEON)
+    if (plan->piece == 16) {
+        for (i = 0; i < n; i++) {
+            vst1q_u8(tile + 16 * i, vld1q_u8(SURF_LINEAR(plan, linear, pitch, i)));
+        }
+        return;
+    }
+    if (plan->piece == 8) {
+        for (i = 0; i < n; i += 2) {
+            vst1q_u8(tile + 8 * i,
+                     vcombine_u8(vld1_u8(SURF_LINEAR(plan, linear, pitch, i)),
+                                 vld1_u8(SURF_LINEAR(plan, linear, pitch, i + 1))));
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++) {
+        memcpy(tile + plan->piece * i, SURF_LINEAR(plan, linear, pitch, i), plan->piece);
+    }
+}
+
+static void surf_untile_micro(const struct surf_tile_plan *plan, uint8_t *linear,
+                              uint32_t pitch, const uint8_t *tile)
+{
+    unsigned i, n = plan->npieces;
+
+#if defined(__SSE2__)
+    if (plan->piece == 16) {
+        for (i = 0; i < n; i++) {
+            _mm_storeu_si128((__m128i *)SURF_LINEAR(plan, linear, pitch, i),
+                             _mm_loadu_si128((const __m128i *)(tile + 16 * i)));
+        }
+        return;
+    }
+    if (plan->piece == 8) {
+        for (i = 0; i < n; i += 2) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(tile + 8 * i));
+
+            _mm_storel_epi64((__m128i *)SURF_LINEAR(plan, linear, pitch, i), v);
+            _mm_storel_epi64((__m128i *)SURF_LINEAR(plan, linear, pitch, i + 1),
+                             _mm_unpackhi_epi64(v, v));
+        }
+        return;
+    }
+    if (plan->piece == 4) {
+        for (i = 0; i < n; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(tile + 4 * i));
+            int32_t w[4];
+
+            w[0] = _mm_cvtsi128_si32(v);
+            w[1] = _mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+            w[2] = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+            w[3] = _mm_cvtsi128_si32(_mm_srli_si128(v, 12));
+            memcpy(SURF_LINEAR(plan, linear, pitch, i), &w[0], 4);
+            memcpy(SURF_LINEAR(plan, linear, pitch, i + 1), &w[1], 4);
+            memcpy(SURF_LINEAR(plan, linear, pitch, i + 2), &w[2], 4);
+            memcpy(SURF_LINEAR(plan, linear, pitch, i + 3), &w[3], 4);
+        }
+        return;
+    }
+#elif defined(__ARM_NEON)
+    if (plan->piece == 16) {
+        for (i = 0; i < n; i++) {
+            vst1q_u8(SURF_LINEAR(plan, linear, pitch, i), vld1q_u8(tile + 16 * i));
+        }
+        return;
+    }
+    if (plan->piece == 8) {
+        for (i = 0; i < n; i += 2) {
+            uint8x16_t v = vld1q_u8(tile + 8 * i);
+
+            vst1_u8(SURF_LINEAR(plan, linear, pitch, i), vget_low_u8(v));
+            vst1_u8(SURF_LINEAR(plan, linear, pitch, i + 1), vget_high_u8(v));
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++) {
+        memcpy(SURF_LINEAR(plan, linear, pitch, i), tile + plan->piece * i, plan->piece);
+    }
+}
+
+/*
+ * 2D tiled levels on evergreen and cayman group micro tiles into macro
+ * tiles spread over all pipes and banks, bankw x bankh micro tiles per pipe
+ * and bank.  A micro tile larger than the tile split is cut into slice_pt
+ * pieces stored in consecutive slices.  Offsets are computed as if the
+ * level lived in a single pipe and bank, then the pipe and bank of the
+ * micro tile are inserted above the group_bytes pipe interleave; a micro
+ * tile thus moves as one or more chunks that are contiguous in memory.
+ */
+struct surf_macro_plan {
+    unsigned    pipes;
+    unsigned    banks;
+    unsigned    bankw;
+    unsigned    bankh;
+    unsigned    group_log2;
+    unsigned    pipe_bank_log2;
+    unsigned    mtilew;
+    unsigned    mtileh;
+    unsigned    mtile_pr;
+    /* bytes of a micro tile piece after the tile split */
+    unsigned    tileb;
+    unsigned    slice_pt;
+    /* bytes of a macro tile, and of one split slice of the level */
+    uint64_t    mtileb;
+    uint64_t    slice_bytes;
+    /* bytes of a micro tile that stay contiguous */
+    unsigned    chunk;
+};
+
+static int surf_macro_plan_init(struct radeon_surface_manager *surf_man,
+                                const struct radeon_surface *surf,
+                                const struct radeon_surface_level *lvl,
+                                struct surf_macro_plan *plan)
+{
+    unsigned tileb = 64 * surf->bpe;
+
+    /* SI and CIK take the pipe layout from the pipe config of the tile
+     * mode and r6xx uses another macro tile layout: not handled yet */
+    if (surf_man->family < CHIP_CEDAR || surf_man->family > CHIP_ARUBA) {
+        return -EINVAL;
+    }
+    if (!surf->bankw || !surf->bankh || !surf->mtilea || !surf->tile_split) {
+        return -EINVAL;
+    }
+    plan->pipes = surf_man->hw_info.num_pipes;
+    plan->banks = surf_man->hw_info.num_banks;
+    plan->bankw = surf->bankw;
+    plan->bankh = surf->bankh;
+    plan->group_log2 = log2_int(surf_man->hw_info.group_bytes);
+    plan->pipe_bank_log2 = log2_int(plan->pipes) + log2_int(plan->banks);
+    plan->slice_pt = 1;
+    if (tileb > surf->tile_split) {
+        plan->slice_pt = tileb / surf->tile_split;
+    }
+    plan->tileb = tileb / plan->slice_pt;
+    plan->mtilew = 8 * plan->bankw * plan->pipes * surf->mtilea;
+    plan->mtileh = 8 * plan->bankh * plan->banks / surf->mtilea;
+    if (lvl->nblk_x % plan->mtilew || lvl->nblk_y % plan->mtileh) {
+        return -EINVAL;
+    }
+    plan->mtile_pr = lvl->nblk_x / plan->mtilew;
+    plan->mtileb = (uint64_t)plan->bankw * plan->bankh * plan->tileb << plan->pipe_bank_log2;
+    plan->slice_bytes = plan->mtileb * plan->mtile_pr * (lvl->nblk_y / plan->mtileh);
+    if (plan->slice_bytes * plan->slice_pt != lvl->slice_size) {
+        return -EINVAL;
+    }
+    plan->chunk = MIN2(plan->tileb, surf_man->hw_info.group_bytes);
+    return 0;
+}
+
+/* pipe of micro tile (tx, ty) */
+static unsigned eg_pipe(unsigned pipes, unsigned tx, unsigned ty)
+{
+    unsigned x3 = tx & 1, x4 = (tx >> 1) & 1, x5 = (tx >> 2) & 1;
+    unsigned y3 = ty & 1, y4 = (ty >> 1) & 1, y5 = (ty >> 2) & 1;
+
+    switch (pipes) {
+    case 2:
+        return x3 ^ y3;
+    case 4:
+        return (x3 ^ y4) | (x4 ^ y3) << 1;
+    case 8:
+        return (x5 ^ y3) | (x4 ^ x5 ^ y4) << 1 | (x3 ^ y5) << 2;
+    default:
+        return 0;
+    }
+}
+
+/* bank of micro tile (tx, ty), before the slice rotations */
+static unsigned eg_bank(const struct surf_macro_plan *plan,
+                        unsigned tx, unsigned ty)
+{
+    unsigned bx = tx / (plan->bankw * plan->pipes), by = ty / plan->bankh;
+    unsigned x3 = bx & 1, x4 = (bx >> 1) & 1, x5 = (bx >> 2) & 1, x6 = (bx >> 3) & 1;
+    unsigned y3 = by & 1, y4 = (by >> 1) & 1, y5 = (by >> 2) & 1, y6 = (by >> 3) & 1;
+
+    switch (plan->banks) {
+    case 2:
+        return x3 ^ y3;
+    case 4:
+        return (x3 ^ y4) | (x4 ^ y3) << 1;
+    case 8:
+        return (x3 ^ y5) | (x4 ^ y4 ^ y5) << 1 | (x5 ^ y3) << 2;
+    case 16:
+        return (x3 ^ y6) | (x4 ^ y5 ^ y6) << 1 | (x5 ^ y4) << 2 | (x6 ^ y3) << 3;
+    default:
+        return 0;
     }
-    return surf_man->surface_best(surf_man, surf);
+}
+
+/* address, from the start of the level, of byte offset in micro tile
+ * (tx, ty) of the given slice */
+static uint64_t surf_macro_address(const struct surf_macro_plan *plan,
+                                   unsigned tx, unsigned ty, unsigned layer,
+                                   unsigned offset)
+{
+    unsigned split = offset / plan->tileb;
+    unsigned tile_index, pipe, bank;
+    uint64_t total;
+
+    tile_index = (ty % plan->bankh) * plan->bankw + (tx / plan->pipes) % plan->bankw;
+    total = ((uint64_t)layer * plan->slice_pt + split) * plan->slice_bytes;
+    total += ((uint64_t)(ty * 8 / plan->mtileh) * plan->mtile_pr +
+              tx * 8 / plan->mtilew) * plan->mtileb;
+    total >>= plan->pipe_bank_log2;
+    total += tile_index * plan->tileb + offset % plan->tileb;
+
+    pipe = eg_pipe(plan->pipes, tx, ty);
+    bank = eg_bank(plan, tx, ty);
+    bank ^= (plan->banks / 2 - 1) * layer;
+    bank ^= (plan->banks / 2 + 1) * split;
+    bank &= plan->banks - 1;
+
+    return (total & ((1 << plan->group_log2) - 1)) |
+           (uint64_t)(pipe | bank << log2_int(plan->pipes)) << plan->group_log2 |
+           (total >> plan->group_log2) << (plan->group_log2 + plan->pipe_bank_log2);
+}
+
+static int surf_tile_copy(struct radeon_surface_manager *surf_man,
+                          const struct radeon_surface *surf,
+                          unsigned level, unsigned layer,
+                          uint8_t *tiled, uint8_t *linear,
+                          uint32_t linear_pitch, int untile)
+{
+    const struct radeon_surface_level *lvl;
+    const uint8_t *order;
+    struct surf_tile_plan plan;
+    struct surf_macro_plan mplan = {};
+    unsigned bpe = surf->bpe, bpe_log2, w, h, x, y, tx, ty, tiles_per_row;
+    unsigned chunk, nchunks, i, o;
+    uint64_t chunk_addr[16];
+    uint8_t *base, *tile, *lin;
+    uint8_t tmp[64 * 16];
+
+    if (surf_man == NULL || surf == NULL || tiled == NULL || linear == NULL) {
+        return -EINVAL;
+    }
+    if (level > surf->last_level || level >= RADEON_SURF_MAX_LEVEL) {
+        return -EINVAL;
+    }
+    lvl = &surf->level[level];
+    if (surf->nsamples != 1 || layer >= lvl->nblk_z * surf->array_size) {
+        return -EINVAL;
+    }
+    switch (bpe) {
+    case 1: bpe_log2 = 0; break;
+    case 2: bpe_log2 = 1; break;
+    case 4: bpe_log2 = 2; break;
+    case 8: bpe_log2 = 3; break;
+    case 16: bpe_log2 = 4; break;
+    default:
+        return -EINVAL;
+    }
+    w = (lvl->npix_x + surf->blk_w - 1) / surf->blk_w;
+    h = (lvl->npix_y + surf->blk_h - 1) / surf->blk_h;
+    if (linear_pitch < w * bpe) {
+        return -EINVAL;
+    }
+    base = tiled + lvl->offset + (uint64_t)layer * lvl->slice_size;
+
+    switch (lvl->mode) {
+    case RADEON_SURF_MODE_LINEAR:
+    case RADEON_SURF_MODE_LINEAR_ALIGNED:
+        for (y = 0; y < h; y++) {
+            if (untile) {
+                memcpy(linear + (size_t)y * linear_pitch, base + (size_t)y * lvl->pitch_bytes, w * bpe);
+            } else {
+                memcpy(base + (size_t)y * lvl->pitch_bytes, linear + (size_t)y * linear_pitch, w * bpe);
+            }
+        }
+        return 0;
+    case RADEON_SURF_MODE_1D:
+        chunk = 64 * bpe;
+        break;
+    case RADEON_SURF_MODE_2D:
+        if (surf_macro_plan_init(surf_man, surf, lvl, &mplan)) {
+            return -EINVAL;
+        }
+        /* the layer is part of the macro tile address */
+        base = tiled + lvl->offset;
+        chunk = mplan.chunk;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    order = surf_micro_order(surf_man, surf, level, bpe_log2);
+    if (order == NULL || lvl->nblk_x % 8) {
+        return -EINVAL;
+    }
+    surf_tile_plan_init(&plan, order, bpe);
+    tiles_per_row = lvl->nblk_x / 8;
+    nchunks = 64 * bpe / chunk;
+
+    for (ty = 0; ty < h; ty += 8) {
+        for (tx = 0; tx < w; tx += 8) {
+            if (lvl->mode == RADEON_SURF_MODE_1D) {
+                chunk_addr[0] = ((uint64_t)(ty / 8) * tiles_per_row + tx / 8) * 64 * bpe;
+            } else {
+                for (i = 0; i < nchunks; i++) {
+                    chunk_addr[i] = surf_macro_address(&mplan, tx / 8, ty / 8,
+                                                       layer, i * chunk);
+                }
+            }
+            lin = linear + (size_t)ty * linear_pitch + tx * bpe;
+            if (tx + 8 <= w && ty + 8 <= h) {
+                /* a split micro tile goes through tmp in tiled order */
+                tile = nchunks == 1 ? base + chunk_addr[0] : tmp;
+                if (untile) {
+                    for (i = 0; nchunks > 1 && i < nchunks; i++) {
+                        memcpy(tmp + i * chunk, base + chunk_addr[i], chunk);
+                    }
+                    surf_untile_micro(&plan, lin, linear_pitch, tile);
+                } else {
+                    surf_tile_micro(&plan, tile, lin, linear_pitch);
+                    for (i = 0; nchunks > 1 && i < nchunks; i++) {
+                        memcpy(base + chunk_addr[i], tmp + i * chunk, chunk);
+                    }
+                }
+                continue;
+            }
+            /* partial tile on the right or bottom edge */
+            for (y = 0; y < 8 && ty + y < h; y++) {
+                for (x = 0; x < 8 && tx + x < w; x++) {
+                    o = plan.offset[y * 8 + x];
+                    tile = base + chunk_addr[o / chunk] + o % chunk;
+                    if (untile) {
+                        memcpy(lin + y * linear_pitch + x * bpe, tile, bpe);
+                    } else {
+                        memcpy(tile, lin + y * linear_pitch + x * bpe, bpe);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+drm_public int
+radeon_surface_tile(struct radeon_surface_manager *surf_man,
+                    const struct radeon_surface *surf,
+                    unsigned level, unsigned layer,
+                    void *tiled, const void *linear, uint32_t linear_pitch)
+{
+    return surf_tile_copy(surf_man, surf, level, layer, tiled,
+                          (uint8_t *)linear, linear_pitch, 0);
+}
+
+drm_public int
+radeon_surface_untile(struct radeon_surface_manager *surf_man,
+                      const struct radeon_surface *surf,
+                      unsigned level, unsigned layer,
+                      void *linear, uint32_t linear_pitch, const void *tiled)
+{
+    return surf_tile_copy(surf_man, surf, level, layer, (uint8_t *)tiled,
+                          linear, linear_pitch, 1);
 }
@@ -141,9 +141,26 @@ struct radeon_surface {
 
 struct radeon_surface_manager *radeon_surface_manager_new(int fd);
 void radeon_surface_manager_free(struct radeon_surface_manager *surf_man);
+void radeon_surface_manager_get_cache_stats(struct radeon_surface_manager *surf_man,
+                                            uint64_t *hits, uint64_t *misses,
+                                            uint64_t *evictions);
 int radeon_surface_init(struct radeon_surface_manager *surf_man,
                         struct radeon_surface *surf);
 int radeon_surface_best(struct radeon_surface_manager *surf_man,
                         struct radeon_surface *surf);
 
+/* Copy one slice (array layer or depth slice) of a mip level from a linear
+ * buffer into the bo mapping that holds the surface, or back.  Linear and
+ * 1D tiled levels are supported, as are 2D tiled levels on evergreen and
+ * cayman; other 2D tiled levels return -EINVAL.
+ */
+int radeon_surface_tile(struct radeon_surface_manager *surf_man,
+                        const struct radeon_surface *surf,
+                        unsigned level, unsigned layer,
+                        void *tiled, const void *linear, uint32_t linear_pitch);
+int radeon_surface_untile(struct radeon_surface_manager *surf_man,
+                          const struct radeon_surface *surf,
+                          unsigned level, unsigned layer,
+                          void *linear, uint32_t linear_pitch, const void *tiled);
+
 #endif
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Measures draw call throughput through an immediate pushbuf, with the
+ * kernel submission done synchronously and on the submission thread of
+ * nouveau_pushbuf_set_async().
+ *
+ * No device is needed: ioctl() is overridden below.  A temporary file
+ * stands in for the drm fd so that bos can be mapped, and the pushbuf
+ * ioctl spins and/or sleeps for a given time per submission to stand in
+ * for the kernel's validation and relocation work.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "xf86drm.h"
+#include "nouveau_drm.h"
+#include "nouveau.h"
+
+#define NR_BOS 256
+
+static uint32_t next_handle = 1;
+static uint64_t next_map = 4096;
+static unsigned busy_us, sleep_us, submits;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+pushbuf_cost(void)
+{
+	struct timespec ts = { 0, sleep_us * 1000 };
+	double end = now() + busy_us * 1e-6;
+
+	while (now() < end)
+		;
+	if (sleep_us)
+		nanosleep(&ts, NULL);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	switch (DRM_IOCTL_NR(request)) {
+	case DRM_IOCTL_NR(DRM_IOCTL_VERSION):
+	{
+		struct drm_version *v = arg;
+		v->version_major = 1;
+		v->version_minor = 1;
+		v->version_patchlevel = 0;
+		if (v->name)
+			v->name[0] = v->date[0] = v->desc[0] = 'x';
+		v->name_len = v->date_len = v->desc_len = 1;
+		return 0;
+	}
+	case DRM_COMMAND_BASE + DRM_NOUVEAU_GETPARAM:
+	{
+		struct drm_nouveau_getparam *req = arg;
+		if (req->param == NOUVEAU_GETPARAM_CHIPSET_ID)
+			req->value = 0xe4;
+		else
+			req->value = 1ULL << 30;
+		return 0;
+	}
+	case DRM_COMMAND_BASE + DRM_NOUVEAU_CHANNEL_ALLOC:
+	{
+		struct drm_nouveau_channel_alloc *req = arg;
+		req->channel = 1;
+		req->pushbuf_domains = NOUVEAU_GEM_DOMAIN_GART;
+		return 0;
+	}
+	case DRM_COMMAND_BASE + DRM_NOUVEAU_GEM_NEW:
+	{
+		struct drm_nouveau_gem_new *req = arg;
+		req->info.handle = next_handle++;
+		req->info.map_handle = next_map;
+		req->info.offset = next_map;
+		next_map += (req->info.size + 4095) & ~4095ULL;
+		return 0;
+	}
+	case DRM_COMMAND_BASE + DRM_NOUVEAU_GEM_PUSHBUF:
+	{
+		struct drm_nouveau_gem_pushbuf *req = arg;
+		if (req->nr_push) {
+			pushbuf_cost();
+			submits++;
+		}
+		req->suffix0 = req->suffix1 = 0;
+		req->vram_available = req->gart_available = 1ULL << 30;
+		return 0;
+	}
+	default:
+		/* cpu prep, gem close... */
+		return 0;
+	}
+}
+
+static double
+run(struct nouveau_pushbuf *push, struct nouveau_bo **bos, unsigned draws,
+    unsigned per_kick)
+{
+	struct nouveau_pushbuf_refn refs[8];
+	double t0;
+	unsigned d, i;
+
+	t0 = now();
+	for (d = 0; d < draws; d++) {
+		/* a render target and some textures and buffers */
+		refs[0].bo = bos[0];
+		refs[0].flags = NOUVEAU_BO_VRAM | NOUVEAU_BO_WR;
+		for (i = 1; i < 8; i++) {
+			refs[i].bo = bos[1 + (d * 7 + i * 31) % (NR_BOS - 1)];
+			refs[i].flags = NOUVEAU_BO_VRAM | NOUVEAU_BO_RD;
+		}
+		if (nouveau_pushbuf_space(push, 64, 0, 0) ||
+		    nouveau_pushbuf_refn(push, refs, 8))
+			return -1;
+		for (i = 0; i < 48; i++)
+			*push->cur++ = d + i;
+		if ((d + 1) % per_kick == 0 &&
+		    nouveau_pushbuf_kick(push, push->channel))
+			return -1;
+	}
+	if (nouveau_pushbuf_kick(push, push->channel))
+		return -1;
+	/* what a client waiting on its last frame gets */
+	if (nouveau_bo_wait(bos[0], NOUVEAU_BO_RD, push->client))
+		return -1;
+	return now() - t0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n draws] [-k draws] [-b us] [-s us]\n", name);
+	fprintf(stderr, "  -n draws  number of draws (100000)\n");
+	fprintf(stderr, "  -k draws  draws per kick (100)\n");
+	fprintf(stderr, "  -b us     cpu time spent per pushbuf ioctl (0)\n");
+	fprintf(stderr, "  -s us     time slept per pushbuf ioctl (50)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct nouveau_device *dev;
+	struct nouveau_client *client;
+	struct nouveau_object *chan;
+	struct nouveau_pushbuf *push;
+	struct nouveau_bo *bos[NR_BOS] = {};
+	struct nve0_fifo nve0 = { .engine = NVE0_FIFO_ENGINE_GR };
+	unsigned draws = 100000, per_kick = 100, i;
+	double t;
+	FILE *file;
+	int c, async, ret = 0;
+
+	sleep_us = 50;
+	while ((c = getopt(argc, argv, "n:k:b:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			draws = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			per_kick = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			busy_us = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sleep_us = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!draws || !per_kick)
+		usage(argv[0]);
+
+	file = tmpfile();
+	if (!file || ftruncate(fileno(file), 1ULL << 30))
+		return 1;
+
+	if (nouveau_device_wrap(fileno(file), 0, &dev) ||
+	    nouveau_client_new(dev, &client))
+		return 1;
+	for (i = 0; i < NR_BOS; i++) {
+		if (nouveau_bo_new(dev, NOUVEAU_BO_VRAM, 0, 65536, NULL,
+				   &bos[i]))
+			return 1;
+	}
+
+	printf("%u draws, %u per kick, %u us busy + %u us asleep per submission\n",
+	       draws, per_kick, busy_us, sleep_us);
+	for (async = 0; async < 2; async++) {
+		if (nouveau_object_new(&dev->object, 0, NOUVEAU_FIFO_CHANNEL_CLASS,
+				       &nve0, sizeof(nve0), &chan) ||
+		    nouveau_pushbuf_new(client, chan, 4, 32 * 1024, true, &push))
+			return 1;
+		if (async && nouveau_pushbuf_set_async(push, true)) {
+			fprintf(stderr, "failed to enable async submission\n");
+			return 1;
+		}
+
+		submits = 0;
+		t = run(push, bos, draws, per_kick);
+		if (t < 0) {
+			fprintf(stderr, "draw failed\n");
+			ret = 1;
+		} else {
+			printf("%-6s: %8.0f draws/s, %u submissions\n",
+			       async ? "async" : "sync", draws / t, submits);
+		}
+
+		nouveau_pushbuf_del(&push);
+		nouveau_object_del(&chan);
+	}
+
+	for (i = 0; i < NR_BOS; i++)
+		nouveau_bo_ref(NULL, &bos[i]);
+	nouveau_client_del(&client);
+	nouveau_device_del(&dev);
+	fclose(file);
+	return ret;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+/*
+ * Replays cs captures written with CS_BOF_DUMP and reports, per capture, the
+ * userspace cost of building the cs (packet copy, space checks, relocation
+ * dedupe) and of emitting it.
+ *
+ * No device is needed: ioctl() is overridden below so that gem objects are
+ * bare handles and cs submission returns right away, which leaves only the
+ * libdrm_radeon side in the measurement.  Since bos cannot be mapped, their
+ * captured content is not uploaded.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "xf86drm.h"
+#include "radeon_drm.h"
+#include "radeon_cs.h"
+#include "radeon_cs_gem.h"
+#include "radeon_bo_gem.h"
+#include "radeon_cs_int.h"
+
+static uint32_t next_handle = 1;
+static int need_flush;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    switch (DRM_IOCTL_NR(request)) {
+    case DRM_COMMAND_BASE + DRM_RADEON_GEM_CREATE:
+        ((struct drm_radeon_gem_create *)arg)->handle = next_handle++;
+        return 0;
+    case DRM_COMMAND_BASE + DRM_RADEON_INFO:
+        /* let the cs manager use its defaults */
+        errno = EINVAL;
+        return -1;
+    default:
+        /* cs submission, gem close... */
+        return 0;
+    }
+}
+
+static void space_flush(void *data)
+{
+    need_flush = 1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n loops] capture.bof...\n", name);
+    fprintf(stderr, "  -n loops  number of times each capture is replayed (100)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct radeon_bo_manager *bom;
+    struct radeon_cs_manager *csm;
+    struct radeon_cs_replay **replays;
+    struct radeon_cs *cs;
+    double t0, t1, *build, *emit;
+    unsigned nframes, loops = 100, crelocs, i, l;
+    uint32_t ndw = 0;
+    int c, r, ret = 0;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            loops = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    nframes = argc - optind;
+    if (!nframes || !loops)
+        usage(argv[0]);
+
+    bom = radeon_bo_manager_gem_ctor(-1);
+    csm = radeon_cs_manager_gem_ctor(-1);
+    replays = calloc(nframes, sizeof(*replays));
+    build = calloc(nframes, sizeof(*build));
+    emit = calloc(nframes, sizeof(*emit));
+    if (bom == NULL || csm == NULL || !replays || !build || !emit)
+        return 1;
+
+    for (i = 0; i < nframes; i++) {
+        replays[i] = radeon_cs_replay_load(bom, argv[optind + i], 0);
+        if (replays[i] == NULL) {
+            fprintf(stderr, "failed to load %s\n", argv[optind + i]);
+            return 1;
+        }
+        if (radeon_cs_replay_ndw(replays[i]) > ndw)
+            ndw = radeon_cs_replay_ndw(replays[i]);
+    }
+    /* room for the padding done at emit */
+    cs = radeon_cs_create(csm, ndw + 8);
+    if (cs == NULL)
+        return 1;
+    radeon_cs_set_limit(cs, RADEON_GEM_DOMAIN_GTT, 1 << 30);
+    radeon_cs_set_limit(cs, RADEON_GEM_DOMAIN_VRAM, 1 << 30);
+    radeon_cs_space_set_flush(cs, space_flush, NULL);
+
+    for (l = 0; l < loops; l++) {
+        for (i = 0; i < nframes; i++) {
+            t0 = now();
+            r = radeon_cs_replay_build(replays[i], cs);
+            t1 = now();
+            if (r || need_flush) {
+                fprintf(stderr, "%s: replay failed (%d%s)\n", argv[optind + i],
+                        r, need_flush ? ", does not fit" : "");
+                return 1;
+            }
+            build[i] += t1 - t0;
+            crelocs = ((struct radeon_cs_int *)cs)->crelocs;
+            if (l == 0)
+                printf("%s: %u dwords, %u relocations\n",
+                       argv[optind + i], cs->cdw, crelocs);
+            t0 = now();
+            r = radeon_cs_emit(cs);
+            emit[i] += now() - t0;
+            radeon_cs_erase(cs);
+            if (r)
+                ret = 1;
+        }
+    }
+
+    t0 = t1 = 0;
+    for (i = 0; i < nframes; i++) {
+        printf("%s: build %8.2f us  emit %8.2f us\n", argv[optind + i],
+               build[i] / loops * 1e6, emit[i] / loops * 1e6);
+        t0 += build[i];
+        t1 += emit[i];
+    }
+    printf("average per frame: build %8.2f us  emit %8.2f us\n",
+           t0 / (loops * nframes) * 1e6, t1 / (loops * nframes) * 1e6);
+
+    radeon_cs_destroy(cs);
+    for (i = 0; i < nframes; i++)
+        radeon_cs_replay_free(replays[i]);
+    radeon_cs_manager_gem_dtor(csm);
+    radeon_bo_manager_gem_dtor(bom);
+    free(replays);
+    free(build);
+    free(emit);
+    return ret;
+}
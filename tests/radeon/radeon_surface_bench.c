@@ -0,0 +1,204 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+/*
+ * Times radeon_surface_best() + radeon_surface_init() on a texture heavy
+ * workload, with and without the surface manager layout cache, and checks
+ * that cached layouts are identical to freshly computed ones.
+ *
+ * The surface manager is built by hand from fixed hw info so that no device
+ * is needed, hence the surface code is compiled in directly.
+ */
+#include <time.h>
+#include "radeon_surface.c"
+
+struct shape {
+    unsigned w, h, bpe, type, mode, flags;
+};
+
+static const struct shape shapes[] = {
+    {   16,   16,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_1D, 0 },
+    {   64,   64,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  128,  128,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  256,  256,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  512,  512,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    { 1024, 1024,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    { 2048, 2048,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  256,  256,  1, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  512,  256,  2, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    { 1024,  512,  8, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  256,  256, 16, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, 0 },
+    {  300,  200,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_1D, 0 },
+    {  128,  128,  4, RADEON_SURF_TYPE_CUBEMAP, RADEON_SURF_MODE_2D, 0 },
+    { 1920, 1080,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D, RADEON_SURF_SCANOUT },
+    { 1920, 1080,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_2D,
+      RADEON_SURF_ZBUFFER | RADEON_SURF_SBUFFER | RADEON_SURF_HAS_SBUFFER_MIPTREE },
+    {  640,  480,  4, RADEON_SURF_TYPE_2D, RADEON_SURF_MODE_LINEAR_ALIGNED, 0 },
+};
+
+#define NSHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+static void fill(struct radeon_surface *surf, const struct shape *s)
+{
+    unsigned size = s->w > s->h ? s->w : s->h;
+
+    memset(surf, 0, sizeof(*surf));
+    surf->npix_x = s->w;
+    surf->npix_y = s->h;
+    surf->npix_z = 1;
+    surf->blk_w = surf->blk_h = surf->blk_d = 1;
+    surf->array_size = 1;
+    surf->bpe = s->bpe;
+    surf->nsamples = 1;
+    surf->last_level = 0;
+    while (size >>= 1)
+        surf->last_level++;
+    surf->flags = RADEON_SURF_SET(s->type, TYPE) |
+                  RADEON_SURF_SET(s->mode, MODE) | s->flags;
+}
+
+/* what radeon_surface_best + radeon_surface_init did before the cache */
+static int compute(struct radeon_surface_manager *surf_man,
+                   struct radeon_surface *surf)
+{
+    unsigned type = RADEON_SURF_GET(surf->flags, TYPE);
+    unsigned mode = RADEON_SURF_GET(surf->flags, MODE);
+    int r;
+
+    r = radeon_surface_sanity(surf_man, surf, type, mode);
+    if (r)
+        return r;
+    r = surf_man->surface_best(surf_man, surf);
+    if (r)
+        return r;
+    type = RADEON_SURF_GET(surf->flags, TYPE);
+    mode = RADEON_SURF_GET(surf->flags, MODE);
+    r = radeon_surface_sanity(surf_man, surf, type, mode);
+    if (r)
+        return r;
+    return surf_man->surface_init(surf_man, surf);
+}
+
+static int compute_cached(struct radeon_surface_manager *surf_man,
+                          struct radeon_surface *surf)
+{
+    int r;
+
+    r = radeon_surface_best(surf_man, surf);
+    if (r)
+        return r;
+    return radeon_surface_init(surf_man, surf);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench(const char *name, struct radeon_surface_manager *surf_man)
+{
+    struct radeon_surface a, b;
+    uint64_t hits, misses, evictions;
+    unsigned i, n = 200000;
+    double t0, t_plain, t_cached;
+    int r1, r2;
+
+    /* cached layouts must be bit identical to computed ones */
+    for (i = 0; i < 2 * NSHAPES; i++) {
+        fill(&a, &shapes[i % NSHAPES]);
+        fill(&b, &shapes[i % NSHAPES]);
+        r1 = compute(surf_man, &a);
+        r2 = compute_cached(surf_man, &b);
+        if (r1 != r2 || memcmp(&a, &b, sizeof(a))) {
+            fprintf(stderr, "%s: shape %u differs (%d vs %d)\n",
+                    name, (unsigned)(i % NSHAPES), r1, r2);
+            return -1;
+        }
+    }
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        fill(&a, &shapes[i % NSHAPES]);
+        compute(surf_man, &a);
+    }
+    t_plain = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        fill(&a, &shapes[i % NSHAPES]);
+        compute_cached(surf_man, &a);
+    }
+    t_cached = now() - t0;
+
+    radeon_surface_manager_get_cache_stats(surf_man, &hits, &misses, &evictions);
+    printf("%-9s uncached %7.1f ns  cached %7.1f ns  "
+           "(hits %llu, misses %llu, evictions %llu)\n", name,
+           t_plain / n * 1e9, t_cached / n * 1e9,
+           (unsigned long long)hits, (unsigned long long)misses,
+           (unsigned long long)evictions);
+    return 0;
+}
+
+static struct radeon_surface_manager *synthetic(unsigned family)
+{
+    struct radeon_surface_manager *surf_man;
+
+    surf_man = calloc(1, sizeof(struct radeon_surface_manager));
+    if (surf_man == NULL)
+        return NULL;
+    pthread_mutex_init(&surf_man->cache_mutex, NULL);
+    surf_man->fd = -1;
+    surf_man->family = family;
+    surf_man->hw_info.group_bytes = 256;
+    surf_man->hw_info.num_banks = 8;
+    surf_man->hw_info.num_pipes = family <= CHIP_RV740 ? 4 : 8;
+    surf_man->hw_info.row_size = 2048;
+    surf_man->hw_info.allow_2d = 1;
+    if (family <= CHIP_RV740) {
+        surf_man->surface_init = &r6_surface_init;
+        surf_man->surface_best = &r6_surface_best;
+    } else {
+        surf_man->surface_init = &eg_surface_init;
+        surf_man->surface_best = &eg_surface_best;
+    }
+    return surf_man;
+}
+
+int main(int argc, char **argv)
+{
+    struct radeon_surface_manager *surf_man;
+    int ret = 0;
+
+    surf_man = synthetic(CHIP_RV770);
+    if (surf_man == NULL || bench("rv770", surf_man))
+        ret = 1;
+    radeon_surface_manager_free(surf_man);
+
+    surf_man = synthetic(CHIP_CAYMAN);
+    if (surf_man == NULL || bench("cayman", surf_man))
+        ret = 1;
+    radeon_surface_manager_free(surf_man);
+    return ret;
+}
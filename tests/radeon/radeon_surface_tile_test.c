@@ -0,0 +1,409 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+/*
+ * Checks radeon_surface_tile() and radeon_surface_untile() against a plain
+ * per element address function for every level and layer of a set of
+ * surfaces, on r6xx, evergreen, SI and CIK, and with 2D tiling on
+ * evergreen and cayman.  The tiled image must match the
+ * one built by the reference byte for byte, and untiling must give back the
+ * original linear data.
+ *
+ * The surface managers are built by hand from fixed hw info so that no
+ * device is needed, hence the surface code is compiled in directly.
+ */
+#include "radeon_surface.c"
+
+struct shape {
+    unsigned w, h, array_size, bpe, mode, flags;
+    unsigned bankw, bankh, mtilea, tile_split;
+};
+
+static const struct shape shapes[] = {
+    {   64,   64, 1,  1, RADEON_SURF_MODE_1D, 0 },
+    {   64,   64, 1,  2, RADEON_SURF_MODE_1D, 0 },
+    {   64,   64, 1,  4, RADEON_SURF_MODE_1D, 0 },
+    {   64,   64, 1,  8, RADEON_SURF_MODE_1D, 0 },
+    {   64,   64, 1, 16, RADEON_SURF_MODE_1D, 0 },
+    {  100,   37, 3,  1, RADEON_SURF_MODE_1D, 0 },
+    {  100,   37, 3,  2, RADEON_SURF_MODE_1D, 0 },
+    {  100,   37, 3,  4, RADEON_SURF_MODE_1D, 0 },
+    {  100,   37, 3,  8, RADEON_SURF_MODE_1D, 0 },
+    {  100,   37, 3, 16, RADEON_SURF_MODE_1D, 0 },
+    {  200,  120, 1,  2, RADEON_SURF_MODE_1D, RADEON_SURF_SCANOUT },
+    {  200,  120, 1,  4, RADEON_SURF_MODE_1D, RADEON_SURF_SCANOUT },
+    {  120,   90, 1,  4, RADEON_SURF_MODE_1D, RADEON_SURF_ZBUFFER },
+    {   77,   50, 2,  4, RADEON_SURF_MODE_LINEAR_ALIGNED, 0 },
+};
+
+#define NSHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+/* small levels fall back to 1D, bpe 8 and 16 use the tile split */
+static const struct shape shapes_2d[] = {
+    {  256,  256, 1,  1, RADEON_SURF_MODE_2D, 0, 2, 4, 2, 1024 },
+    {  200,  160, 2,  2, RADEON_SURF_MODE_2D, 0, 1, 4, 1, 2048 },
+    {  256,  128, 1,  4, RADEON_SURF_MODE_2D, 0, 2, 1, 4, 4096 },
+    {  130,   70, 3,  8, RADEON_SURF_MODE_2D, 0, 1, 2, 2,  256 },
+    {   96,   64, 1, 16, RADEON_SURF_MODE_2D, 0, 1, 1, 1,  512 },
+    {  120,   90, 1,  4, RADEON_SURF_MODE_2D, RADEON_SURF_ZBUFFER, 1, 2, 1, 256 },
+};
+
+#define NSHAPES_2D (sizeof(shapes_2d) / sizeof(shapes_2d[0]))
+
+static unsigned levels_2d;
+
+static void fill(struct radeon_surface *surf, const struct shape *s)
+{
+    unsigned size = s->w > s->h ? s->w : s->h;
+
+    memset(surf, 0, sizeof(*surf));
+    surf->npix_x = s->w;
+    surf->npix_y = s->h;
+    surf->npix_z = 1;
+    surf->blk_w = surf->blk_h = surf->blk_d = 1;
+    surf->array_size = s->array_size;
+    surf->bpe = s->bpe;
+    surf->nsamples = 1;
+    surf->bankw = s->bankw;
+    surf->bankh = s->bankh;
+    surf->mtilea = s->mtilea;
+    surf->tile_split = s->tile_split;
+    surf->last_level = 0;
+    while (size >>= 1)
+        surf->last_level++;
+    surf->flags = RADEON_SURF_SET(s->array_size > 1 ? RADEON_SURF_TYPE_2D_ARRAY :
+                                  RADEON_SURF_TYPE_2D, TYPE) |
+                  RADEON_SURF_SET(s->mode, MODE) | s->flags |
+                  RADEON_SURF_HAS_TILE_MODE_INDEX;
+}
+
+/* element index inside an 8x8 micro tile, as documented for the hw */
+static unsigned ref_pixel_index(unsigned x, unsigned y, unsigned bpe,
+                                int display)
+{
+    unsigned x0 = x & 1, x1 = (x >> 1) & 1, x2 = (x >> 2) & 1;
+    unsigned y0 = y & 1, y1 = (y >> 1) & 1, y2 = (y >> 2) & 1;
+
+    if (!display)
+        return x0 | y0 << 1 | x1 << 2 | y1 << 3 | x2 << 4 | y2 << 5;
+    switch (bpe) {
+    case 1:
+        return x0 | x1 << 1 | x2 << 2 | y1 << 3 | y0 << 4 | y2 << 5;
+    case 2:
+        return x0 | x1 << 1 | x2 << 2 | y0 << 3 | y1 << 4 | y2 << 5;
+    case 4:
+        return x0 | x1 << 1 | y0 << 2 | x2 << 3 | y1 << 4 | y2 << 5;
+    case 8:
+        return x0 | y0 << 1 | x1 << 2 | x2 << 3 | y1 << 4 | y2 << 5;
+    default:
+        return y0 | x0 << 1 | x1 << 2 | x2 << 3 | y1 << 4 | y2 << 5;
+    }
+}
+
+#define BIT(v, n) (((v) >> (n)) & 1)
+
+/* evergreen 2D tiled address: offset within one pipe and bank, spread
+ * over the pipes and banks every group_bytes */
+static uint64_t ref_address_2d(const struct radeon_surface_manager *surf_man,
+                               const struct radeon_surface *surf, unsigned level,
+                               unsigned layer, unsigned x, unsigned y, int display)
+{
+    const struct radeon_surface_level *lvl = &surf->level[level];
+    unsigned pipes = surf_man->hw_info.num_pipes;
+    unsigned banks = surf_man->hw_info.num_banks;
+    unsigned group = surf_man->hw_info.group_bytes;
+    unsigned tile_bytes = 64 * surf->bpe, splits = 1;
+    unsigned mtilew, mtileh, elem, split, tile_index, pipe = 0, bank = 0;
+    unsigned bx, by;
+    uint64_t mtile_bytes, slice_bytes, total;
+
+    if (tile_bytes > surf->tile_split) {
+        splits = tile_bytes / surf->tile_split;
+        tile_bytes = surf->tile_split;
+    }
+    mtilew = 8 * surf->bankw * pipes * surf->mtilea;
+    mtileh = 8 * surf->bankh * banks / surf->mtilea;
+    mtile_bytes = (uint64_t)(mtilew / 8) * (mtileh / 8) * tile_bytes;
+    slice_bytes = (uint64_t)(lvl->nblk_x / mtilew) * (lvl->nblk_y / mtileh) * mtile_bytes;
+
+    elem = ref_pixel_index(x % 8, y % 8, surf->bpe, display) * surf->bpe;
+    split = elem / tile_bytes;
+    elem %= tile_bytes;
+
+    total = ((uint64_t)layer * splits + split) * slice_bytes +
+            ((uint64_t)(y / mtileh) * (lvl->nblk_x / mtilew) + x / mtilew) * mtile_bytes;
+    total /= pipes * banks;
+    tile_index = (y / 8 % surf->bankh) * surf->bankw + x / 8 / pipes % surf->bankw;
+    total += tile_index * tile_bytes + elem;
+
+    switch (pipes) {
+    case 2:
+        pipe = BIT(x, 3) ^ BIT(y, 3);
+        break;
+    case 4:
+        pipe = (BIT(x, 3) ^ BIT(y, 4)) | (BIT(x, 4) ^ BIT(y, 3)) << 1;
+        break;
+    case 8:
+        pipe = (BIT(x, 5) ^ BIT(y, 3)) | (BIT(x, 4) ^ BIT(x, 5) ^ BIT(y, 4)) << 1 |
+               (BIT(x, 3) ^ BIT(y, 5)) << 2;
+        break;
+    }
+    bx = x / (8 * surf->bankw * pipes);
+    by = y / (8 * surf->bankh);
+    switch (banks) {
+    case 4:
+        bank = (BIT(bx, 0) ^ BIT(by, 1)) | (BIT(bx, 1) ^ BIT(by, 0)) << 1;
+        break;
+    case 8:
+        bank = (BIT(bx, 0) ^ BIT(by, 2)) | (BIT(bx, 1) ^ BIT(by, 1) ^ BIT(by, 2)) << 1 |
+               (BIT(bx, 2) ^ BIT(by, 0)) << 2;
+        break;
+    case 16:
+        bank = (BIT(bx, 0) ^ BIT(by, 3)) | (BIT(bx, 1) ^ BIT(by, 2) ^ BIT(by, 3)) << 1 |
+               (BIT(bx, 2) ^ BIT(by, 1)) << 2 | (BIT(bx, 3) ^ BIT(by, 0)) << 3;
+        break;
+    }
+    /* rotated for each slice and each piece of a split tile */
+    bank ^= (banks / 2 - 1) * layer;
+    bank ^= (banks / 2 + 1) * split;
+    bank %= banks;
+
+    return lvl->offset + total % group + (uint64_t)(pipe + bank * pipes) * group +
+           total / group * group * pipes * banks;
+}
+
+static uint64_t ref_address(const struct radeon_surface_manager *surf_man,
+                            const struct radeon_surface *surf, unsigned level,
+                            unsigned layer, unsigned x, unsigned y, int display)
+{
+    const struct radeon_surface_level *lvl = &surf->level[level];
+    uint64_t addr = lvl->offset + (uint64_t)layer * lvl->slice_size;
+
+    if (lvl->mode == RADEON_SURF_MODE_2D)
+        return ref_address_2d(surf_man, surf, level, layer, x, y, display);
+    if (lvl->mode != RADEON_SURF_MODE_1D)
+        return addr + (uint64_t)y * lvl->pitch_bytes + x * surf->bpe;
+    addr += ((uint64_t)(y / 8) * (lvl->nblk_x / 8) + x / 8) * 64 * surf->bpe;
+    return addr + ref_pixel_index(x % 8, y % 8, surf->bpe, display) * surf->bpe;
+}
+
+static uint32_t seed = 1;
+
+static uint8_t next_byte(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+static int test_shape(const char *name, struct radeon_surface_manager *surf_man,
+                      const struct shape *s)
+{
+    struct radeon_surface surf;
+    uint8_t *tiled, *expect, *linear, *back;
+    unsigned level, layer, x, y, pitch;
+    int display, r, ret = 0;
+
+    fill(&surf, s);
+    r = radeon_surface_init(surf_man, &surf);
+    if (r) {
+        fprintf(stderr, "%s: %ux%u bpe %u: init failed %d\n",
+                name, s->w, s->h, s->bpe, r);
+        return -1;
+    }
+    if (surf_man->family <= CHIP_ARUBA)
+        display = !(surf.flags & RADEON_SURF_ZBUFFER);
+    else
+        display = !!(surf.flags & RADEON_SURF_SCANOUT);
+
+    pitch = s->w * s->bpe + 12;
+    tiled = malloc(surf.bo_size);
+    expect = malloc(surf.bo_size);
+    linear = malloc((size_t)pitch * s->h);
+    back = malloc((size_t)pitch * s->h);
+    if (!tiled || !expect || !linear || !back) {
+        ret = -1;
+        goto out;
+    }
+    memset(tiled, 0xcd, surf.bo_size);
+    memset(expect, 0xcd, surf.bo_size);
+
+    for (level = 0; level <= surf.last_level; level++) {
+        const struct radeon_surface_level *lvl = &surf.level[level];
+
+        if (lvl->mode == RADEON_SURF_MODE_2D)
+            levels_2d++;
+        for (layer = 0; layer < lvl->nblk_z * surf.array_size; layer++) {
+            for (y = 0; y < lvl->npix_y; y++)
+                for (x = 0; x < lvl->npix_x * s->bpe; x++)
+                    linear[y * pitch + x] = next_byte();
+            for (y = 0; y < lvl->npix_y; y++)
+                for (x = 0; x < lvl->npix_x; x++)
+                    memcpy(expect + ref_address(surf_man, &surf, level, layer, x, y, display),
+                           linear + y * pitch + x * s->bpe, s->bpe);
+
+            r = radeon_surface_tile(surf_man, &surf, level, layer,
+                                    tiled, linear, pitch);
+            memset(back, 0, (size_t)pitch * s->h);
+            if (!r)
+                r = radeon_surface_untile(surf_man, &surf, level, layer,
+                                          back, pitch, tiled);
+            if (r) {
+                fprintf(stderr, "%s: %ux%u bpe %u level %u layer %u: failed %d\n",
+                        name, s->w, s->h, s->bpe, level, layer, r);
+                ret = -1;
+                goto out;
+            }
+            for (y = 0; y < lvl->npix_y; y++) {
+                if (memcmp(back + y * pitch, linear + y * pitch, lvl->npix_x * s->bpe)) {
+                    fprintf(stderr, "%s: %ux%u bpe %u level %u layer %u: "
+                            "round trip differs at row %u\n",
+                            name, s->w, s->h, s->bpe, level, layer, y);
+                    ret = -1;
+                    goto out;
+                }
+            }
+        }
+    }
+    if (memcmp(tiled, expect, surf.bo_size)) {
+        fprintf(stderr, "%s: %ux%u bpe %u flags 0x%x: tiled image differs from reference\n",
+                name, s->w, s->h, s->bpe, s->flags);
+        ret = -1;
+    }
+
+out:
+    free(tiled);
+    free(expect);
+    free(linear);
+    free(back);
+    return ret;
+}
+
+/* r6xx macro tiling is not handled, its 2D levels must be rejected */
+static int test_2d(const char *name, struct radeon_surface_manager *surf_man)
+{
+    struct radeon_surface surf;
+    uint8_t *tiled, linear[4 * 256];
+    int r;
+
+    fill(&surf, &shapes[2]);
+    surf.npix_x = surf.npix_y = 256;
+    surf.last_level = 0;
+    surf.flags = RADEON_SURF_CLR(surf.flags, MODE) |
+                 RADEON_SURF_SET(RADEON_SURF_MODE_2D, MODE);
+    if (radeon_surface_init(surf_man, &surf) || surf.level[0].mode != RADEON_SURF_MODE_2D)
+        return 0;
+    tiled = malloc(surf.bo_size);
+    if (tiled == NULL)
+        return -1;
+    r = radeon_surface_tile(surf_man, &surf, 0, 0, tiled, linear, sizeof(linear));
+    free(tiled);
+    if (r != -EINVAL) {
+        fprintf(stderr, "%s: 2D tiled level not rejected (%d)\n", name, r);
+        return -1;
+    }
+    return 0;
+}
+
+static struct radeon_surface_manager *synthetic(unsigned family, unsigned num_pipes,
+                                                unsigned num_banks, unsigned group_bytes)
+{
+    struct radeon_surface_manager *surf_man;
+    uint32_t *tile_mode = NULL;
+
+    surf_man = calloc(1, sizeof(struct radeon_surface_manager));
+    if (surf_man == NULL)
+        return NULL;
+    pthread_mutex_init(&surf_man->cache_mutex, NULL);
+    surf_man->fd = -1;
+    surf_man->family = family;
+    surf_man->hw_info.group_bytes = group_bytes;
+    surf_man->hw_info.num_banks = num_banks;
+    surf_man->hw_info.num_pipes = num_pipes;
+    surf_man->hw_info.row_size = 2048;
+    surf_man->hw_info.allow_2d = 1;
+    if (family <= CHIP_RV740) {
+        surf_man->surface_init = &r6_surface_init;
+        surf_man->surface_best = &r6_surface_best;
+    } else if (family <= CHIP_ARUBA) {
+        surf_man->surface_init = &eg_surface_init;
+        surf_man->surface_best = &eg_surface_best;
+    } else if (family < CHIP_BONAIRE) {
+        surf_man->surface_init = &si_surface_init;
+        surf_man->surface_best = &si_surface_best;
+        tile_mode = surf_man->hw_info.tile_mode_array;
+        tile_mode[SI_TILE_MODE_COLOR_1D] = SI__MICRO_TILE_MODE__THIN;
+        tile_mode[SI_TILE_MODE_COLOR_1D_SCANOUT] = SI__MICRO_TILE_MODE__DISPLAY;
+        tile_mode[SI_TILE_MODE_DEPTH_STENCIL_1D] = SI__MICRO_TILE_MODE__DEPTH;
+    } else {
+        surf_man->surface_init = &cik_surface_init;
+        surf_man->surface_best = &cik_surface_best;
+        tile_mode = surf_man->hw_info.tile_mode_array;
+        tile_mode[SI_TILE_MODE_COLOR_1D] = CIK__MICRO_TILE_MODE__THIN << 22;
+        tile_mode[SI_TILE_MODE_COLOR_1D_SCANOUT] = CIK__MICRO_TILE_MODE__DISPLAY << 22;
+        tile_mode[CIK_TILE_MODE_DEPTH_STENCIL_1D] = CIK__MICRO_TILE_MODE__DEPTH << 22;
+    }
+    return surf_man;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        unsigned family, num_pipes, num_banks, group_bytes;
+    } chips[] = {
+        { "rv770", CHIP_RV770, 4, 8, 256 },
+        { "cedar", CHIP_CEDAR, 2, 4, 256 },
+        { "juniper", CHIP_JUNIPER, 4, 16, 512 },
+        { "cayman", CHIP_CAYMAN, 8, 8, 256 },
+        { "tahiti", CHIP_TAHITI, 8, 8, 256 },
+        { "bonaire", CHIP_BONAIRE, 8, 8, 256 },
+    };
+    struct radeon_surface_manager *surf_man;
+    unsigned i, j;
+    int ret = 0;
+
+    for (i = 0; i < sizeof(chips) / sizeof(chips[0]); i++) {
+        surf_man = synthetic(chips[i].family, chips[i].num_pipes,
+                             chips[i].num_banks, chips[i].group_bytes);
+        if (surf_man == NULL)
+            return 1;
+        for (j = 0; j < NSHAPES; j++) {
+            if (test_shape(chips[i].name, surf_man, &shapes[j]))
+                ret = 1;
+        }
+        if (chips[i].family <= CHIP_RV740 && test_2d(chips[i].name, surf_man))
+            ret = 1;
+        if (chips[i].family >= CHIP_CEDAR && chips[i].family <= CHIP_ARUBA) {
+            levels_2d = 0;
+            for (j = 0; j < NSHAPES_2D; j++) {
+                if (test_shape(chips[i].name, surf_man, &shapes_2d[j]))
+                    ret = 1;
+            }
+            if (!levels_2d) {
+                fprintf(stderr, "%s: no 2D tiled level tested\n", chips[i].name);
+                ret = 1;
+            }
+        }
+        radeon_surface_manager_free(surf_man);
+    }
+    return ret;
+}